@@ -12,14 +12,14 @@ endif()
 if(DoublePrec_CPU)
     # set fftw lib to use double precision
     set(libfft "fftw3")
-    set(ext_conf_flags_fft --enable-shared --prefix=${FFTW_EXTERNAL_PATH})
+    set(ext_conf_flags_fft --enable-shared --enable-threads --prefix=${FFTW_EXTERNAL_PATH})
     if(TARGET_X86)
         set(ext_conf_flags_fft ${ext_conf_flags_fft} --enable-sse2 --enable-avx)
     endif()
 else(DoublePrec_CPU)
     # set fftw lib to use single precision
     set(libfft "fftw3f")
-    set(ext_conf_flags_fft --enable-shared --enable-float --prefix=${FFTW_EXTERNAL_PATH})
+    set(ext_conf_flags_fft --enable-shared --enable-float --enable-threads --prefix=${FFTW_EXTERNAL_PATH})
     if(TARGET_X86)
         set(ext_conf_flags_fft ${ext_conf_flags_fft} --enable-sse --enable-avx)
     endif()
@@ -29,9 +29,14 @@ endif(DoublePrec_CPU)
 
 find_path(FFTW_INCLUDES     NAMES fftw3.h         PATHS ${FFTW_EXTERNAL_PATH}/include NO_DEFAULT_PATH) 
 find_library(FFTW_LIBRARIES NAMES ${libfft}       PATHS ${FFTW_EXTERNAL_PATH}/lib     NO_DEFAULT_PATH)
+find_library(FFTW_THREADS_LIBRARIES NAMES ${libfft}_threads PATHS ${FFTW_EXTERNAL_PATH}/lib NO_DEFAULT_PATH)
 
 if(FFTW_INCLUDES AND FFTW_LIBRARIES)
     set(FFTW_FOUND TRUE)
+    if(FFTW_THREADS_LIBRARIES)
+        set(FFTW_THREADS_FOUND TRUE)
+        list(APPEND FFTW_LIBRARIES ${FFTW_THREADS_LIBRARIES})
+    endif()
     message( STATUS "Found previously built external (non-system) FFTW library")
 else()
     set(FFTW_FOUND FALSE)
@@ -41,7 +46,9 @@ endif()
 
 if(NOT FFTW_FOUND)
 
-    set(FFTW_LIBRARIES ${FFTW_EXTERNAL_PATH}/lib/${CMAKE_SHARED_LIBRARY_PREFIX}${libfft}${CMAKE_SHARED_LIBRARY_SUFFIX})
+    set(FFTW_LIBRARIES ${FFTW_EXTERNAL_PATH}/lib/${CMAKE_SHARED_LIBRARY_PREFIX}${libfft}${CMAKE_SHARED_LIBRARY_SUFFIX}
+                       ${FFTW_EXTERNAL_PATH}/lib/${CMAKE_SHARED_LIBRARY_PREFIX}${libfft}_threads${CMAKE_SHARED_LIBRARY_SUFFIX})
+    set(FFTW_THREADS_FOUND TRUE)
     set(FFTW_PATH      "${FFTW_EXTERNAL_PATH}" )
     set(FFTW_INCLUDES  "${FFTW_EXTERNAL_PATH}/include" )
 
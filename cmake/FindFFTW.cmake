@@ -34,9 +34,20 @@ if(FFTW_PATH AND FFTW_INCLUDES AND FFTW_LIBRARIES)
    set(FFTW_FOUND TRUE)
 endif(FFTW_PATH AND FFTW_INCLUDES AND FFTW_LIBRARIES)
 
+# The threads library is optional: without it all FFTs are single-threaded
+unset(FFTW_THREADS_LIBRARIES CACHE)
+find_library(FFTW_THREADS_LIBRARIES  NAMES ${libfft}_threads PATHS ${LIB_PATHFFT} $ENV{FFTW_LIB} $ENV{FFTW_HOME} )
+if(FFTW_FOUND AND FFTW_THREADS_LIBRARIES)
+	set(FFTW_THREADS_FOUND TRUE)
+	list(APPEND FFTW_LIBRARIES ${FFTW_THREADS_LIBRARIES})
+endif(FFTW_FOUND AND FFTW_THREADS_LIBRARIES)
+
 if (FFTW_FOUND)
 	message(STATUS "Found FFTW: ${libfft}")
 	message(STATUS "FFTW_LIBRARIES: ${FFTW_LIBRARIES}")
+	if(NOT FFTW_THREADS_FOUND)
+		message(STATUS "FFTW threads library was NOT found: FFTs will be single-threaded")
+	endif(NOT FFTW_THREADS_FOUND)
 else(FFTW_FOUND)
 	if(DoublePrec_CPU)
 		message(STATUS "Double-precision FFTW was NOT found")
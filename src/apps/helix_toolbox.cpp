@@ -88,6 +88,9 @@ public:
 	// Number of helical asymmetrical units
 	int nr_asu;
 
+	// Number of threads (for imposing and local searches of helical symmetry)
+	int nr_threads;
+
 	// Rotational symmetry - Cn
 	int sym_Cn;
 
@@ -213,6 +216,7 @@ public:
 		fn_in_root = parser.getOption("--i_root", "Rootname of input files", "_rootnameIn.star");
 		fn_in1_root = parser.getOption("--i1_root", "Rootname #1 of input files", "_rootnameIn01.star");
 		fn_in2_root = parser.getOption("--i2_root", "Rootname #2 of input files", "_rootnameIn02.star");
+		nr_threads = textToInteger(parser.getOption("--j", "Number of threads (for imposing and local searches of helical symmetry)", "1"));
 		nr_asu = textToInteger(parser.getOption("--nr_asu", "Number of helical asymmetrical units", "1"));
 		nr_outfiles = textToInteger(parser.getOption("--nr_outfiles", "Number of output files", "10"));
 		nr_subunits = textToInteger(parser.getOption("--nr_subunits", "Number of helical subunits", "-1"));
@@ -546,7 +550,7 @@ public:
 			{
 				displayEmptyLine();
 				std::cout << " Impose helical symmetry (in real space)" << std::endl;
-				std::cout << "  USAGE: --impose --i in.mrc --o out.mrc (--cyl_inner_diameter -1) --cyl_outer_diameter 200 --angpix 1.126 --rise 1.408 --twist 22.03 (--z_percentage 0.3 --sphere_percentage 0.9 --width 5)" << std::endl;
+				std::cout << "  USAGE: --impose --i in.mrc --o out.mrc (--cyl_inner_diameter -1) --cyl_outer_diameter 200 --angpix 1.126 --rise 1.408 --twist 22.03 (--z_percentage 0.3 --sphere_percentage 0.9 --width 5) (--j 1)" << std::endl;
 				displayEmptyLine();
 				return;
 			}
@@ -571,7 +575,8 @@ public:
 					z_percentage,
 					rise_A,
 					twist_deg,
-					width_edge_pix);
+					width_edge_pix,
+					nr_threads);
 			img.write(fn_out);
 		}
 		else if (do_local_search_helical_symmetry)
@@ -580,7 +585,7 @@ public:
 			{
 				displayEmptyLine();
 				std::cout << " Local search of helical symmetry" << std::endl;
-				std::cout << "  USAGE: --search --i in.mrc (--cyl_inner_diameter -1) --cyl_outer_diameter 200 --angpix 1.126 --rise_min 1.3 --rise_max 1.5 (--rise_inistep -1) --twist_min 20 --twist_max 24 (--twist_inistep -1) (--z_percentage 0.3)" << std::endl;
+				std::cout << "  USAGE: --search --i in.mrc (--cyl_inner_diameter -1) --cyl_outer_diameter 200 --angpix 1.126 --rise_min 1.3 --rise_max 1.5 (--rise_inistep -1) --twist_min 20 --twist_max 24 (--twist_inistep -1) (--z_percentage 0.3) (--j 1)" << std::endl;
 				displayEmptyLine();
 				return;
 			}
@@ -610,7 +615,8 @@ public:
 					twist_min_deg,
 					twist_max_deg,
 					twist_inistep_deg,
-					twist_refined_deg);
+					twist_refined_deg,
+					nr_threads);
 			std::cout << " Refined helical rise = " << rise_refined_A << " Angstroms, twist = " << twist_refined_deg << " degrees." << std::endl;
 		}
 		else if (do_PDB_helix)
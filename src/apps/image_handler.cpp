@@ -29,7 +29,7 @@ class image_handler_parameters
 {
 	public:
    	FileName fn_in, fn_out, fn_sel, fn_img, fn_sym, fn_sub, fn_mult, fn_div, fn_add, fn_subtract, fn_fsc, fn_adjust_power, fn_correct_ampl;
-	int bin_avg, avg_first, avg_last, edge_x0, edge_xF, edge_y0, edge_yF, filter_edge_width, new_box, minr_ampl_corr;
+	int bin_avg, avg_first, avg_last, edge_x0, edge_xF, edge_y0, edge_yF, filter_edge_width, new_box, minr_ampl_corr, nr_threads;
     bool do_add_edge, do_flipXY, do_flipmXY, do_flipZ, do_flipX, do_flipY, do_shiftCOM, do_stats, do_avg_ampl, do_average, do_remove_nan;
 	RFLOAT multiply_constant, divide_constant, add_constant, subtract_constant, threshold_above, threshold_below, angpix, new_angpix, lowpass, highpass, bfactor, shift_x, shift_y, shift_z, replace_nan;
    	int verb;
@@ -46,6 +46,9 @@ class image_handler_parameters
 	int xdim, ydim, zdim;
 	long int ndim;
 
+	// Datatype of output MRC files
+	DataType write_datatype;
+
 	void usage()
 	{
 		parser.writeUsage(std::cerr);
@@ -110,22 +113,42 @@ class image_handler_parameters
 	    edge_y0 = textToInteger(parser.getOption("--edge_y0", "Pixel row to be used for the top edge", "0"));
 	    edge_xF = textToInteger(parser.getOption("--edge_xF", "Pixel column to be used for the right edge", "4095"));
 	    edge_yF = textToInteger(parser.getOption("--edge_yF", "Pixel row to be used for the bottom edge", "4095"));
+	    bool do_write_float16 = parser.checkOption("--float16", "Write output MRC files as 16-bit floats (mode 12)");
+	    bool do_write_4bit = parser.checkOption("--4bit", "Write output MRC files as packed 4-bit integers (mode 101, only for counting movies with values 0-15)");
 
 	    int avg_section = parser.addSection("Movie-frame averaging options");
        	bin_avg = textToInteger(parser.getOption("--avg_bin", "Width (in frames) for binning average, i.e. of every so-many frames", "-1"));
     	avg_first = textToInteger(parser.getOption("--avg_first", "First frame to include in averaging", "-1"));
     	avg_last = textToInteger(parser.getOption("--avg_last", "Last frame to include in averaging", "-1"));
 
+    	int expert_section = parser.addSection("Expert options");
+    	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to use for FFTs of 3D maps", "1"));
+
     	// Check for errors in the command-line option
     	if (parser.checkForErrors())
     		REPORT_ERROR("Errors encountered on the command line (see above), exiting...");
 
+    	if (do_write_float16 && do_write_4bit)
+    		REPORT_ERROR("Please provide only one of --float16 and --4bit");
+    	write_datatype = (do_write_float16) ? Float16 : ((do_write_4bit) ? UInt4 : Unknown_Type);
+
+    	// All FFTs in this program are done one at a time
+    	setFftwDefaultThreads(nr_threads);
+    	transformer.setThreads(nr_threads);
+
     	verb = (do_stats || fn_fsc !="") ? 0 : 1;
 
 	}
 
 
 
+	// 16-bit float and 4-bit output only exist for MRC files
+	void checkWriteDatatype(const FileName &fn_write)
+	{
+		if (write_datatype != Unknown_Type && !fn_write.getFileFormat().contains("mrc"))
+			REPORT_ERROR("ERROR: --float16 and --4bit can only be used to write MRC files (.mrc or .mrcs), not " + fn_write);
+	}
+
 	void perImageOperations(Image<RFLOAT> &Iin, FileName &my_fn_out)
 	{
 
@@ -418,6 +441,7 @@ class image_handler_parameters
 		FileName fn_tmp;
 		my_fn_out.decompose(n, fn_tmp);
 		n--;
+		checkWriteDatatype(fn_tmp);
 		if (n >= 0) // This is a stack...
 		{
 
@@ -430,13 +454,13 @@ class image_handler_parameters
 			{
 				// The following assumes the images in the stack come ordered...
 				if (n == 0)
-					Iout.write(fn_tmp, n, true, WRITE_OVERWRITE); // make a new stack
+					Iout.write(fn_tmp, n, true, WRITE_OVERWRITE, write_datatype); // make a new stack
 				else
 					Iout.write(fn_tmp, n, true, WRITE_APPEND);
 			}
 		}
 		else
-			Iout.write(my_fn_out);
+			Iout.write(my_fn_out, -1, false, WRITE_OVERWRITE, write_datatype);
 
 	}
 
@@ -627,7 +651,8 @@ class image_handler_parameters
 						}
 					}
 				}
-				Iavg.write(fn_out);
+				checkWriteDatatype(fn_out);
+				Iavg.write(fn_out, -1, false, WRITE_OVERWRITE, write_datatype);
 			}
 			else
 			{
@@ -659,7 +684,8 @@ class image_handler_parameters
 		{
 			avg_ampl /= (RFLOAT)i_img;
 			Iout() = avg_ampl;
-			Iout.write(fn_out);
+			checkWriteDatatype(fn_out);
+			Iout.write(fn_out, -1, false, WRITE_OVERWRITE, write_datatype);
 		}
 
 		if (verb > 0)
@@ -0,0 +1,151 @@
+/***************************************************************************
+ *
+ * Author: "Sjors H.W. Scheres"
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <src/image.h>
+#include <src/exp_model.h>
+#include <src/args.h>
+#include <src/error.h>
+
+// Pack all particles of a STAR file into a single MRC stack, in the order of the original particles in the Experiment
+// Image i of the packed stack is at byte offset 1024 + i * (4 * XSIZE * YSIZE), so that refine reads the particles
+// from one large file instead of from many small stacks
+class pack_particles_parameters
+{
+	public:
+	FileName fn_star, fn_root;
+	int buffer_size_Mb;
+	// I/O Parser
+	IOParser parser;
+
+	void usage()
+	{
+		parser.writeUsage(std::cerr);
+	}
+
+	void read(int argc, char **argv)
+	{
+
+		parser.setCommandLine(argc, argv);
+
+		int general_section = parser.addSection("General options");
+		fn_star = parser.getOption("--i", "Input STAR file with the particles (as rlnImageName) to be packed");
+		fn_root = parser.getOption("--o", "Output rootname (a _packed.mrcs stack and a _packed.star file will be written)","output");
+		buffer_size_Mb = textToInteger(parser.getOption("--buffer_size", "Size of the output write buffer (in Mb)","256"));
+
+		// Check for errors in the command-line option
+		if (parser.checkForErrors())
+			REPORT_ERROR("Errors encountered on the command line, exiting...");
+	}
+
+	void run()
+	{
+		Experiment exp_model;
+		exp_model.read(fn_star);
+
+		if (exp_model.is_3D)
+			REPORT_ERROR("ERROR: relion_pack_particles only works for 2D particles");
+
+		FileName fn_stack_out = fn_root + "_packed.mrcs";
+		FileName fn_star_out = fn_root + "_packed.star";
+		long int nr_particles = exp_model.numberOfParticles();
+		if (nr_particles == 0)
+			REPORT_ERROR("ERROR: there are no particles in " + fn_star);
+
+		std::cout << " Packing " << nr_particles << " particles into " << fn_stack_out << " ..." << std::endl;
+		init_progress_bar(nr_particles);
+		int barstep = XMIPP_MAX(1, nr_particles / 60);
+
+		MetaDataTable MDout;
+		fImageHandler hFile;
+		ImageStackWriter stack_writer;
+		FileName fn_img, fn_stack, fn_open_stack = "", fn_new;
+		long int dump, imgno = 0;
+		// Keep the original image names of particles that have been packed or extracted before
+		bool do_set_ori_name = !exp_model.MDimg.containsLabel(EMDL_IMAGE_ORI_NAME);
+		for (long int ori_part_id = 0; ori_part_id < exp_model.numberOfOriginalParticles(); ori_part_id++)
+		{
+			for (long int i = 0; i < exp_model.ori_particles[ori_part_id].particles_id.size(); i++)
+			{
+				long int part_id = exp_model.ori_particles[ori_part_id].particles_id[i];
+				exp_model.MDimg.getValue(EMDL_IMAGE_NAME, fn_img, part_id);
+
+				// Only open (and map read-only) new stacks
+				fn_img.decompose(dump, fn_stack);
+				if (fn_stack != fn_open_stack)
+				{
+					hFile.openFile(fn_stack, WRITE_READONLY, true, true);
+					fn_open_stack = fn_stack;
+				}
+				Image<float> img;
+				img.readFromOpenFile(fn_img, hFile, -1, false);
+
+				// Stream all images into the stack through two buffers of half the buffer size,
+				// one of which is written in the background while the other is filled
+				if (imgno == 0)
+				{
+					size_t one_img_size = ZYXSIZE(img()) * sizeof(float);
+					long int nr_buffer_images = ((size_t)buffer_size_Mb * 1024 * 1024 / 2) / one_img_size;
+					stack_writer.openStack(fn_stack_out, Float, nr_buffer_images, true);
+				}
+				stack_writer.writeImage(img);
+
+				fn_new.compose(imgno + 1, fn_stack_out);
+				MDout.addObject(exp_model.MDimg.getObject(part_id));
+				MDout.setValue(EMDL_IMAGE_NAME, fn_new);
+				if (do_set_ori_name)
+					MDout.setValue(EMDL_IMAGE_ORI_NAME, fn_img);
+
+				imgno++;
+				if (imgno % barstep == 0)
+					progress_bar(imgno);
+			}
+		}
+
+		// Write the remaining images and set the number of images and their statistics in the header
+		stack_writer.closeStack();
+		progress_bar(nr_particles);
+
+		MDout.write(fn_star_out);
+		std::cout << " Done! Written: " << fn_stack_out << " and " << fn_star_out << std::endl;
+	}
+
+};
+
+
+int main(int argc, char *argv[])
+{
+	pack_particles_parameters prm;
+
+	try
+    {
+
+		prm.read(argc, argv);
+
+		prm.run();
+
+    }
+    catch (RelionError XE)
+    {
+        std::cerr << XE;
+        prm.usage();
+        exit(1);
+    }
+    return 0;
+}
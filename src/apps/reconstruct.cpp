@@ -60,7 +60,7 @@ class reconstruct_parameters
        	angpix = textToFloat(parser.getOption("--angpix", "Pixel size (in Angstroms)", "1"));
        	maxres = textToFloat(parser.getOption("--maxres", "Maximum resolution (in Angstrom) to consider in Fourier space (default Nyquist)", "-1"));
        	padding_factor = textToFloat(parser.getOption("--pad", "Padding factor", "2"));
-    	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to use for FFTs", "1"));
+    	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to use for FFTs and symmetrisation", "1"));
 
 	    int ctf_section = parser.addSection("CTF options");
        	do_ctf = parser.checkOption("--ctf", "Apply CTF correction");
@@ -459,7 +459,7 @@ class reconstruct_parameters
    			}
    		}
    		std::cerr << "Starting the reconstruction ..." << std::endl;
-   		backprojector.symmetrise(nr_helical_asu, helical_twist, helical_rise);
+   		backprojector.symmetrise(nr_helical_asu, helical_twist, helical_rise, nr_threads);
    		backprojector.reconstruct(vol(), iter, do_map, 1., dummy, dummy, dummy, fsc, 1., do_use_fsc, true, nr_threads, -1);
 
    		if (do_reconstruct_ctf)
@@ -64,6 +64,9 @@ class stack_create_parameters
 	{
 		MD.read(fn_star);
 
+		if (MD.numberOfObjects() == 0)
+			REPORT_ERROR("ERROR: Input STAR file does not contain any images: " + fn_star);
+
 		// Check for rlnImageName label
 		if (!MD.containsLabel(EMDL_IMAGE_NAME))
 			REPORT_ERROR("ERROR: Input STAR file does not contain the rlnImageName label");
@@ -129,11 +132,31 @@ class stack_create_parameters
 			ndim = mics_ndims[m];
 			fn_mic = fn_mics[m];
 
-			// Resize the output image
-			std::cout << "Resizing the output stack to "<< ndim<<" images of size: "<<xdim<<"x"<<ydim<<"x"<<zdim << std::endl;
-			RFLOAT Gb = (ndim*zdim*ydim*xdim*sizeof(RFLOAT))/(1024.*1024.*1024.);
-			std::cout << "This will require " << Gb << "Gb of memory...."<< std::endl;
-			Image<RFLOAT> out(xdim, ydim, zdim, ndim);
+			FileName fn_out;
+			if (do_split_per_micrograph)
+			{
+				// Remove any extensions from micrograph names....
+				fn_out = fn_root + "_" + fn_mic.withoutExtension() + fn_ext;
+			}
+			else
+				fn_out = fn_root + fn_ext;
+
+			// MRC stacks of 2D images are written while the images are read, without keeping the whole stack in memory
+			bool do_stream = (!do_spider && zdim == 1);
+			ImageStackWriter writer;
+			Image<RFLOAT> out;
+			if (do_stream)
+			{
+				writer.openStack(fn_out, Float, 64, true);
+			}
+			else
+			{
+				// Resize the output image
+				std::cout << "Resizing the output stack to "<< ndim<<" images of size: "<<xdim<<"x"<<ydim<<"x"<<zdim << std::endl;
+				RFLOAT Gb = (ndim*zdim*ydim*xdim*sizeof(RFLOAT))/(1024.*1024.*1024.);
+				std::cout << "This will require " << Gb << "Gb of memory...."<< std::endl;
+				out().resize(ndim, zdim, ydim, xdim);
+			}
 
 			int n = 0;
 			init_progress_bar(ndim);
@@ -167,7 +190,11 @@ class stack_create_parameters
 					    selfApplyGeometry(in(), A, IS_NOT_INV, DONT_WRAP);
 					}
 
-					out().setImage(n, in());
+					// The writer keeps the statistics of the whole stack for the header
+					if (do_stream)
+						writer.writeImage(in);
+					else
+						out().setImage(n, in());
 					n++;
 					if (n%100==0) progress_bar(n);
 
@@ -175,16 +202,10 @@ class stack_create_parameters
 			}
 			progress_bar(ndim);
 
-
-			FileName fn_out;
-			if (do_split_per_micrograph)
-			{
-				// Remove any extensions from micrograph names....
-				fn_out = fn_root + "_" + fn_mic.withoutExtension() + fn_ext;
-			}
+			if (do_stream)
+				writer.closeStack();
 			else
-				fn_out = fn_root + fn_ext;
-			out.write(fn_out);
+				out.write(fn_out);
 			std::cout << "Written out: " << fn_out << std::endl;
 		}
 		std::cout << "Done!" <<std::endl;
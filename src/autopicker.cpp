@@ -22,6 +22,38 @@
 //#define DEBUG
 //#define DEBUG_HELIX
 
+void globalThreadSearchInPlaneRotations(ThreadArgument &thArg)
+{
+	AutoPicker *prm = (AutoPicker*) thArg.workClass;
+	prm->doThreadSearchInPlaneRotations(thArg.thread_id);
+}
+
+void globalThreadCalculateHarmonicCorrelations(ThreadArgument &thArg)
+{
+	AutoPicker *prm = (AutoPicker*) thArg.workClass;
+	prm->doThreadCalculateHarmonicCorrelations(thArg.thread_id);
+}
+
+void globalThreadSearchWithHarmonics(ThreadArgument &thArg)
+{
+	AutoPicker *prm = (AutoPicker*) thArg.workClass;
+	prm->doThreadSearchWithHarmonics(thArg.thread_id);
+}
+
+void * globalThreadReadMicrograph(void *self)
+{
+	AutoPicker *prm = (AutoPicker*) self;
+	prm->readMicrographInBackground();
+	return NULL;
+}
+
+void * globalThreadWriteCoordinates(void *self)
+{
+	AutoPicker *prm = (AutoPicker*) self;
+	prm->writeCoordinates();
+	return NULL;
+}
+
 void ccfPeak::clear()
 {
 	id = ref = nr_peak_pixel = -1;
@@ -88,6 +120,93 @@ bool ccfPeak::refresh()
 	return true;
 };
 
+void PeakGrid::build(const std::vector<Peak> &peaks, int min_cell_size)
+{
+	std::vector<int> xs(peaks.size()), ys(peaks.size());
+	for (int ipeak = 0; ipeak < peaks.size(); ipeak++)
+	{
+		xs[ipeak] = peaks[ipeak].x;
+		ys[ipeak] = peaks[ipeak].y;
+	}
+	build(xs, ys, min_cell_size);
+}
+
+void PeakGrid::build(const std::vector<ccfPeak> &peaks, int min_cell_size)
+{
+	std::vector<int> xs(peaks.size()), ys(peaks.size());
+	for (int ipeak = 0; ipeak < peaks.size(); ipeak++)
+	{
+		xs[ipeak] = FLOOR(peaks[ipeak].x);
+		ys[ipeak] = FLOOR(peaks[ipeak].y);
+	}
+	build(xs, ys, min_cell_size);
+}
+
+void PeakGrid::build(const std::vector<int> &xs, const std::vector<int> &ys, int min_cell_size)
+{
+	cell_start.clear();
+	cell_peaks.clear();
+	x0 = y0 = xdim = ydim = 0;
+	cell_size = XMIPP_MAX(1, min_cell_size);
+	if (xs.size() < 1)
+		return;
+
+	int x1 = xs[0], y1 = ys[0];
+	x0 = x1;
+	y0 = y1;
+	for (int ipeak = 1; ipeak < xs.size(); ipeak++)
+	{
+		x0 = XMIPP_MIN(x0, xs[ipeak]);
+		y0 = XMIPP_MIN(y0, ys[ipeak]);
+		x1 = XMIPP_MAX(x1, xs[ipeak]);
+		y1 = XMIPP_MAX(y1, ys[ipeak]);
+	}
+
+	// Use larger cells if there would be many more cells than peaks
+	while ((long int)((x1 - x0) / cell_size + 1) * (long int)((y1 - y0) / cell_size + 1) > 4 * (long int)xs.size() + 16)
+		cell_size *= 2;
+	xdim = (x1 - x0) / cell_size + 1;
+	ydim = (y1 - y0) / cell_size + 1;
+
+	// Counting sort of the peaks over the cells
+	cell_start.resize(xdim * ydim + 1, 0);
+	for (int ipeak = 0; ipeak < xs.size(); ipeak++)
+		cell_start[((ys[ipeak] - y0) / cell_size) * xdim + (xs[ipeak] - x0) / cell_size + 1]++;
+	for (int icell = 0; icell < xdim * ydim; icell++)
+		cell_start[icell + 1] += cell_start[icell];
+	std::vector<int> cell_fill(cell_start.begin(), cell_start.end() - 1);
+	cell_peaks.resize(xs.size());
+	for (int ipeak = 0; ipeak < xs.size(); ipeak++)
+		cell_peaks[cell_fill[((ys[ipeak] - y0) / cell_size) * xdim + (xs[ipeak] - x0) / cell_size]++] = ipeak;
+}
+
+void PeakGrid::getCandidates(int x, int y, int reach, std::vector<int> &candidates) const
+{
+	candidates.clear();
+	if (cell_peaks.size() < 1 || x + reach < x0 || y + reach < y0)
+		return;
+	int ix0 = XMIPP_MAX(0, x - reach - x0) / cell_size;
+	int iy0 = XMIPP_MAX(0, y - reach - y0) / cell_size;
+	int ix1 = XMIPP_MIN(xdim - 1, (x + reach - x0) / cell_size);
+	int iy1 = XMIPP_MIN(ydim - 1, (y + reach - y0) / cell_size);
+	for (int iy = iy0; iy <= iy1; iy++)
+		for (int ix = ix0; ix <= ix1; ix++)
+			for (int i = cell_start[iy * xdim + ix]; i < cell_start[iy * xdim + ix + 1]; i++)
+				candidates.push_back(cell_peaks[i]);
+}
+
+AutoPicker::~AutoPicker()
+{
+	if (is_prefetching)
+		pthread_join(prefetch_thread, NULL);
+	if (is_writing)
+		pthread_join(write_thread, NULL);
+	if (psi_threads != NULL)
+		delete psi_threads;
+	if (psi_distributor != NULL)
+		delete psi_distributor;
+}
+
 void AutoPicker::read(int argc, char **argv)
 {
 
@@ -103,10 +222,15 @@ void AutoPicker::read(int argc, char **argv)
 	outlier_removal_zscore= textToFloat(parser.getOption("--outlier_removal_zscore", "Remove pixels that are this many sigma away from the mean", "8."));
 	do_write_fom_maps = parser.checkOption("--write_fom_maps", "Write calculated probability-ratio maps to disc (for re-reading in subsequent runs)");
 	do_read_fom_maps = parser.checkOption("--read_fom_maps", "Skip probability calculations, re-read precalculated maps from disc");
+	do_compact_fom_maps = parser.checkOption("--compact_fom_maps", "Write the probability-ratio maps as 16-bit MRC files, at 2 bytes per pixel (give this option also with --read_fom_maps)");
 	do_optimise_scale = !parser.checkOption("--skip_optimise_scale", "Skip the optimisation of the micrograph scale for better prime factors in the FFTs. This runs slower, but at exactly the requested resolution.");
 	do_only_unfinished = parser.checkOption("--only_do_unfinished", "Only autopick those micrographs for which the coordinate file does not yet exist");
+	do_stream = parser.checkOption("--stream", "Keep watching the input for new micrographs and pick them as they appear (e.g. during data collection)");
+	stream_wait = textToFloat(parser.getOption("--stream_wait", "Number of seconds between checks for new micrographs in --stream mode", "30"));
+	stream_timeout = textToFloat(parser.getOption("--stream_timeout", "Stop --stream mode after this many minutes without new micrographs", "60"));
 	do_gpu = parser.checkOption("--gpu", "Use GPU acceleration when availiable");
 	gpu_ids = parser.getOption("--gpu", "Device ids for each MPI-thread","default");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to search the in-plane rotations of each reference in parallel (on the CPU)", "1"));
 #ifndef CUDA
 	if(do_gpu)
 	{
@@ -118,7 +242,9 @@ void AutoPicker::read(int argc, char **argv)
 	fn_ref = parser.getOption("--ref", "STAR file with the reference names, or an MRC stack with all references, or \"gauss\" for blob-picking");
 	angpix_ref = textToFloat(parser.getOption("--angpix_ref", "Pixel size of the references in Angstroms (default is same as micrographs)", "-1"));
 	do_invert = parser.checkOption("--invert", "Density in micrograph is inverted w.r.t. density in template");
+	fn_ref_cache = parser.getOption("--ref_cache", "File to store the Fourier transforms of the prepared references in, for re-use by subsequent runs with the same references and sizes", "");
 	psi_sampling = textToFloat(parser.getOption("--ang", "Angular sampling (in degrees); use 360 for no rotations", "10"));
+	nr_harmonics = textToInteger(parser.getOption("--harmonics", "Synthesise the in-plane rotations from the circular harmonics of the references up to this order, e.g. 3.14 * diameter / lowpass. This replaces one FFT per rotation by 2*order+1 FFTs, so it pays off for fine angular samplings (default is one FFT per rotation, also used when this order is too high to pay off)", "-1"));
 	lowpass = textToFloat(parser.getOption("--lowpass", "Lowpass filter in Angstroms for the references (prevent Einstein-from-noise!)","-1"));
 	highpass = textToFloat(parser.getOption("--highpass", "Highpass filter in Angstroms for the micrographs","-1"));
 	do_ctf = parser.checkOption("--ctf", "Perform CTF correction on the references?");
@@ -192,58 +318,41 @@ void AutoPicker::initialise()
 
 	if (random_seed == -1) random_seed = time(NULL);
 
-	if (fn_in.isStarFile())
+	// In --stream mode, the input STAR file may not have been written yet
+	try
 	{
-		MDmic.read(fn_in);
-		fn_micrographs.clear();
-		FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDmic)
-		{
-			FileName fn_mic;
-			MDmic.getValue(EMDL_MICROGRAPH_NAME, fn_mic);
-			fn_micrographs.push_back(fn_mic);
-		}
-
-        RFLOAT mag, dstep;
-        if (MDmic.containsLabel(EMDL_CTF_MAGNIFICATION) && MDmic.containsLabel(EMDL_CTF_DETECTOR_PIXEL_SIZE))
-        {
-			MDmic.goToObject(0);
-        	MDmic.getValue(EMDL_CTF_MAGNIFICATION, mag);
-			MDmic.getValue(EMDL_CTF_DETECTOR_PIXEL_SIZE, dstep);
-			angpix = 10000. * dstep / mag;
-			if (verb > 0)
-				std::cout << " + Using pixel size from input STAR file of " << angpix << " Angstroms" << std::endl;
-        }
-        else if (verb > 0)
-        {
-        	std::cout << " + Warning: input STAR file does not contain information about pixel size!" << std::endl;
-        	std::cout << " + Warning: use --angpix to provide the correct value. Now using " << angpix << " Angstroms" << std::endl;
-        }
+		readInputMicrographs();
 	}
-	else
+	catch (RelionError XE)
 	{
-
-		if (do_ctf)
-			REPORT_ERROR("AutoPicker::initialise ERROR: use an input STAR file with the CTF information when using --ctf");
-
-		fn_in.globFiles(fn_micrographs);
-		if (fn_micrographs.size() == 0)
-			REPORT_ERROR("Cannot find any micrograph called: "+fns_autopick);
+		if (!do_stream)
+			throw XE;
+		fn_micrographs.clear();
 	}
+	if (!fn_in.isStarFile() && do_ctf)
+		REPORT_ERROR("AutoPicker::initialise ERROR: use an input STAR file with the CTF information when using --ctf");
+	if (do_gpu && nr_harmonics >= 0)
+		REPORT_ERROR("AutoPicker::initialise ERROR: --harmonics is not implemented on the GPU, do not combine it with --gpu");
+	if (do_gpu && do_stream)
+		REPORT_ERROR("AutoPicker::initialise ERROR: --stream is not implemented on the GPU, do not combine it with --gpu");
+	if (!fn_in.isStarFile() && fn_micrographs.size() == 0 && !do_stream)
+		REPORT_ERROR("Cannot find any micrograph called: "+fns_autopick);
 
 	// If we're continuing an old run, see which micrographs have not been finished yet...
-	if (do_only_unfinished)
+	// In --stream mode, this is always done, and the first micrograph may still have to be written
+	if (do_only_unfinished || do_stream)
 	{
 		if (verb > 0)
 			std::cout << " + Skipping those micrographs for which coordinate file already exists" << std::endl;
 		std::vector<FileName> fns_todo;
-		for (long int imic = 0; imic < fn_micrographs.size(); imic++)
+		std::vector<long int> imics_todo;
+		getNewMicrographs(fns_todo, imics_todo);
+		if (do_stream && fns_todo.size() == 0)
 		{
-
-			FileName fn_tmp = getOutputRootName(fn_micrographs[imic]) + "_" + fn_out + ".star";
-			if (!exists(fn_tmp))
-				fns_todo.push_back(fn_micrographs[imic]);
+			if (verb > 0)
+				std::cout << " + Waiting for micrographs to appear in " << fn_in << " ..." << std::endl;
+			waitForNewMicrographs(fns_todo, imics_todo);
 		}
-
 		fn_micrographs = fns_todo;
 	}
 
@@ -257,6 +366,25 @@ void AutoPicker::initialise()
 		return;
 	}
 
+	if (fn_in.isStarFile())
+	{
+		RFLOAT mag, dstep;
+		if (MDmic.containsLabel(EMDL_CTF_MAGNIFICATION) && MDmic.containsLabel(EMDL_CTF_DETECTOR_PIXEL_SIZE))
+		{
+			MDmic.goToObject(0);
+			MDmic.getValue(EMDL_CTF_MAGNIFICATION, mag);
+			MDmic.getValue(EMDL_CTF_DETECTOR_PIXEL_SIZE, dstep);
+			angpix = 10000. * dstep / mag;
+			if (verb > 0)
+				std::cout << " + Using pixel size from input STAR file of " << angpix << " Angstroms" << std::endl;
+		}
+		else if (verb > 0)
+		{
+			std::cout << " + Warning: input STAR file does not contain information about pixel size!" << std::endl;
+			std::cout << " + Warning: use --angpix to provide the correct value. Now using " << angpix << " Angstroms" << std::endl;
+		}
+	}
+
 	if (verb > 0)
 	{
 		std::cout << " + Run autopicking on the following micrographs: " << std::endl;
@@ -520,6 +648,11 @@ void AutoPicker::initialise()
 	timer.tic(TIMING_A4);
 #endif
 
+	// All in-plane rotations that are searched for each reference
+	psi_angles.clear();
+	for (RFLOAT psi = 0. ; psi < 360.; psi+=psi_sampling)
+		psi_angles.push_back(psi);
+
 	// Pre-calculate and store Projectors for all references at the right size
 	if (!do_read_fom_maps)
 	{
@@ -528,6 +661,16 @@ void AutoPicker::initialise()
 			std::cout << " Initialising FFTs for the references and masks ... " << std::endl;
 		}
 
+		// The FTs of the references and of the mask may have been prepared by an earlier run
+		// (The key is calculated before the references are masked below)
+		std::string cache_key;
+		bool is_cached = false;
+		if (fn_ref_cache != "")
+		{
+			cache_key = getReferenceCacheKey();
+			is_cached = readReferenceCache(cache_key);
+		}
+
 		// Calculate a circular mask based on the particle_diameter and then store its FT
 		FourierTransformer transformer;
 		MultidimArray<RFLOAT> Mcirc_mask(particle_size, particle_size);
@@ -553,8 +696,11 @@ void AutoPicker::initialise()
 		{
 			A2D_ELEM(Maux, i, j ) = A2D_ELEM(Mcirc_mask, i, j);
 		}
-		CenterFFT(Maux, true);
-		transformer.FourierTransform(Maux, Finvmsk);
+		if (!is_cached)
+		{
+			CenterFFT(Maux, true);
+			transformer.FourierTransform(Maux, Finvmsk);
+		}
 
 		// Also get the particle-area mask
 		nr_pixels_circular_mask = 0;
@@ -574,41 +720,55 @@ void AutoPicker::initialise()
 #endif
 
 
-		PPref.clear();
-		if (verb > 0)
-			init_progress_bar(Mrefs.size());
-
-		Projector PP(micrograph_size);
-		MultidimArray<RFLOAT> dummy;
-
-		for (int iref = 0; iref < Mrefs.size(); iref++)
+		if (is_cached)
+		{
+			if (verb > 0)
+				std::cout << " + Read the prepared references and masks from " << fn_ref_cache << std::endl;
+		}
+		else
 		{
+			PPref.clear();
+			if (verb > 0)
+				init_progress_bar(Mrefs.size());
 
-			// (Re-)apply the mask to the references
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mrefs[iref])
-			{
-				DIRECT_MULTIDIM_ELEM(Mrefs[iref], n) *= DIRECT_MULTIDIM_ELEM(Mcirc_mask, n);
-			}
+			Projector PP(micrograph_size);
+			MultidimArray<RFLOAT> dummy;
 
-			// Set reference in the large box of the micrograph
-			Maux.initZeros();
-			Maux.setXmippOrigin();
-			FOR_ALL_ELEMENTS_IN_ARRAY2D(Mrefs[iref])
+			for (int iref = 0; iref < Mrefs.size(); iref++)
 			{
-				A2D_ELEM(Maux, i, j) = A2D_ELEM(Mrefs[iref], i, j);
-			}
 
-			// And compute its Fourier Transform inside the Projector
-			PP.computeFourierTransformMap(Maux, dummy, downsize_mic, 1, false);
-			PPref.push_back(PP);
+				// (Re-)apply the mask to the references
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mrefs[iref])
+				{
+					DIRECT_MULTIDIM_ELEM(Mrefs[iref], n) *= DIRECT_MULTIDIM_ELEM(Mcirc_mask, n);
+				}
+
+				// Set reference in the large box of the micrograph
+				Maux.initZeros();
+				Maux.setXmippOrigin();
+				FOR_ALL_ELEMENTS_IN_ARRAY2D(Mrefs[iref])
+				{
+					A2D_ELEM(Maux, i, j) = A2D_ELEM(Mrefs[iref], i, j);
+				}
+
+				// And compute its Fourier Transform inside the Projector
+				PP.computeFourierTransformMap(Maux, dummy, downsize_mic, 1, false);
+				PPref.push_back(PP);
+
+				if (verb > 0)
+					progress_bar(iref+1);
+
+			}
 
 			if (verb > 0)
-				progress_bar(iref+1);
+				progress_bar(Mrefs.size());
 
+			if (fn_ref_cache != "" && verb > 0)
+				writeReferenceCache(cache_key);
 		}
 
-		if (verb > 0)
-			progress_bar(Mrefs.size());
+		if (nr_harmonics >= 0)
+			calculateCircularHarmonics();
 
 	}
 #ifdef TIMING
@@ -621,6 +781,111 @@ void AutoPicker::initialise()
 
 }
 
+std::string AutoPicker::getReferenceCacheKey()
+{
+	// 64-bit FNV-1a hash of all pixels of the (rescaled, inverted but not yet masked) references
+	unsigned long long hash = 14695981039346656037ULL;
+	for (int iref = 0; iref < Mrefs.size(); iref++)
+	{
+		const unsigned char *ptr = (const unsigned char *)MULTIDIM_ARRAY(Mrefs[iref]);
+		size_t nr_bytes = MULTIDIM_SIZE(Mrefs[iref]) * sizeof(RFLOAT);
+		for (size_t n = 0; n < nr_bytes; n++)
+		{
+			hash ^= ptr[n];
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	// The mask depends on particle_radius2, the FTs on the micrograph size and the lowpass filter (downsize_mic)
+	std::ostringstream key;
+	key << "relion_autopick_references v1 rfloat= " << sizeof(RFLOAT) << " nr_refs= " << Mrefs.size()
+		<< " hash= " << std::hex << hash << std::dec << " particle_size= " << particle_size
+		<< " particle_radius2= " << particle_radius2 << " micrograph_size= " << micrograph_size
+		<< " downsize_mic= " << downsize_mic << " workSize= " << workSize;
+	return key.str();
+}
+
+bool AutoPicker::readReferenceCache(std::string key)
+{
+	std::ifstream in(fn_ref_cache.c_str(), std::ios::in | std::ios::binary);
+	if (!in)
+		return false;
+
+	// Different references or sizes: prepare them again (and overwrite the cache)
+	std::string file_key;
+	std::getline(in, file_key);
+	if (file_key != key)
+		return false;
+
+	long int ydim, xdim;
+	in.read(reinterpret_cast<char*>(&ydim), sizeof(long int));
+	in.read(reinterpret_cast<char*>(&xdim), sizeof(long int));
+	if (!in || ydim != micrograph_size || xdim != micrograph_size/2 + 1)
+		return false;
+	Finvmsk.resize(ydim, xdim);
+	in.read(reinterpret_cast<char*>(MULTIDIM_ARRAY(Finvmsk)), MULTIDIM_SIZE(Finvmsk) * sizeof(Complex));
+
+	PPref.clear();
+	for (int iref = 0; iref < Mrefs.size(); iref++)
+	{
+		// Same Projector as in initialise, but without calculating the FT of the padded reference
+		Projector PP(micrograph_size);
+		in.read(reinterpret_cast<char*>(&PP.padding_factor), sizeof(float));
+		PP.ref_dim = 2;
+		PP.initialiseData(downsize_mic);
+		in.read(reinterpret_cast<char*>(MULTIDIM_ARRAY(PP.data)), MULTIDIM_SIZE(PP.data) * sizeof(Complex));
+		if (!in)
+			break;
+		PPref.push_back(PP);
+	}
+
+	// A truncated file (e.g. because it was still being written) is not used either
+	if (!in)
+	{
+		PPref.clear();
+		Finvmsk.clear();
+		return false;
+	}
+
+	return true;
+}
+
+void AutoPicker::writeReferenceCache(std::string key)
+{
+	// Write to a temporary file first, so that other (MPI) processes never read half a file
+	FileName fn_tmp = fn_ref_cache + ".tmp";
+	std::ofstream out(fn_tmp.c_str(), std::ios::out | std::ios::binary);
+	if (!out)
+		REPORT_ERROR("AutoPicker::writeReferenceCache ERROR: cannot write to file: " + fn_tmp);
+
+	out << key << "\n";
+	long int ydim = YSIZE(Finvmsk), xdim = XSIZE(Finvmsk);
+	out.write(reinterpret_cast<char*>(&ydim), sizeof(long int));
+	out.write(reinterpret_cast<char*>(&xdim), sizeof(long int));
+	out.write(reinterpret_cast<char*>(MULTIDIM_ARRAY(Finvmsk)), MULTIDIM_SIZE(Finvmsk) * sizeof(Complex));
+	for (int iref = 0; iref < PPref.size(); iref++)
+	{
+		out.write(reinterpret_cast<char*>(&PPref[iref].padding_factor), sizeof(float));
+		out.write(reinterpret_cast<char*>(MULTIDIM_ARRAY(PPref[iref].data)), MULTIDIM_SIZE(PPref[iref].data) * sizeof(Complex));
+	}
+	out.close();
+	if (!out)
+		REPORT_ERROR("AutoPicker::writeReferenceCache ERROR: cannot write to file: " + fn_tmp);
+
+	if (std::rename(fn_tmp.c_str(), fn_ref_cache.c_str()) != 0)
+		REPORT_ERROR("AutoPicker::writeReferenceCache ERROR: cannot rename " + fn_tmp + " to " + fn_ref_cache);
+}
+
+FileName AutoPicker::getFomMapName(FileName fn_mic, std::string suffix, int iref)
+{
+	FileName fn_map = getOutputRootName(fn_mic) + "_" + fn_out;
+	if (iref >= 0)
+		fn_map.compose(fn_map + "_ref", iref, suffix);
+	else
+		fn_map += suffix;
+	return fn_map + ((do_compact_fom_maps) ? ".mrc" : ".spi");
+}
+
 #ifdef CUDA
 int AutoPicker::deviceInitialise()
 {
@@ -648,6 +913,12 @@ int AutoPicker::deviceInitialise()
 
 void AutoPicker::run()
 {
+	if (do_stream)
+	{
+		runStream();
+		return;
+	}
+
 	int barstep;
 	if (verb > 0)
 	{
@@ -663,29 +934,156 @@ void AutoPicker::run()
 		if (verb > 0 && imic % barstep == 0)
 			progress_bar(imic);
 
-		// Check new-style outputdirectory exists and make it if not!
-		FileName fn_dir = getOutputRootName(fn_micrographs[imic]);
-		fn_dir = fn_dir.beforeLastOf("/");
-		if (fn_dir != fn_olddir)
-		{
-			// Make a Particles directory
-			int res = system(("mkdir -p " + fn_dir).c_str());
-			fn_olddir = fn_dir;
-		}
 #ifdef TIMING
 		timer.tic(TIMING_A5);
 #endif
-		autoPickOneMicrograph(fn_micrographs[imic], imic);
+		FileName fn_next = (imic + 1 < fn_micrographs.size()) ? fn_micrographs[imic + 1] : "";
+		autoPickMicrographInList(fn_micrographs[imic], imic, fn_next, fn_olddir);
 #ifdef TIMING
 		timer.toc(TIMING_A5);
 #endif
 	}
+	waitForBackgroundThreads();
 
 	if (verb > 0)
 		progress_bar(fn_micrographs.size());
 
 }
 
+void AutoPicker::autoPickMicrographInList(FileName &fn_mic, long int imic, const FileName &fn_next, FileName &fn_olddir)
+{
+	// Check new-style outputdirectory exists and make it if not!
+	FileName fn_dir = getOutputRootName(fn_mic);
+	fn_dir = fn_dir.beforeLastOf("/");
+	if (fn_dir != fn_olddir)
+	{
+		// Make a Particles directory
+		if (system(("mkdir -p " + fn_dir).c_str()) != 0)
+			REPORT_ERROR("AutoPicker::autoPickMicrographInList ERROR: cannot make output directory " + fn_dir);
+		fn_olddir = fn_dir;
+	}
+
+	// Let the background thread start reading the next micrograph while this one is picked
+	fn_mic_next = fn_next;
+	autoPickOneMicrograph(fn_mic, imic);
+}
+
+void AutoPicker::readInputMicrographs()
+{
+	fn_micrographs.clear();
+	if (fn_in.isStarFile())
+	{
+		MDmic.read(fn_in);
+		FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDmic)
+		{
+			FileName fn_mic;
+			MDmic.getValue(EMDL_MICROGRAPH_NAME, fn_mic);
+			fn_micrographs.push_back(fn_mic);
+		}
+	}
+	else
+	{
+		fn_in.globFiles(fn_micrographs);
+	}
+}
+
+void AutoPicker::getNewMicrographs(std::vector<FileName> &fns_new, std::vector<long int> &imics_new, int rank, int nr_ranks)
+{
+	fns_new.clear();
+	imics_new.clear();
+	for (long int imic = rank; imic < fn_micrographs.size(); imic += nr_ranks)
+	{
+		if (fns_picked.find(fn_micrographs[imic]) != fns_picked.end())
+			continue;
+		FileName fn_tmp = getOutputRootName(fn_micrographs[imic]) + "_" + fn_out + ".star";
+		if (exists(fn_tmp))
+			continue;
+		// In streaming mode, micrographs may be listed before they have been written
+		if (do_stream && !exists(fn_micrographs[imic]))
+			continue;
+		fns_new.push_back(fn_micrographs[imic]);
+		imics_new.push_back(imic);
+	}
+}
+
+bool AutoPicker::waitForNewMicrographs(std::vector<FileName> &fns_new, std::vector<long int> &imics_new, int rank, int nr_ranks)
+{
+	time_t last_new = time(NULL);
+	while (difftime(time(NULL), last_new) < 60. * stream_timeout)
+	{
+		sleep(XMIPP_MAX(1, ROUND(stream_wait)));
+
+		// The input STAR file may be in the middle of being written: then just try again later
+		try
+		{
+			readInputMicrographs();
+		}
+		catch (RelionError XE)
+		{
+			continue;
+		}
+
+		getNewMicrographs(fns_new, imics_new, rank, nr_ranks);
+		if (fns_new.size() > 0)
+			return true;
+	}
+
+	if (verb > 0)
+		std::cout << " + No new micrographs for " << stream_timeout << " minutes, so stopping autopicking ..." << std::endl;
+	return false;
+}
+
+void AutoPicker::runStream(int rank, int nr_ranks)
+{
+	// initialise() only kept the unfinished micrographs: start again from all micrographs in the input
+	std::vector<FileName> fns_todo;
+	std::vector<long int> imics_todo;
+	readInputMicrographs();
+	getNewMicrographs(fns_todo, imics_todo, rank, nr_ranks);
+
+	FileName fn_olddir="";
+	do
+	{
+		if (verb > 0)
+		{
+			std::cout << " Autopicking " << fns_todo.size() << " new micrograph(s) ..." << std::endl;
+			init_progress_bar(fns_todo.size());
+		}
+
+		for (long int i = 0; i < fns_todo.size(); i++)
+		{
+			// Do not try the same micrograph again in this batch
+			fns_picked.insert(fns_todo[i]);
+			FileName fn_next = (i + 1 < fns_todo.size()) ? fns_todo[i + 1] : "";
+			try
+			{
+				autoPickMicrographInList(fns_todo[i], imics_todo[i], fn_next, fn_olddir);
+			}
+			catch (RelionError XE)
+			{
+				// A micrograph that is still being written may be incomplete:
+				// try it once more at the next check for new micrographs, and skip it if it fails again
+				bool do_retry = (fns_failed.find(fns_todo[i]) == fns_failed.end());
+				std::cerr << " + WARNING: cannot autopick " << fns_todo[i] << ": " << XE.msg << std::endl;
+				if (do_retry)
+				{
+					std::cerr << " + WARNING: will try " << fns_todo[i] << " again in " << stream_wait << " seconds" << std::endl;
+					fns_failed.insert(fns_todo[i]);
+					fns_picked.erase(fns_todo[i]);
+				}
+				else
+					std::cerr << " + WARNING: skipping " << fns_todo[i] << std::endl;
+			}
+
+			if (verb > 0)
+				progress_bar(i + 1);
+		}
+		waitForBackgroundThreads();
+	}
+	while (waitForNewMicrographs(fns_todo, imics_todo, rank, nr_ranks));
+
+}
+
 void AutoPicker::pickCCFPeaks(
 		const MultidimArray<RFLOAT>& Mccf,
 		const MultidimArray<int>& Mclass,
@@ -772,11 +1170,22 @@ void AutoPicker::pickCCFPeaks(
 		return;
 	}
 
+	// Pixels within these bounds can be part of a peak
+	int peak_xmin = FIRST_XMIPP_INDEX(new_micrograph_xsize) + skip_side + 1;
+	int peak_xmax = LAST_XMIPP_INDEX(new_micrograph_xsize) - skip_side - 1;
+	int peak_ymin = FIRST_XMIPP_INDEX(new_micrograph_ysize) + skip_side + 1;
+	int peak_ymax = LAST_XMIPP_INDEX(new_micrograph_ysize) - skip_side - 1;
+
+	// Pixels that are not (or no longer) marked in Mrec are given the minimum ccf value,
+	// so that only the marked pixels count towards the centre and the area of a peak (unless minccf0 is above the threshold)
+	bool do_count_all = (minccf0 > threshold_value);
+
 	// Find all peaks! (From the highest fom values)
 	ccf_peak_list.clear();
 	for (int id = ccf_pixel_list.size() - 1; id >= 0; id--)
 	{
 		int x_new, y_new, x_old, y_old, rmax, rmax2, iref;
+		int x_big = 0, y_big = 0, x_small = 0, y_small = 0;
 		int rmax_min = peak_r_min;
 		int rmax_max;
 		int iter_max = 3;
@@ -808,6 +1217,8 @@ void AutoPicker::pickCCFPeaks(
 		{
 			// Record the smaller peak
 			ccf_peak_small = ccf_peak_big;
+			x_small = x_big;
+			y_small = y_big;
 
 			//std::cout << " id= " << id << ", rmax= " << rmax << ", p= " << ccf_peak_small.area_percentage << std::endl;
 
@@ -818,44 +1229,46 @@ void AutoPicker::pickCCFPeaks(
 				// Empty this peak
 				ccf_peak_big.clear();
 
-				// New rmax
+				// Count all ccf pixels within this rmax, and those above the threshold
+				// This gives the same centre and area as ccfPeak::refresh() on a list of all these pixels,
+				// but the list itself is only made below, for the peaks that are kept
+				long int nr_pixels_in_circle = 0, nr_peak_pixels = 0, sum_x = 0, sum_y = 0;
 				rmax2 = rmax * rmax;
-
-				// Get all ccf pixels within this rmax
-				for (int dx = -rmax; dx <= rmax; dx++)
+				for (int dy = -rmax; dy <= rmax; dy++)
 				{
-					for (int dy = -rmax; dy <= rmax; dy++)
+					y_new = y_old + dy;
+					if ( (y_new < peak_ymin) || (y_new > peak_ymax) )
+						continue;
+					for (int dx = -rmax; dx <= rmax; dx++)
 					{
-						// Boundary checks
-						if ( (dx * dx + dy * dy) > rmax2)
-							continue;
-
 						x_new = x_old + dx;
-						y_new = y_old + dy;
-						if ( (x_new < (FIRST_XMIPP_INDEX(new_micrograph_xsize) + skip_side + 1))
-								|| (x_new > (LAST_XMIPP_INDEX(new_micrograph_xsize) - skip_side - 1))
-								|| (y_new < (FIRST_XMIPP_INDEX(new_micrograph_ysize) + skip_side + 1))
-								|| (y_new > (LAST_XMIPP_INDEX(new_micrograph_ysize) - skip_side - 1)) )
+						if ( ((dx * dx + dy * dy) > rmax2) || (x_new < peak_xmin) || (x_new > peak_xmax) )
 							continue;
-
-						// Push back all ccf pixels within this rmax
-						RFLOAT ccf = A2D_ELEM(Mccf, y_new, x_new);
-						if (A2D_ELEM(Mrec, y_new, x_new) == 0)
-							ccf = minccf0;
-						ccf_peak_big.ccf_pixel_list.push_back(ccfPixel(x_new, y_new, ccf));
+						nr_pixels_in_circle++;
+						if ( (do_count_all) || (A2D_ELEM(Mrec, y_new, x_new) != 0) )
+						{
+							nr_peak_pixels++;
+							sum_x += x_new;
+							sum_y += y_new;
+						}
 					}
 				}
-				// Check ccf_peak.ccf_pixel_list.size() below!
+				x_big = x_old;
+				y_big = y_old;
 
 				// Refresh
 				ccf_peak_big.r = rmax;
 				ccf_peak_big.fom_thres = threshold_value;
-				if (ccf_peak_big.refresh() == false)
+				if ( (nr_pixels_in_circle < 1) || (nr_peak_pixels < 1) )
 				{
 					//std::cout << " x_old, y_old = " << x_old << ", " << y_old << std::endl;
 					//REPORT_ERROR("autopicker.cpp::pickCCFPeaks(): BUG No ccf pixels found within the small circle!");
 					break;
 				}
+				ccf_peak_big.nr_peak_pixel = nr_peak_pixels;
+				ccf_peak_big.x = (RFLOAT)(sum_x) / (RFLOAT)(nr_peak_pixels);
+				ccf_peak_big.y = (RFLOAT)(sum_y) / (RFLOAT)(nr_peak_pixels);
+				ccf_peak_big.area_percentage = (RFLOAT)(nr_peak_pixels) / (RFLOAT)(nr_pixels_in_circle);
 				x_new = ROUND(ccf_peak_big.x);
 				y_new = ROUND(ccf_peak_big.y);
 
@@ -881,6 +1294,33 @@ void AutoPicker::pickCCFPeaks(
 
 		} // rmax++ ends
 
+		// Get all ccf pixels within the circle of the smaller peak
+		if (ccf_peak_small.area_percentage >= 0.)
+		{
+			rmax = ROUND(ccf_peak_small.r);
+			rmax2 = rmax * rmax;
+			for (int dx = -rmax; dx <= rmax; dx++)
+			{
+				for (int dy = -rmax; dy <= rmax; dy++)
+				{
+					// Boundary checks
+					if ( (dx * dx + dy * dy) > rmax2)
+						continue;
+
+					x_new = x_small + dx;
+					y_new = y_small + dy;
+					if ( (x_new < peak_xmin) || (x_new > peak_xmax) || (y_new < peak_ymin) || (y_new > peak_ymax) )
+						continue;
+
+					// Push back all ccf pixels within this rmax
+					RFLOAT ccf = A2D_ELEM(Mccf, y_new, x_new);
+					if (A2D_ELEM(Mrec, y_new, x_new) == 0)
+						ccf = minccf0;
+					ccf_peak_small.ccf_pixel_list.push_back(ccfPixel(x_new, y_new, ccf));
+				}
+			}
+		}
+
 		// A peak is found
 		if (ccf_peak_small.isValid())
 		{
@@ -998,7 +1438,9 @@ void AutoPicker::extractHelicalTubes(
 		float scale)
 {
 	std::vector<int> is_peak_on_other_tubes;
-	std::vector<int> is_peak_on_this_tube;
+	std::vector<int> is_peak_on_this_tube, peaks_on_this_tube;
+	std::vector<int> candidates;
+	PeakGrid grid;
 	int tube_id;
 	RFLOAT curvature_max;
 
@@ -1034,6 +1476,10 @@ void AutoPicker::extractHelicalTubes(
 	for (int peak_id0 = 0; peak_id0 < is_peak_on_other_tubes.size(); peak_id0++)
 		is_peak_on_other_tubes[peak_id0] = is_peak_on_this_tube[peak_id0] = -1;
 
+	// All searches below are for peaks within a particle radius (or within half a step along the tube plus its radius),
+	// so only the peaks in the neighbouring cells of a grid need to be checked (sorted back into their original order)
+	grid.build(peak_list, CEIL(particle_diameter_pix / 2.));
+
 	// Traverse peaks from the strongest to the weakest
 	tube_id = 0;
 	for (int peak_id0 = peak_list.size() - 1; peak_id0 >= 0; peak_id0--)
@@ -1048,15 +1494,20 @@ void AutoPicker::extractHelicalTubes(
 		// Probably a new tube
 		tube_id++;
 		is_peak_on_other_tubes[peak_id0] = tube_id;
-		for (int peak_id1 = 0; peak_id1 < peak_list.size(); peak_id1++)
-			is_peak_on_this_tube[peak_id1] = -1;
+		for (int ii = 0; ii < peaks_on_this_tube.size(); ii++)
+			is_peak_on_this_tube[peaks_on_this_tube[ii]] = -1;
+		peaks_on_this_tube.clear();
 		is_peak_on_this_tube[peak_id0] = tube_id;
+		peaks_on_this_tube.push_back(peak_id0);
 
 		// Gather all neighboring peaks around
 		selected_peaks.clear(); // don't push itself in? No do not push itself!!!
 		rmax2 = particle_diameter_pix * particle_diameter_pix / 4.;
-		for (int peak_id1 = 0; peak_id1 < peak_list.size(); peak_id1++)
+		grid.getCandidates(FLOOR(peak_list[peak_id0].x), FLOOR(peak_list[peak_id0].y), CEIL(sqrt(rmax2)) + 1, candidates);
+		std::sort(candidates.begin(), candidates.end());
+		for (int ii = 0; ii < candidates.size(); ii++)
 		{
+			int peak_id1 = candidates[ii];
 			if (peak_id0 == peak_id1)
 				continue;
 			if (is_peak_on_other_tubes[peak_id1] > 0)
@@ -1192,8 +1643,10 @@ void AutoPicker::extractHelicalTubes(
 				rmax2 = ((dist_max + tube_diameter_pix) / 2.) * ((dist_max + tube_diameter_pix) / 2.);
 				bool is_new_peak_found = false;
 				bool is_combined_with_another_tube = true;
-				for (int peak_id1 = 0; peak_id1 < peak_list.size(); peak_id1++)
+				grid.getCandidates(FLOOR(xc), FLOOR(yc), CEIL(sqrt(rmax2)) + 1, candidates);
+				for (int ii = 0; ii < candidates.size(); ii++)
 				{
+					int peak_id1 = candidates[ii];
 					RFLOAT dx, dy, dist, dist2, dpsi, h, r;
 					dx = peak_list[peak_id1].x - xc;
 					dy = peak_list[peak_id1].y - yc;
@@ -1216,6 +1669,7 @@ void AutoPicker::extractHelicalTubes(
 						{
 							is_new_peak_found = true;
 							is_peak_on_this_tube[peak_id1] = tube_id;
+							peaks_on_this_tube.push_back(peak_id1);
 							if (is_peak_on_other_tubes[peak_id1] < 0)
 							{
 								is_combined_with_another_tube = false;
@@ -1236,8 +1690,11 @@ void AutoPicker::extractHelicalTubes(
 				yc_old = yc_new;
 				rmax2 = particle_diameter_pix * particle_diameter_pix / 4.;
 				selected_peaks_dir1.clear();
-				for (int peak_id1 = 0; peak_id1 < peak_list.size(); peak_id1++)
+				grid.getCandidates(FLOOR(xc_old), FLOOR(yc_old), CEIL(sqrt(rmax2)) + 1, candidates);
+				std::sort(candidates.begin(), candidates.end());
+				for (int ii = 0; ii < candidates.size(); ii++)
 				{
+					int peak_id1 = candidates[ii];
 					if (is_peak_on_this_tube[peak_id1] > 0)
 						continue;
 
@@ -1332,8 +1789,10 @@ void AutoPicker::extractHelicalTubes(
 				rmax2 = ((dist_max + tube_diameter_pix) / 2.) * ((dist_max + tube_diameter_pix) / 2.);
 				bool is_new_peak_found = false;
 				bool is_combined_with_another_tube = true;
-				for (int peak_id1 = 0; peak_id1 < peak_list.size(); peak_id1++)
+				grid.getCandidates(FLOOR(xc), FLOOR(yc), CEIL(sqrt(rmax2)) + 1, candidates);
+				for (int ii = 0; ii < candidates.size(); ii++)
 				{
+					int peak_id1 = candidates[ii];
 					RFLOAT dx, dy, dist, dist2, dpsi, h, r;
 					dx = peak_list[peak_id1].x - xc;
 					dy = peak_list[peak_id1].y - yc;
@@ -1356,6 +1815,7 @@ void AutoPicker::extractHelicalTubes(
 						{
 							is_new_peak_found = true;
 							is_peak_on_this_tube[peak_id1] = tube_id;
+							peaks_on_this_tube.push_back(peak_id1);
 							if (is_peak_on_other_tubes[peak_id1] < 0)
 							{
 								is_combined_with_another_tube = false;
@@ -1375,8 +1835,11 @@ void AutoPicker::extractHelicalTubes(
 				yc_old = yc_new;
 				rmax2 = particle_diameter_pix * particle_diameter_pix / 4.;
 				selected_peaks_dir2.clear();
-				for (int peak_id1 = 0; peak_id1 < peak_list.size(); peak_id1++)
+				grid.getCandidates(FLOOR(xc_old), FLOOR(yc_old), CEIL(sqrt(rmax2)) + 1, candidates);
+				std::sort(candidates.begin(), candidates.end());
+				for (int ii = 0; ii < candidates.size(); ii++)
 				{
+					int peak_id1 = candidates[ii];
 					if (is_peak_on_this_tube[peak_id1] > 0)
 						continue;
 
@@ -1748,6 +2211,7 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 	MultidimArray<RFLOAT> Maux, Mstddev, Mmean, Mdiff2, MsumX2, Mccf_best, Mpsi_best, Fctf, Mccf_best_combined;
 	MultidimArray<int> Mclass_best_combined;
 	FourierTransformer transformer;
+	PrunedFourierTransformer pruned_transformer;
 	RFLOAT sum_ref_under_circ_mask, sum_ref2_under_circ_mask;
 	int my_skip_side = autopick_skip_side + particle_size/2;
 	CTF ctf;
@@ -1766,8 +2230,8 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 #ifdef TIMING
 	timer.tic(TIMING_A6);
 #endif
-	// Read in the micrograph
-	Imic.read(fn_mic);
+	// Read in the micrograph (and start reading the next one)
+	readMicrograph(fn_mic, Imic);
 	Imic().setXmippOrigin();
 #ifdef TIMING
 	timer.toc(TIMING_A6);
@@ -1861,7 +2325,7 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 	RFLOAT normfft = (RFLOAT)(micrograph_size * micrograph_size) / (RFLOAT)nr_pixels_circular_mask;
 	if (do_read_fom_maps)
 	{
-		FileName fn_tmp=getOutputRootName(fn_mic)+"_"+fn_out+"_stddevNoise.spi";
+		FileName fn_tmp = getFomMapName(fn_mic, "_stddevNoise");
 		Image<RFLOAT> It;
 		It.read(fn_tmp);
 		Mstddev = It();
@@ -1924,10 +2388,10 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 		if (do_write_fom_maps)
 		{
 			// TMP output
-			FileName fn_tmp=getOutputRootName(fn_mic)+"_"+fn_out+"_stddevNoise.spi";
+			FileName fn_tmp = getFomMapName(fn_mic, "_stddevNoise");
 			Image<RFLOAT> It;
 			It() = Mstddev;
-			It.write(fn_tmp);
+			It.write(fn_tmp, -1, false, WRITE_OVERWRITE, (do_compact_fom_maps) ? Float16 : Unknown_Type);
 		}
 
 		// From now on use downsized Fmic, as the cross-correlation with the references can be done at lower resolution
@@ -1952,7 +2416,7 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 			Image<RFLOAT> It_float;
 			Image<int> It_int;
 
-			fn_tmp = getOutputRootName(fn_mic)+"_"+fn_out+"_combinedCCF.spi";
+			fn_tmp = getFomMapName(fn_mic, "_combinedCCF");
 			It_float.read(fn_tmp);
 			Mccf_best_combined = It_float();
 
@@ -1984,12 +2448,12 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 				FileName fn_tmp;
 				Image<RFLOAT> It;
 
-				fn_tmp.compose(getOutputRootName(fn_mic)+"_"+fn_out+"_ref", iref,"_bestCCF.spi");
+				fn_tmp = getFomMapName(fn_mic, "_bestCCF", iref);
 				It.read(fn_tmp);
 				Mccf_best = It();
 				It.MDMainHeader.getValue(EMDL_IMAGE_STATS_MAX, expected_Pratio);  // Retrieve expected_Pratio from the header of the image
 
-				fn_tmp.compose(getOutputRootName(fn_mic)+"_"+fn_out+"_ref", iref,"_bestPSI.spi");
+				fn_tmp = getFomMapName(fn_mic, "_bestPSI", iref);
 				It.read(fn_tmp);
 				Mpsi_best = It();
 			}
@@ -2003,176 +2467,96 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 			timer.tic(TIMING_B3);
 #endif
 			Mccf_best.initConstant(-LARGE_NUMBER);
-			bool is_first_psi = true;
-			for (RFLOAT psi = 0. ; psi < 360.; psi+=psi_sampling)
-			{
-				// Get the Euler matrix
-				Matrix2D<RFLOAT> A(3,3);
-				Euler_angles2matrix(0., 0., psi, A);
 
-				// Now get the FT of the rotated (non-ctf-corrected) template
-				Faux.initZeros(downsize_mic, downsize_mic/2 + 1);
-				PPref[iref].get2DFourierTransform(Faux, A, IS_NOT_INV);
-
-#ifdef DEBUG
-				std::cerr << " psi= " << psi << std::endl;
-				windowFourierTransform(Faux, Faux2, micrograph_size);
-				tt().resize(micrograph_size, micrograph_size);
-				transformer.inverseFourierTransform(Faux2, tt());
-				CenterFFT(tt(), false);
-				tt.write("Mref_rot.spi");
-
-				windowFourierTransform(Fmic, Faux2, micrograph_size);
-				transformer.inverseFourierTransform(Faux2, tt());
-				CenterFFT(tt(), false);
-				tt.write("Mmic.spi");
+			// Get the FT of the non-rotated (non-ctf-corrected) template
+			Matrix2D<RFLOAT> A(3,3);
+			Euler_angles2matrix(0., 0., 0., A);
+			Faux.initZeros(downsize_mic, downsize_mic/2 + 1);
+			PPref[iref].get2DFourierTransform(Faux, A, IS_NOT_INV);
 
-#endif
-#ifdef TIMING
-	timer.tic(TIMING_B4);
-#endif
-				// Apply the CTF on-the-fly (so same PPref can be used for many different micrographs)
-				if (do_ctf)
-				{
-					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
-					{
-						DIRECT_MULTIDIM_ELEM(Faux, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
-					}
-#ifdef TIMING
-	timer.toc(TIMING_B4);
-#endif
-#ifdef DEBUG
-				MultidimArray<RFLOAT> ttt(micrograph_size, micrograph_size);
-				windowFourierTransform(Faux, Faux2, micrograph_size);
-				transformer.inverseFourierTransform(Faux2, ttt);
-				CenterFFT(ttt, false);
-				ttt.setXmippOrigin();
-				tt().resize(particle_size, particle_size);
-				tt().setXmippOrigin();
-				FOR_ALL_ELEMENTS_IN_ARRAY2D(tt())
+			// Apply the CTF on-the-fly (so same PPref can be used for many different micrographs)
+			if (do_ctf)
+			{
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
 				{
-					A2D_ELEM(tt(), i, j) = A2D_ELEM(ttt, i, j);
-				}
-				tt.write("Mref_rot_ctf.spi");
-#endif
+					DIRECT_MULTIDIM_ELEM(Faux, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
 				}
+			}
 
-				if (is_first_psi)
-				{
 #ifdef TIMING
 	timer.tic(TIMING_B5);
 #endif
-					// Calculate the expected ratio of probabilities for this CTF-corrected reference
-					// and the sum_ref_under_circ_mask and sum_ref_under_circ_mask2
-					// Do this also if we're not recalculating the fom maps...
-					// This calculation needs to be done on an "non-shrinked" micrograph, in order to get the correct I^2 statistics
-					windowFourierTransform(Faux, Faux2, micrograph_size);
-					Maux.resize(micrograph_size, micrograph_size);
-					transformer.inverseFourierTransform(Faux2, Maux);
-					CenterFFT(Maux, false);
-					Maux.setXmippOrigin();
-//#ifdef DEBUG
-					Image<RFLOAT> ttt;
-					ttt()=Maux;
-					ttt.write("Maux.spi");
-//#endif
-					sum_ref_under_circ_mask = 0.;
-					sum_ref2_under_circ_mask = 0.;
-					RFLOAT suma2 = 0.;
-					RFLOAT sumn = 1.;
-					MultidimArray<RFLOAT> Mctfref(particle_size, particle_size);
-					Mctfref.setXmippOrigin();
-					FOR_ALL_ELEMENTS_IN_ARRAY2D(Mctfref) // only loop over smaller Mctfref, but take values from large Maux!
-					{
-						if (i*i + j*j < particle_radius2)
-						{
-							suma2 += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
-							suma2 += 2. * A2D_ELEM(Maux, i, j) * rnd_gaus(0., 1.);
-							sum_ref_under_circ_mask += A2D_ELEM(Maux, i, j);
-							sum_ref2_under_circ_mask += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
-							sumn += 1.;
-						}
+			// Calculate the expected ratio of probabilities for this CTF-corrected reference
+			// and the sum_ref_under_circ_mask and sum_ref_under_circ_mask2
+			// Do this also if we're not recalculating the fom maps...
+			// This calculation needs to be done on an "non-shrinked" micrograph, in order to get the correct I^2 statistics
+			// Only the non-zero columns of the padded transform are transformed
+			Maux.resize(micrograph_size, micrograph_size);
+			pruned_transformer.inverseFourierTransform(Faux, Maux);
+			CenterFFT(Maux, false);
+			Maux.setXmippOrigin();
 #ifdef DEBUG
-						A2D_ELEM(Mctfref, i, j) = A2D_ELEM(Maux, i, j);
+			Image<RFLOAT> ttt;
+			ttt()=Maux;
+			ttt.write("Maux.spi");
 #endif
-					}
-					sum_ref_under_circ_mask /= sumn;
-					sum_ref2_under_circ_mask /= sumn;
-					expected_Pratio = exp(suma2 / (2. * sumn));
+			sum_ref_under_circ_mask = 0.;
+			sum_ref2_under_circ_mask = 0.;
+			RFLOAT suma2 = 0.;
+			RFLOAT sumn = 1.;
+			MultidimArray<RFLOAT> Mctfref(particle_size, particle_size);
+			Mctfref.setXmippOrigin();
+			FOR_ALL_ELEMENTS_IN_ARRAY2D(Mctfref) // only loop over smaller Mctfref, but take values from large Maux!
+			{
+				if (i*i + j*j < particle_radius2)
+				{
+					suma2 += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
+					suma2 += 2. * A2D_ELEM(Maux, i, j) * rnd_gaus(0., 1.);
+					sum_ref_under_circ_mask += A2D_ELEM(Maux, i, j);
+					sum_ref2_under_circ_mask += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
+					sumn += 1.;
+				}
 #ifdef DEBUG
-					std::cerr << " expected_Pratio["<<iref<<"]= " << expected_Pratio << std::endl;
-					tt()=Mctfref;
-					tt.write("Mctfref.spi");
-					std::cerr << "suma2 " << suma2<< " sumn " << sumn << " suma2/2sumn="<< suma2 / (2. * sumn) << std::endl;
-					std::cerr << " nr_pixels_under_mask= " << nr_pixels_circular_mask << " nr_pixels_under_invmask= " << nr_pixels_circular_invmask << std::endl;
-					std::cerr << "sum_ref_under_circ_mask " << sum_ref_under_circ_mask << std::endl;
-					std::cerr << "sum_ref2_under_circ_mask " << sum_ref2_under_circ_mask << std::endl;
-					std::cerr << "expected_Pratio " << expected_Pratio << std::endl;
+				A2D_ELEM(Mctfref, i, j) = A2D_ELEM(Maux, i, j);
+#endif
+			}
+			sum_ref_under_circ_mask /= sumn;
+			sum_ref2_under_circ_mask /= sumn;
+			expected_Pratio = exp(suma2 / (2. * sumn));
+#ifdef DEBUG
+			std::cerr << " expected_Pratio["<<iref<<"]= " << expected_Pratio << std::endl;
+			tt()=Mctfref;
+			tt.write("Mctfref.spi");
+			std::cerr << "suma2 " << suma2<< " sumn " << sumn << " suma2/2sumn="<< suma2 / (2. * sumn) << std::endl;
+			std::cerr << " nr_pixels_under_mask= " << nr_pixels_circular_mask << " nr_pixels_under_invmask= " << nr_pixels_circular_invmask << std::endl;
+			std::cerr << "sum_ref_under_circ_mask " << sum_ref_under_circ_mask << std::endl;
+			std::cerr << "sum_ref2_under_circ_mask " << sum_ref2_under_circ_mask << std::endl;
+			std::cerr << "expected_Pratio " << expected_Pratio << std::endl;
 #endif
 
-					// Maux goes back to the workSize
-					Maux.resize(workSize, workSize);
 #ifdef TIMING
 	timer.toc(TIMING_B5);
 #endif
-				}
 
 #ifdef TIMING
 	timer.tic(TIMING_B6);
 #endif
-				// Now multiply template and micrograph to calculate the cross-correlation
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
-				{
-					DIRECT_MULTIDIM_ELEM(Faux, n) = conj(DIRECT_MULTIDIM_ELEM(Faux, n)) * DIRECT_MULTIDIM_ELEM(Fmic, n);
-				}
-
-				// If we're not doing shrink, then Faux is bigger than Faux2!
-				windowFourierTransform(Faux, Faux2, workSize);
-				transformer.inverseFourierTransform(Faux2, Maux);
-				CenterFFT(Maux, false);
-#ifdef DEBUG
-				tt()=Maux*normfft;
-				tt.write("Mcc.spi");
-#endif
-
-				// Calculate ratio of prabilities P(ref)/P(zero)
-				// Keep track of the best values and their corresponding iref and psi
-
-				// So now we already had precalculated: Mdiff2 = 1/sig*Sum(X^2) - 2/sig*Sum(X) + mu^2/sig*Sum(1)
-				// Still to do (per reference): - 2/sig*Sum(AX) + 2*mu/sig*Sum(A) + Sum(A^2)
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Maux)
-				{
-					RFLOAT diff2 = - 2. * normfft * DIRECT_MULTIDIM_ELEM(Maux, n);
-					diff2 += 2. * DIRECT_MULTIDIM_ELEM(Mmean, n) * sum_ref_under_circ_mask;
-					if (DIRECT_MULTIDIM_ELEM(Mstddev, n) > 1E-10)
-						diff2 /= DIRECT_MULTIDIM_ELEM(Mstddev, n);
-					diff2 += sum_ref2_under_circ_mask;
-					diff2 = exp(- diff2 / 2.); // exponentiate to reflect the Gaussian error model. sigma=1 after normalization, 0.4=1/sqrt(2pi)
-
-					// Store fraction of (1 - probability-ratio) wrt  (1 - expected Pratio)
-					diff2 = (diff2 - 1.) / (expected_Pratio - 1.);
-#ifdef DEBUG
-					DIRECT_MULTIDIM_ELEM(Maux, n) = diff2;
-#endif
-					if (diff2 > DIRECT_MULTIDIM_ELEM(Mccf_best, n))
-					{
-						DIRECT_MULTIDIM_ELEM(Mccf_best, n) = diff2;
-						DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = psi;
-					}
-				}
-#ifdef DEBUG
-				std::cerr << " Maux.computeMax()= " << Maux.computeMax() << std::endl;
-				tt()=Maux;
-				tt.write("Mccf.spi");
-			    std::cerr << " Press any key to continue... "  << std::endl;
-			    char c;
-			    std::cin >> c;
-#endif
-			    is_first_psi = false;
+			// Now calculate the FOM maps for all in-plane rotations, and keep track of the best values and their corresponding psi
+			psi_iref = iref;
+			psi_Fmic = &Fmic;
+			psi_Fctf = &Fctf;
+			psi_Mmean = &Mmean;
+			psi_Mstddev = &Mstddev;
+			psi_sum_ref_under_circ_mask = sum_ref_under_circ_mask;
+			psi_sum_ref2_under_circ_mask = sum_ref2_under_circ_mask;
+			psi_expected_Pratio = expected_Pratio;
+			psi_normfft = normfft;
+			psi_Mccf_best = &Mccf_best;
+			psi_Mpsi_best = &Mpsi_best;
+			searchInPlaneRotations();
 #ifdef TIMING
 	timer.toc(TIMING_B6);
 #endif
-			} // end for psi
 #ifdef TIMING
 	timer.toc(TIMING_B3);
 #endif
@@ -2186,12 +2570,12 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 
 				It() = Mccf_best;
 				It.MDMainHeader.setValue(EMDL_IMAGE_STATS_MAX, expected_Pratio);  // Store expected_Pratio in the header of the image
-				fn_tmp.compose(getOutputRootName(fn_mic)+"_"+fn_out+"_ref", iref,"_bestCCF.spi");
-				It.write(fn_tmp);
+				fn_tmp = getFomMapName(fn_mic, "_bestCCF", iref);
+				It.write(fn_tmp, -1, false, WRITE_OVERWRITE, (do_compact_fom_maps) ? Float16 : Unknown_Type);
 
 				It() = Mpsi_best;
-				fn_tmp.compose(getOutputRootName(fn_mic)+"_"+fn_out+"_ref", iref,"_bestPSI.spi");
-				It.write(fn_tmp);
+				fn_tmp = getFomMapName(fn_mic, "_bestPSI", iref);
+				It.write(fn_tmp, -1, false, WRITE_OVERWRITE, (do_compact_fom_maps) ? Float16 : Unknown_Type);
 
 //				for (long int n=0; n<((Mccf_best).nzyxdim/10); n+=1)
 //				{
@@ -2272,8 +2656,8 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 			Image<int> It_int;
 
 			It_float() = Mccf_best_combined;
-			fn_tmp = getOutputRootName(fn_mic) + "_" + fn_out + "_combinedCCF.spi";
-			It_float.write(fn_tmp);
+			fn_tmp = getFomMapName(fn_mic, "_combinedCCF");
+			It_float.write(fn_tmp, -1, false, WRITE_OVERWRITE, (do_compact_fom_maps) ? Float16 : Unknown_Type);
 
 			It_int() = Mclass_best_combined;
 			fn_tmp = getOutputRootName(fn_mic) + + "_" + fn_out + "_combinedCLASS.spi";
@@ -2311,7 +2695,7 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 			MDout.setValue(EMDL_ORIENT_PSI, peaks[ipeak].psi);
 		}
 		FileName fn_tmp = getOutputRootName(fn_mic) + "_" + fn_out + ".star";
-		MDout.write(fn_tmp);
+		writeCoordinatesInBackground(MDout, fn_tmp);
 #ifdef TIMING
 	timer.toc(TIMING_B9);
 #endif
@@ -2327,6 +2711,493 @@ FileName AutoPicker::getOutputRootName(FileName fn_mic)
 
 }
 
+void AutoPicker::readMicrograph(FileName &fn_mic, Image<RFLOAT> &Imic)
+{
+	bool have_read = false;
+	if (is_prefetching)
+	{
+		pthread_join(prefetch_thread, NULL);
+		is_prefetching = false;
+		// If the background thread failed, the micrograph is read again below to report the error
+		if (prefetch_ok && fn_mic_prefetch == fn_mic)
+		{
+			// Take over the data of the prefetched micrograph without copying them
+			Imic.data.swap(Imic_prefetch.data);
+			Imic.MDMainHeader = Imic_prefetch.MDMainHeader;
+			have_read = true;
+		}
+		Imic_prefetch.clear();
+	}
+
+	// A micrograph that is still being written may be shorter than its header says
+	if (!have_read && Imic.read(fn_mic) < 0)
+		REPORT_ERROR("AutoPicker::readMicrograph ERROR: cannot read all data of " + fn_mic);
+
+	startReadingNextMicrograph();
+}
+
+void AutoPicker::startReadingNextMicrograph()
+{
+	if (fn_mic_next == "" || !exists(fn_mic_next))
+		return;
+
+	fn_mic_prefetch = fn_mic_next;
+	if (pthread_create(&prefetch_thread, NULL, globalThreadReadMicrograph, (void *)this) != 0)
+		REPORT_ERROR("AutoPicker::startReadingNextMicrograph ERROR: cannot create thread to read " + fn_mic_prefetch);
+	is_prefetching = true;
+}
+
+void AutoPicker::readMicrographInBackground()
+{
+	try
+	{
+		prefetch_ok = (Imic_prefetch.read(fn_mic_prefetch) >= 0);
+	}
+	catch (RelionError XE)
+	{
+		prefetch_ok = false;
+	}
+}
+
+void AutoPicker::writeCoordinatesInBackground(MetaDataTable &MDout, FileName fn_star)
+{
+	if (is_writing)
+	{
+		pthread_join(write_thread, NULL);
+		is_writing = false;
+	}
+
+	MDcoords_write = MDout;
+	fn_coords_write = fn_star;
+	if (pthread_create(&write_thread, NULL, globalThreadWriteCoordinates, (void *)this) != 0)
+		REPORT_ERROR("AutoPicker::writeCoordinatesInBackground ERROR: cannot create thread to write " + fn_star);
+	is_writing = true;
+}
+
+void AutoPicker::writeCoordinates()
+{
+	try
+	{
+		MDcoords_write.write(fn_coords_write);
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE << std::endl << "In the thread that writes " << fn_coords_write << std::endl;
+		exit(1);
+	}
+}
+
+void AutoPicker::waitForBackgroundThreads()
+{
+	if (is_prefetching)
+	{
+		pthread_join(prefetch_thread, NULL);
+		is_prefetching = false;
+		Imic_prefetch.clear();
+	}
+	if (is_writing)
+	{
+		pthread_join(write_thread, NULL);
+		is_writing = false;
+	}
+}
+
+RFLOAT AutoPicker::calculateFom(RFLOAT ccf, long int n)
+{
+	const MultidimArray<RFLOAT> &Mmean = *psi_Mmean;
+	const MultidimArray<RFLOAT> &Mstddev = *psi_Mstddev;
+
+	// So now we already had precalculated: Mdiff2 = 1/sig*Sum(X^2) - 2/sig*Sum(X) + mu^2/sig*Sum(1)
+	// Still to do (per reference): - 2/sig*Sum(AX) + 2*mu/sig*Sum(A) + Sum(A^2)
+	RFLOAT diff2 = - 2. * psi_normfft * ccf;
+	diff2 += 2. * DIRECT_MULTIDIM_ELEM(Mmean, n) * psi_sum_ref_under_circ_mask;
+	if (DIRECT_MULTIDIM_ELEM(Mstddev, n) > 1E-10)
+		diff2 /= DIRECT_MULTIDIM_ELEM(Mstddev, n);
+	diff2 += psi_sum_ref2_under_circ_mask;
+	diff2 = exp(- diff2 / 2.); // exponentiate to reflect the Gaussian error model. sigma=1 after normalization, 0.4=1/sqrt(2pi)
+
+	// Store fraction of (1 - probability-ratio) wrt  (1 - expected Pratio)
+	return (diff2 - 1.) / (psi_expected_Pratio - 1.);
+}
+
+void AutoPicker::searchOneInPlaneRotation(int ipsi, MultidimArray<Complex > &Faux, MultidimArray<Complex > &Faux2,
+		MultidimArray<RFLOAT> &Maux, FourierTransformer &transformer,
+		MultidimArray<RFLOAT> &Mccf_best, MultidimArray<RFLOAT> &Mpsi_best)
+{
+	RFLOAT psi = psi_angles[ipsi];
+	const MultidimArray<Complex > &Fmic = *psi_Fmic;
+	const MultidimArray<RFLOAT> &Fctf = *psi_Fctf;
+
+	// Get the Euler matrix
+	Matrix2D<RFLOAT> A(3,3);
+	Euler_angles2matrix(0., 0., psi, A);
+
+	// Now get the FT of the rotated (non-ctf-corrected) template
+	Faux.initZeros(downsize_mic, downsize_mic/2 + 1);
+	PPref[psi_iref].get2DFourierTransform(Faux, A, IS_NOT_INV);
+
+	// Apply the CTF on-the-fly, multiply template and micrograph to calculate the cross-correlation,
+	// and window to workSize (if we're not doing shrink, then Faux is bigger than Faux2!) in one go
+	// This gives the same Faux2 as separate passes for the CTF, the multiplication and windowFourierTransform
+	long int newhdim = workSize/2 + 1;
+	if (newhdim == XSIZE(Faux))
+	{
+		Faux2.resize(Faux);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
+		{
+			Complex fref = DIRECT_MULTIDIM_ELEM(Faux, n);
+			if (do_ctf)
+				fref *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+			DIRECT_MULTIDIM_ELEM(Faux2, n) = conj(fref) * DIRECT_MULTIDIM_ELEM(Fmic, n);
+		}
+	}
+	else
+	{
+		Faux2.initZeros(workSize, newhdim);
+		bool is_upsize = (newhdim > XSIZE(Faux));
+		long int max_r2 = (XSIZE(Faux) -1) * (XSIZE(Faux) - 1);
+		// Loop over the smallest of the two transforms
+		MultidimArray<Complex > &Fsmall = (is_upsize) ? Faux : Faux2;
+		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(Fsmall)
+		{
+			// Make sure windowed FT has nothing in the corners, otherwise we end up with an asymmetric FT!
+			if (is_upsize && ip*ip + jp*jp > max_r2)
+				continue;
+			Complex fref = FFTW2D_ELEM(Faux, ip, jp);
+			if (do_ctf)
+				fref *= FFTW2D_ELEM(Fctf, ip, jp);
+			FFTW2D_ELEM(Faux2, ip, jp) = conj(fref) * FFTW2D_ELEM(Fmic, ip, jp);
+		}
+	}
+
+	transformer.inverseFourierTransform(Faux2, Maux);
+
+	// Calculate ratio of prabilities P(ref)/P(zero)
+	// Keep track of the best values and their corresponding psi
+	// Maux is not re-centered with CenterFFT: pixel (i, j) of the centered map is read directly from Maux
+	long int xdim = XSIZE(Maux), ydim = YSIZE(Maux);
+	for (long int i = 0; i < ydim; i++)
+	{
+		long int ii = i + ydim/2;
+		if (ii >= ydim)
+			ii -= ydim;
+		for (long int j = 0; j < xdim; j++)
+		{
+			long int jj = j + xdim/2;
+			if (jj >= xdim)
+				jj -= xdim;
+			long int n = i * xdim + j;
+			RFLOAT diff2 = calculateFom(DIRECT_A2D_ELEM(Maux, ii, jj), n);
+			if (diff2 > DIRECT_MULTIDIM_ELEM(Mccf_best, n))
+			{
+				DIRECT_MULTIDIM_ELEM(Mccf_best, n) = diff2;
+				DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = psi;
+			}
+		}
+	}
+}
+
+void AutoPicker::searchRowsWithHarmonics(long int first_row, long int last_row, BatchFourierTransformer &transformer,
+		MultidimArray<RFLOAT> &Mrow_ccfs)
+{
+	// The cross-correlation at psi_j = 360 * j / N is
+	// CC(psi_j) = CC_0 + sum_m ( cos(m*psi_j) CC_cos_m + sin(m*psi_j) CC_sin_m ),
+	// which is the inverse real FFT over the N rotations of Z_0 = CC_0 and Z_m = (CC_cos_m - i CC_sin_m) / 2.
+	// (The order-N/2 harmonic of even N only has a cosine component, which FFTW takes as it is.)
+	// These FFTs are done in a batch for all pixels of a row
+	int nr_rot = psi_angles.size();
+	long int xdim = workSize, ydim = workSize;
+	Mrow_ccfs.resize(xdim, 1, 1, nr_rot);
+	transformer.setReal(Mrow_ccfs);
+	MultidimArray<Complex > &Fz = transformer.getFourierReference();
+	long int zdim = XSIZE(Fz);
+	MultidimArray<RFLOAT> &Mccf_best = *psi_Mccf_best;
+	MultidimArray<RFLOAT> &Mpsi_best = *psi_Mpsi_best;
+
+	for (long int i = first_row; i <= last_row; i++)
+	{
+		// The component maps are not re-centered: pixel (i, j) of the centered map is read directly from them
+		long int ii = i + ydim/2;
+		if (ii >= ydim)
+			ii -= ydim;
+		Fz.initZeros();
+		for (long int j = 0; j < xdim; j++)
+		{
+			long int jj = j + xdim/2;
+			if (jj >= xdim)
+				jj -= xdim;
+			long int nn = ii * xdim + jj;
+			Complex *z = &DIRECT_MULTIDIM_ELEM(Fz, j * zdim);
+			z[0] = Complex(DIRECT_MULTIDIM_ELEM(harmonic_ccfs[0], nn), 0.);
+			for (int m = 1; m <= nr_harmonics; m++)
+			{
+				RFLOAT ccf_cos = DIRECT_MULTIDIM_ELEM(harmonic_ccfs[2*m-1], nn);
+				RFLOAT ccf_sin = DIRECT_MULTIDIM_ELEM(harmonic_ccfs[2*m], nn);
+				z[m] = (2 * m == nr_rot) ? Complex(ccf_cos, 0.) : Complex(0.5 * ccf_cos, -0.5 * ccf_sin);
+			}
+		}
+		transformer.Transform(FFTW_BACKWARD);
+
+		// Keep track of the best values and their corresponding psi, in order of increasing psi
+		for (long int j = 0; j < xdim; j++)
+		{
+			long int n = i * xdim + j;
+			const RFLOAT *ccfs = &DIRECT_MULTIDIM_ELEM(Mrow_ccfs, j * nr_rot);
+			for (int ipsi = 0; ipsi < nr_rot; ipsi++)
+			{
+				RFLOAT diff2 = calculateFom(ccfs[ipsi], n);
+				if (diff2 > DIRECT_MULTIDIM_ELEM(Mccf_best, n))
+				{
+					DIRECT_MULTIDIM_ELEM(Mccf_best, n) = diff2;
+					DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = psi_angles[ipsi];
+				}
+			}
+		}
+	}
+}
+
+void AutoPicker::searchInPlaneRotations()
+{
+	if (nr_threads < 2)
+	{
+		MultidimArray<Complex > Faux, Faux2;
+		MultidimArray<RFLOAT> Maux(workSize, workSize);
+		FourierTransformer transformer;
+		if (nr_harmonics >= 0)
+		{
+			harmonic_ccfs.resize(2 * nr_harmonics + 1);
+			for (int icomp = 0; icomp < harmonic_ccfs.size(); icomp++)
+				calculateOneHarmonicCorrelation(icomp, Faux2, transformer);
+			BatchFourierTransformer batch_transformer;
+			MultidimArray<RFLOAT> Mrow_ccfs;
+			searchRowsWithHarmonics(0, workSize - 1, batch_transformer, Mrow_ccfs);
+			return;
+		}
+		for (int ipsi = 0; ipsi < psi_angles.size(); ipsi++)
+			searchOneInPlaneRotation(ipsi, Faux, Faux2, Maux, transformer, *psi_Mccf_best, *psi_Mpsi_best);
+		return;
+	}
+
+	if (psi_threads == NULL)
+	{
+		psi_distributor = new ThreadTaskDistributor(psi_angles.size(), 1);
+		psi_threads = new ThreadManager(nr_threads, this);
+	}
+
+	if (nr_harmonics >= 0)
+	{
+		harmonic_ccfs.resize(2 * nr_harmonics + 1);
+		psi_distributor->resize(harmonic_ccfs.size(), 1);
+		psi_distributor->reset();
+		psi_threads->run(globalThreadCalculateHarmonicCorrelations);
+
+		// Every pixel is searched by one thread only, so the threads can keep track of the best values in the same maps
+		psi_distributor->resize(workSize, XMIPP_MAX(1, workSize / (4 * nr_threads)));
+		psi_distributor->reset();
+		psi_threads->run(globalThreadSearchWithHarmonics);
+		return;
+	}
+
+	thread_Mccf_best.resize(nr_threads);
+	thread_Mpsi_best.resize(nr_threads);
+	for (int ithread = 1; ithread < nr_threads; ithread++)
+	{
+		thread_Mccf_best[ithread].resize(*psi_Mccf_best);
+		thread_Mccf_best[ithread].initConstant(-LARGE_NUMBER);
+		thread_Mpsi_best[ithread].resize(*psi_Mpsi_best);
+	}
+
+	psi_distributor->resize(psi_angles.size(), 1);
+	psi_distributor->reset();
+	psi_threads->run(globalThreadSearchInPlaneRotations);
+
+	// Combine the best values of all threads. Each thread searched its rotations in order of increasing psi,
+	// so for equal values the smallest psi is the one that a sequential search would have kept
+	for (int ithread = 1; ithread < nr_threads; ithread++)
+	{
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(*psi_Mccf_best)
+		{
+			RFLOAT new_ccf = DIRECT_MULTIDIM_ELEM(thread_Mccf_best[ithread], n);
+			RFLOAT old_ccf = DIRECT_MULTIDIM_ELEM(*psi_Mccf_best, n);
+			if (new_ccf > old_ccf || (new_ccf == old_ccf && new_ccf > -LARGE_NUMBER &&
+					DIRECT_MULTIDIM_ELEM(thread_Mpsi_best[ithread], n) < DIRECT_MULTIDIM_ELEM(*psi_Mpsi_best, n)))
+			{
+				DIRECT_MULTIDIM_ELEM(*psi_Mccf_best, n) = new_ccf;
+				DIRECT_MULTIDIM_ELEM(*psi_Mpsi_best, n) = DIRECT_MULTIDIM_ELEM(thread_Mpsi_best[ithread], n);
+			}
+		}
+	}
+}
+
+void AutoPicker::doThreadSearchInPlaneRotations(int thread_id)
+{
+	try
+	{
+		MultidimArray<Complex > Faux, Faux2;
+		MultidimArray<RFLOAT> Maux(workSize, workSize);
+		FourierTransformer transformer;
+		MultidimArray<RFLOAT> &Mccf_best = (thread_id == 0) ? *psi_Mccf_best : thread_Mccf_best[thread_id];
+		MultidimArray<RFLOAT> &Mpsi_best = (thread_id == 0) ? *psi_Mpsi_best : thread_Mpsi_best[thread_id];
+
+		size_t first_ipsi, last_ipsi;
+		while (psi_distributor->getTasks(first_ipsi, last_ipsi))
+		{
+			for (long int ipsi = first_ipsi; ipsi <= last_ipsi; ipsi++)
+				searchOneInPlaneRotation(ipsi, Faux, Faux2, Maux, transformer, Mccf_best, Mpsi_best);
+		}
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE << std::endl << "In the thread that searches in-plane rotations" << std::endl;
+		exit(1);
+	}
+}
+
+void AutoPicker::calculateCircularHarmonics()
+{
+	// With N equally spaced rotations, harmonics up to order N/2 can be determined
+	int nr_rot = psi_angles.size();
+	if (fabs(nr_rot * psi_sampling - 360.) > 0.001)
+		REPORT_ERROR("AutoPicker::calculateCircularHarmonics ERROR: --harmonics needs an angular sampling that divides 360 degrees");
+	if (nr_harmonics > nr_rot / 2)
+		nr_harmonics = nr_rot / 2;
+
+	// One inverse FFT of the micrograph costs about C = 2.5 log2(workSize^2) flops per pixel, and synthesising all N rotations
+	// from the components with one small FFT per pixel about S = 2.5 N log2(N) flops per pixel, independent of the order M.
+	// Including the 2M+1 FFTs of the components themselves, this is only cheaper than one FFT per rotation up to
+	// order (N - 1 - S/C) / 2. This neglects the interpolation of the rotated references, so it is a conservative limit
+	RFLOAT fft_cost = 2.5 * log((RFLOAT)workSize * workSize) / log(2.);
+	RFLOAT synthesis_cost = 2.5 * nr_rot * log((RFLOAT)nr_rot) / log(2.);
+	int max_harmonics = FLOOR((nr_rot - 1 - synthesis_cost / fft_cost) / 2.);
+	if (nr_harmonics > max_harmonics)
+	{
+		if (verb > 0)
+			std::cout << " + WARNING: circular harmonics up to order " << nr_harmonics << " are more expensive than one FFT per rotation (break-even at order "
+				<< max_harmonics << " for " << nr_rot << " rotations); calculating one FFT per rotation instead" << std::endl;
+		nr_harmonics = -1;
+		return;
+	}
+	int comp_size = XMIPP_MIN(workSize, downsize_mic);
+
+	if (verb > 0)
+	{
+		std::cout << " Calculating circular harmonics up to order " << nr_harmonics << " for the references ... " << std::endl;
+		RFLOAT mem = (RFLOAT)Mrefs.size() * (2 * nr_harmonics + 1) * comp_size * (comp_size/2 + 1) * sizeof(Complex);
+		std::cout << " + This will use " << mem / (1024. * 1024. * 1024.) << " Gb of memory for the components of all references" << std::endl;
+		init_progress_bar(Mrefs.size());
+	}
+
+	// The rotated reference at psi_j (= 360*j/N) is sum_m ( cos(m*psi_j) F_cos_m + sin(m*psi_j) F_sin_m ),
+	// so the components are obtained by a discrete Fourier transform over the rotations
+	MultidimArray<Complex > Faux, Fwin;
+	harmonic_Frefs.resize(PPref.size());
+	for (int iref = 0; iref < PPref.size(); iref++)
+	{
+		harmonic_Frefs[iref].resize(2 * nr_harmonics + 1);
+		for (int icomp = 0; icomp < harmonic_Frefs[iref].size(); icomp++)
+			harmonic_Frefs[iref][icomp].initZeros(comp_size, comp_size/2 + 1);
+
+		for (int irot = 0; irot < nr_rot; irot++)
+		{
+			// Use exactly the same angles as the rotations that are synthesised in searchOneInPlaneRotation
+			RFLOAT psi = psi_angles[irot];
+			Matrix2D<RFLOAT> A(3,3);
+			Euler_angles2matrix(0., 0., psi, A);
+			Faux.initZeros(downsize_mic, downsize_mic/2 + 1);
+			PPref[iref].get2DFourierTransform(Faux, A, IS_NOT_INV);
+			windowFourierTransform(Faux, Fwin, comp_size);
+
+			for (int m = 0; m <= nr_harmonics; m++)
+			{
+				// The average and the order-N/2 harmonic (for even N) only have a cosine component
+				RFLOAT weight = (m == 0 || 2 * m == nr_rot) ? 1. / nr_rot : 2. / nr_rot;
+				RFLOAT wcos = weight * cos(DEG2RAD(m * psi));
+				RFLOAT wsin = weight * sin(DEG2RAD(m * psi));
+				MultidimArray<Complex > &Fcos = harmonic_Frefs[iref][XMIPP_MAX(0, 2*m-1)];
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fwin)
+				{
+					DIRECT_MULTIDIM_ELEM(Fcos, n) += DIRECT_MULTIDIM_ELEM(Fwin, n) * wcos;
+				}
+				if (m > 0)
+				{
+					MultidimArray<Complex > &Fsin = harmonic_Frefs[iref][2*m];
+					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fwin)
+					{
+						DIRECT_MULTIDIM_ELEM(Fsin, n) += DIRECT_MULTIDIM_ELEM(Fwin, n) * wsin;
+					}
+				}
+			}
+		}
+
+		if (verb > 0)
+			progress_bar(iref+1);
+	}
+
+	if (verb > 0)
+		progress_bar(Mrefs.size());
+}
+
+void AutoPicker::calculateOneHarmonicCorrelation(int icomp, MultidimArray<Complex > &Faux2, FourierTransformer &transformer)
+{
+	const MultidimArray<Complex > &Fcomp = harmonic_Frefs[psi_iref][icomp];
+	const MultidimArray<Complex > &Fmic = *psi_Fmic;
+	const MultidimArray<RFLOAT> &Fctf = *psi_Fctf;
+
+	// Apply the CTF, multiply with the micrograph and pad to workSize, as for the rotated references in searchOneInPlaneRotation
+	Faux2.initZeros(workSize, workSize/2 + 1);
+	bool is_upsize = (workSize > downsize_mic);
+	long int max_r2 = (XSIZE(Fcomp) -1) * (XSIZE(Fcomp) - 1);
+	FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(Fcomp)
+	{
+		if (is_upsize && ip*ip + jp*jp > max_r2)
+			continue;
+		Complex fref = DIRECT_A2D_ELEM(Fcomp, i, j);
+		if (do_ctf)
+			fref *= FFTW2D_ELEM(Fctf, ip, jp);
+		FFTW2D_ELEM(Faux2, ip, jp) = conj(fref) * FFTW2D_ELEM(Fmic, ip, jp);
+	}
+
+	harmonic_ccfs[icomp].resize(workSize, workSize);
+	transformer.inverseFourierTransform(Faux2, harmonic_ccfs[icomp]);
+}
+
+void AutoPicker::doThreadCalculateHarmonicCorrelations(int thread_id)
+{
+	try
+	{
+		MultidimArray<Complex > Faux2;
+		FourierTransformer transformer;
+		size_t first_icomp, last_icomp;
+		while (psi_distributor->getTasks(first_icomp, last_icomp))
+		{
+			for (long int icomp = first_icomp; icomp <= last_icomp; icomp++)
+				calculateOneHarmonicCorrelation(icomp, Faux2, transformer);
+		}
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE << std::endl << "In the thread that calculates cross-correlations with circular harmonics" << std::endl;
+		exit(1);
+	}
+}
+
+void AutoPicker::doThreadSearchWithHarmonics(int thread_id)
+{
+	try
+	{
+		BatchFourierTransformer transformer;
+		MultidimArray<RFLOAT> Mrow_ccfs;
+		size_t first_row, last_row;
+		while (psi_distributor->getTasks(first_row, last_row))
+			searchRowsWithHarmonics(first_row, last_row, transformer, Mrow_ccfs);
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE << std::endl << "In the thread that synthesises the in-plane rotations from circular harmonics" << std::endl;
+		exit(1);
+	}
+}
+
 void AutoPicker::calculateStddevAndMeanUnderMask(const MultidimArray<Complex > &_Fmic, const MultidimArray<Complex > &_Fmic2,
 		MultidimArray<Complex > &_Fmsk, int nr_nonzero_pixels_mask, MultidimArray<RFLOAT> &_Mstddev, MultidimArray<RFLOAT> &_Mmean)
 {
@@ -2458,67 +3329,87 @@ void AutoPicker::peakSearch(const MultidimArray<RFLOAT> &Mfom, const MultidimArr
 void AutoPicker::prunePeakClusters(std::vector<Peak> &peaks, int min_distance, float scale)
 {
 	int mind2 = (float)(min_distance*min_distance)*scale*scale;
-	int nclus = 0;
-
+	float clus2 = (float)(particle_radius2)*scale*scale;
+	int clus_reach = (int)sqrt(XMIPP_MAX(clus2, 0.)) + 1;
+	int mind_reach = (int)sqrt((RFLOAT)XMIPP_MAX(mind2, 0)) + 1;
+
+	// Use a grid to only compare peaks with those in neighbouring cells
+	PeakGrid grid;
+	grid.build(peaks, XMIPP_MAX(clus_reach, mind_reach));
+
+	// cluster_id is the index of the first peak of the cluster a peak belongs to, or -1 if it has not been clustered yet
+	std::vector<int> cluster_id(peaks.size(), -1);
+	std::vector<bool> is_removed(peaks.size(), false);
+	std::vector<int> cluster, candidates, new_members;
+	std::vector<std::pair<RFLOAT, int> > fom_order;
 	std::vector<Peak> pruned_peaks;
-	while (peaks.size() > 0)
+	for (int ipeak = 0; ipeak < peaks.size(); ipeak++)
 	{
-		nclus++;
-		std::vector<Peak> cluster;
-		cluster.push_back(peaks[0]);
-		peaks.erase(peaks.begin());
+		if (cluster_id[ipeak] >= 0)
+			continue;
+
+		// Start a new cluster at the first peak that is not in any cluster yet,
+		// and add all unclustered peaks that are within the particle radius of any of its members.
+		// Peaks are added in the same order as a scan through the remaining peaks would add them.
+		cluster.clear();
+		cluster.push_back(ipeak);
+		cluster_id[ipeak] = ipeak;
 		for (int iclus = 0; iclus < cluster.size(); iclus++)
 		{
-			int my_x = cluster[iclus].x;
-			int my_y = cluster[iclus].y;
-			for (int ipeakp = 0; ipeakp < peaks.size(); ipeakp++)
+			int my_x = peaks[cluster[iclus]].x;
+			int my_y = peaks[cluster[iclus]].y;
+			grid.getCandidates(my_x, my_y, clus_reach, candidates);
+			new_members.clear();
+			for (int icand = 0; icand < candidates.size(); icand++)
 			{
+				int ipeakp = candidates[icand];
+				if (cluster_id[ipeakp] >= 0)
+					continue;
 				int dx = my_x - peaks[ipeakp].x;
 				int dy = my_y - peaks[ipeakp].y;
-				if (dx*dx + dy*dy < ( (float)(particle_radius2)*scale*scale ))
-				{
-					// Put ipeakp in the cluster, and remove from the peaks list
-					cluster.push_back(peaks[ipeakp]);
-					peaks.erase(peaks.begin()+ipeakp);
-					ipeakp--;
-				}
+				if (dx*dx + dy*dy < clus2)
+					new_members.push_back(ipeakp);
+			}
+			std::sort(new_members.begin(), new_members.end());
+			for (int inew = 0; inew < new_members.size(); inew++)
+			{
+				cluster_id[new_members[inew]] = ipeak;
+				cluster.push_back(new_members[inew]);
 			}
 		}
 
-		// Now search for the peak from the cluster with the best ccf.
-		// Then search again if there are any other peaks in the cluster that are further than particle_diameter apart from the selected peak
-		// If so, again search for the maximum
-		int ipass = 0;
-		while (cluster.size() > 0)
+		// Now take the peak from the cluster with the best ccf, and remove all peaks within mind2 from it from the cluster.
+		// Then take the best of the remaining peaks in the cluster, and so forth...
+		// Going through the cluster in order of decreasing relative_fom (the first one in the cluster for equal values)
+		// selects the same peaks as repeatedly searching for the best remaining one.
+		fom_order.clear();
+		for (int iclus = 0; iclus < cluster.size(); iclus++)
+			fom_order.push_back(std::pair<RFLOAT, int>(-peaks[cluster[iclus]].relative_fom, iclus));
+		std::sort(fom_order.begin(), fom_order.end());
+		for (int iorder = 0; iorder < fom_order.size(); iorder++)
 		{
-			RFLOAT best_relative_fom=-1.;
-			Peak bestpeak;
-			for (int iclus = 0; iclus < cluster.size(); iclus++)
-			{
-				if ( cluster[iclus].relative_fom > best_relative_fom)
-				{
-					best_relative_fom = cluster[iclus].relative_fom;
-					bestpeak = cluster[iclus];
-				}
-			}
+			int ibest = cluster[fom_order[iorder].second];
+			if (is_removed[ibest])
+				continue;
 
 			// Store this peak as pruned
-			pruned_peaks.push_back(bestpeak);
+			pruned_peaks.push_back(peaks[ibest]);
+			is_removed[ibest] = true;
 
-			// Remove all peaks within mind2 from the clusters
-			for (int iclus = 0; iclus < cluster.size(); iclus++)
+			// Remove all peaks within mind2 from the cluster
+			grid.getCandidates(peaks[ibest].x, peaks[ibest].y, mind_reach, candidates);
+			for (int icand = 0; icand < candidates.size(); icand++)
 			{
-				int dx = cluster[iclus].x - bestpeak.x;
-				int dy = cluster[iclus].y - bestpeak.y;
+				int ipeakp = candidates[icand];
+				if (cluster_id[ipeakp] != ipeak || is_removed[ipeakp])
+					continue;
+				int dx = peaks[ipeakp].x - peaks[ibest].x;
+				int dy = peaks[ipeakp].y - peaks[ibest].y;
 				if (dx*dx + dy*dy < mind2)
-				{
-					cluster.erase(cluster.begin()+iclus);
-					iclus--;
-				}
+					is_removed[ipeakp] = true;
 			}
-			ipass++;
 		}
-	} // end while peaks.size > 0
+	}
 
 	// Set the pruned peaks back into the input vector
 	peaks = pruned_peaks;
@@ -2530,13 +3421,34 @@ void AutoPicker::removeTooCloselyNeighbouringPeaks(std::vector<Peak> &peaks, int
 	// Now only keep those peaks that are at least min_particle_distance number of pixels from any other peak
 	std::vector<Peak> pruned_peaks;
 	int mind2 = (float)(min_distance*min_distance)*scale*scale;
+
+	// my_mind2 below only decreases from its initial value if scale <= 1, so only peaks closer than max_d2 can ever change it.
+	// Then only the peaks in the neighbouring cells of a grid need to be checked, in their original order.
+	// Otherwise, check all peaks.
+	int max_d2 = (int)(((float)99999)*scale*scale);
+	bool do_use_grid = (max_d2 <= 100000);
+	PeakGrid grid;
+	std::vector<int> candidates;
+	int reach = (int)sqrt((RFLOAT)XMIPP_MAX(max_d2, 0)) + 1;
+	if (do_use_grid)
+		grid.build(peaks, reach);
+	else
+		for (int ipeakp = 0; ipeakp < peaks.size(); ipeakp++)
+			candidates.push_back(ipeakp);
+
 	for (int ipeak = 0; ipeak < peaks.size(); ipeak++)
 	{
 		int my_x = peaks[ipeak].x;
 		int my_y = peaks[ipeak].y;
 		int my_mind2 = 99999;
-		for (int ipeakp = 0; ipeakp < peaks.size(); ipeakp++)
+		if (do_use_grid)
+		{
+			grid.getCandidates(my_x, my_y, reach, candidates);
+			std::sort(candidates.begin(), candidates.end());
+		}
+		for (int icand = 0; icand < candidates.size(); icand++)
 		{
+			int ipeakp = candidates[icand];
 			if (ipeakp != ipeak)
 			{
 				int dx = peaks[ipeakp].x - my_x;
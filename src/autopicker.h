@@ -17,6 +17,8 @@
 #include "src/mask.h"
 #include "src/macros.h"
 #include "src/helix.h"
+#include "src/parallel.h"
+#include <set>
 #ifdef CUDA
 #include "src/gpu_utils/cuda_mem_utils.h"
 #include "src/gpu_utils/cuda_projector.h"
@@ -69,6 +71,29 @@ struct Peak
 	RFLOAT psi, fom, relative_fom;
 };
 
+// Uniform grid of square cells over the peak coordinates,
+// so that the neighbours of a peak are found without comparing it to all other peaks
+class PeakGrid
+{
+public:
+	int x0, y0, xdim, ydim, cell_size;
+	// Indices of the peaks in each cell: cell_peaks[cell_start[c]] ... cell_peaks[cell_start[c+1]-1]
+	std::vector<int> cell_start, cell_peaks;
+
+	// Sort the peaks into cells of at least min_cell_size pixels
+	void build(const std::vector<Peak> &peaks, int min_cell_size);
+
+	// Same for the peaks along helical tubes, which are sorted into cells by the integer parts of their coordinates
+	void build(const std::vector<ccfPeak> &peaks, int min_cell_size);
+
+	// Sort the points (xs[i], ys[i]) into cells of at least min_cell_size pixels
+	void build(const std::vector<int> &xs, const std::vector<int> &ys, int min_cell_size);
+
+	// Get the indices of all peaks in the cells that overlap with the square of half-width reach around (x, y)
+	// This is a superset of the peaks within a distance reach of (x, y), in no particular order
+	void getCandidates(int x, int y, int reach, std::vector<int> &candidates) const;
+};
+
 class AutoPicker
 {
 public:
@@ -134,12 +159,30 @@ public:
 	// Write precalculated best_localCCF and SPI arrays to disc
 	bool do_write_fom_maps;
 
+	// Write (and re-read) the FOM maps as 16-bit floats in MRC format, instead of full-precision SPIDER files
+	bool do_compact_fom_maps;
+
+	// File with the prepared FTs of the references and masks, to be re-used in subsequent runs
+	FileName fn_ref_cache;
+
 	/// Only autopick those micrographs for which the coordinate file does not yet exist
 	bool do_only_unfinished;
 
 	// Is there any work to be done?
 	bool todo_anything;
 
+	// Keep watching the input for new micrographs, and pick those as they appear?
+	bool do_stream;
+
+	// Number of seconds between checks for new micrographs, and number of minutes without new micrographs after which streaming stops
+	RFLOAT stream_wait, stream_timeout;
+
+	// Micrographs that have been picked (or have been tried) in this run
+	std::set<FileName> fns_picked;
+
+	// Micrographs that could not be picked once in --stream mode (they are tried one more time)
+	std::set<FileName> fns_failed;
+
 	// All micrographs to autopick from
 	std::vector<FileName> fn_micrographs;
 
@@ -204,6 +247,49 @@ public:
 	// Perform optimisation of the scale factor?
 	bool do_optimise_scale;
 
+	// Number of threads to search the in-plane rotations of each reference in parallel
+	int nr_threads;
+
+	// Threads and task distributor for the in-plane rotations
+	ThreadManager *psi_threads;
+	ThreadTaskDistributor *psi_distributor;
+
+	// All in-plane rotations (in degrees)
+	std::vector<RFLOAT> psi_angles;
+
+	// Maximum order of the circular harmonics from which the cross-correlations for all in-plane rotations are synthesised
+	// (negative: calculate each in-plane rotation with its own FFT)
+	int nr_harmonics;
+
+	// Fourier transforms of the circular-harmonic components of the references (at the smallest of workSize and downsize_mic)
+	// [iref][0] is the rotational average, [iref][2m-1] and [iref][2m] are the cosine and sine components of order m
+	std::vector<std::vector<MultidimArray<Complex > > > harmonic_Frefs;
+
+	// Cross-correlations (not re-centered) of the micrograph with the circular-harmonic components of the current reference
+	std::vector<MultidimArray<RFLOAT> > harmonic_ccfs;
+
+	// The reference, (downsized) micrograph, CTF and background statistics of the current search over the in-plane rotations
+	int psi_iref;
+	MultidimArray<Complex > *psi_Fmic;
+	MultidimArray<RFLOAT> *psi_Fctf, *psi_Mmean, *psi_Mstddev;
+	RFLOAT psi_sum_ref_under_circ_mask, psi_sum_ref2_under_circ_mask, psi_expected_Pratio, psi_normfft;
+
+	// Best FOM and corresponding psi for each pixel from the rotations searched by each thread (thread 0 uses the final arrays)
+	std::vector<MultidimArray<RFLOAT> > thread_Mccf_best, thread_Mpsi_best;
+	MultidimArray<RFLOAT> *psi_Mccf_best, *psi_Mpsi_best;
+
+	// The next micrograph is read in a background thread while the current one is being picked
+	FileName fn_mic_next, fn_mic_prefetch;
+	Image<RFLOAT> Imic_prefetch;
+	pthread_t prefetch_thread;
+	bool is_prefetching, prefetch_ok;
+
+	// The coordinates of the previous micrograph are written in a background thread while the current one is being picked
+	MetaDataTable MDcoords_write;
+	FileName fn_coords_write;
+	pthread_t write_thread;
+	bool is_writing;
+
 #ifdef TIMING
     Timer timer;
 	int TIMING_A0, TIMING_A1, TIMING_A2, TIMING_A3, TIMING_A4, TIMING_A5, TIMING_A6, TIMING_A7, TIMING_A8, TIMING_A9;
@@ -215,9 +301,17 @@ public:
 	AutoPicker():
 		available_memory(0),
 		available_gpu_memory(0),
-		requested_gpu_memory(0)
+		requested_gpu_memory(0),
+		nr_threads(1),
+		psi_threads(NULL),
+		psi_distributor(NULL),
+		nr_harmonics(-1),
+		is_prefetching(false),
+		is_writing(false)
 	{}
 
+	~AutoPicker();
+
 	// Read command line arguments
 	void read(int argc, char **argv);
 
@@ -233,6 +327,21 @@ public:
 	// General function to decide what to do
 	void run();
 
+	// Read the micrographs from the input STAR file (into MDmic) or from the input pattern
+	void readInputMicrographs();
+
+	// Get the micrographs in the input that have not been picked yet (in this run or in an earlier one),
+	// and their positions in the input (which set their random seeds)
+	// Only every nr_ranks-th micrograph, starting at the rank-th, is considered, so that all MPI ranks can watch the same input
+	void getNewMicrographs(std::vector<FileName> &fns_new, std::vector<long int> &imics_new, int rank = 0, int nr_ranks = 1);
+
+	// Check every stream_wait seconds for new micrographs
+	// Returns false if there were none for stream_timeout minutes
+	bool waitForNewMicrographs(std::vector<FileName> &fns_new, std::vector<long int> &imics_new, int rank = 0, int nr_ranks = 1);
+
+	// Pick all micrographs in the input, and keep picking new ones as they appear in it
+	void runStream(int rank = 0, int nr_ranks = 1);
+
 	void pickCCFPeaks(
 			const MultidimArray<RFLOAT>& Mccf,
 			const MultidimArray<int>& Mclass,
@@ -268,6 +377,77 @@ public:
 
 	void autoPickOneMicrograph(FileName &fn_mic, long int imic);
 
+	// Make the output directory of fn_mic if it differs from fn_olddir, and pick fn_mic
+	// fn_next is the micrograph that will be picked after it (empty for the last one), which is read in the background
+	void autoPickMicrographInList(FileName &fn_mic, long int imic, const FileName &fn_next, FileName &fn_olddir);
+
+	// Read a micrograph, or take it from the background thread if that already read it
+	void readMicrograph(FileName &fn_mic, Image<RFLOAT> &Imic);
+
+	// Start reading fn_mic_next in a background thread
+	void startReadingNextMicrograph();
+
+	// Read fn_mic_prefetch into Imic_prefetch (this is run in a background thread)
+	void readMicrographInBackground();
+
+	// Write a STAR file with coordinates in a background thread (after the previous one has been written)
+	void writeCoordinatesInBackground(MetaDataTable &MDout, FileName fn_star);
+
+	// Write MDcoords_write to fn_coords_write (this is run in a background thread)
+	void writeCoordinates();
+
+	// Wait until the background threads have finished reading and writing
+	void waitForBackgroundThreads();
+
+	// Calculate the FOM of pixel n from its (un-normalised) cross-correlation ccf with psi_iref
+	RFLOAT calculateFom(RFLOAT ccf, long int n);
+
+	// Calculate the FOM map of psi_iref at in-plane rotation psi_angles[ipsi], and keep track of the best FOM and psi for each pixel in Mccf_best and Mpsi_best
+	// The CTF, the conjugated multiplication with the micrograph and the windowing to workSize are done in a single pass over the Fourier transform,
+	// and the re-centering of the cross-correlation in a single pass with the calculation of the FOM
+	void searchOneInPlaneRotation(int ipsi, MultidimArray<Complex > &Faux, MultidimArray<Complex > &Faux2,
+			MultidimArray<RFLOAT> &Maux, FourierTransformer &transformer,
+			MultidimArray<RFLOAT> &Mccf_best, MultidimArray<RFLOAT> &Mpsi_best);
+
+	// Decompose the in-plane rotations of all references into circular harmonics up to order nr_harmonics
+	// The components are calculated from psi_angles.size() equally spaced rotations, so that all harmonics
+	// (up to half the number of rotations) reproduce the rotated references at those angles
+	void calculateCircularHarmonics();
+
+	// String that identifies the prepared references: it changes with the references, their mask and the sizes of all FTs
+	std::string getReferenceCacheKey();
+
+	// Read Finvmsk and PPref from fn_ref_cache, returns false if it does not exist or was made for a different key
+	bool readReferenceCache(std::string key);
+
+	// Write Finvmsk and PPref to fn_ref_cache
+	void writeReferenceCache(std::string key);
+
+	// Name of the FOM map with the given suffix (for example "_stddevNoise") for this micrograph
+	FileName getFomMapName(FileName fn_mic, std::string suffix, int iref = -1);
+
+	// Calculate the cross-correlation of the micrograph with circular-harmonic component icomp of psi_iref in harmonic_ccfs[icomp]
+	void calculateOneHarmonicCorrelation(int icomp, MultidimArray<Complex > &Faux2, FourierTransformer &transformer);
+
+	// Thread function for the cross-correlations with the circular-harmonic components
+	void doThreadCalculateHarmonicCorrelations(int thread_id);
+
+	// Synthesise the cross-correlations at all in-plane rotations from harmonic_ccfs for the pixels in rows first_row to last_row,
+	// with one small inverse FFT over the rotations per pixel, and keep track of the best FOM and psi for each pixel in *psi_Mccf_best and *psi_Mpsi_best
+	// Mrow_ccfs is scratch space for the cross-correlations of one row
+	void searchRowsWithHarmonics(long int first_row, long int last_row, BatchFourierTransformer &transformer,
+			MultidimArray<RFLOAT> &Mrow_ccfs);
+
+	// Thread function for searchRowsWithHarmonics
+	void doThreadSearchWithHarmonics(int thread_id);
+
+	// Search all in-plane rotations of psi_iref, with nr_threads threads
+	// Gives the same Mccf_best and Mpsi_best as a sequential search in order of increasing psi
+	void searchInPlaneRotations();
+
+	// Thread function for searchInPlaneRotations
+	void doThreadSearchInPlaneRotations(int thread_id);
+
 	// Get the output coordinate filename given the micrograph filename
 	FileName getOutputRootName(FileName fn_mic);
 	// Uses Roseman2003 formulae to calculate stddev under the mask through FFTs
@@ -75,6 +75,13 @@ int AutoPickerMpi::deviceInitialise()
 
 void AutoPickerMpi::run()
 {
+	// In streaming mode, each node picks every node->size-th micrograph of the input, so that all nodes can keep watching the same input
+	if (do_stream)
+	{
+		runStream(node->rank, node->size);
+		return;
+	}
+
 	// Each node does part of the work
 	long int my_first_micrograph, my_last_micrograph, my_nr_micrographs;
 	divide_equally(fn_micrographs.size(), node->size, node->rank, my_first_micrograph, my_last_micrograph);
@@ -94,18 +101,10 @@ void AutoPickerMpi::run()
     	if (verb > 0 && imic % barstep == 0)
 			progress_bar(imic);
 
-		// Check new-style outputdirectory exists and make it if not!
-		FileName fn_dir = getOutputRootName(fn_micrographs[imic]);
-		fn_dir = fn_dir.beforeLastOf("/");
-		if (fn_dir != fn_olddir)
-		{
-			// Make a Particles directory
-			int res = system(("mkdir -p " + fn_dir).c_str());
-			fn_olddir = fn_dir;
-		}
-
-    	autoPickOneMicrograph(fn_micrographs[imic], imic);
+		FileName fn_next = (imic + 1 <= my_last_micrograph) ? fn_micrographs[imic + 1] : "";
+		autoPickMicrographInList(fn_micrographs[imic], imic, fn_next, fn_olddir);
 	}
+	waitForBackgroundThreads();
 	if (verb > 0)
 		progress_bar(my_nr_micrographs);
 
@@ -25,6 +25,7 @@
  */
 
 #include "src/backprojector.h"
+#include "src/parallel.h"
 
 void BackProjector::initialiseDataAndWeight(int current_size)
 {
@@ -769,6 +770,7 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 	MultidimArray<RFLOAT> Fweight;
 	// Fnewweight can become too large for a float: always keep this one in double-precision
 	MultidimArray<double> Fnewweight;
+	transformer.setThreads(nr_threads);
 	MultidimArray<Complex>& Fconv = transformer.getFourierReference();
 	int max_r2 = ROUND(r_max * padding_factor) * ROUND(r_max * padding_factor);
 
@@ -1078,6 +1080,7 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 
 	FourierTransformer transformer2;
 	MultidimArray<Complex > Ftmp;
+	transformer2.setThreads(nr_threads);
 	transformer2.setReal(vol_out); // cannot use the first transformer because Fconv is inside there!!
 	transformer2.getFourierAlias(Ftmp);
 	FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Ftmp)
@@ -1194,7 +1197,7 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 
 }
 
-void BackProjector::symmetrise(int nr_helical_asu, RFLOAT helical_twist, RFLOAT helical_rise)
+void BackProjector::symmetrise(int nr_helical_asu, RFLOAT helical_twist, RFLOAT helical_rise, int nr_threads)
 {
 	// First make sure the input arrays are obeying Hermitian symmetry,
 	// which is assumed in the rotation operators of both helical and point group symmetry
@@ -1203,7 +1206,7 @@ void BackProjector::symmetrise(int nr_helical_asu, RFLOAT helical_twist, RFLOAT
 	// Then apply helical and point group symmetry (order irrelevant?)
 	applyHelicalSymmetry(nr_helical_asu, helical_twist, helical_rise);
 
-	applyPointGroupSymmetry();
+	applyPointGroupSymmetry(nr_threads);
 }
 
 void BackProjector::enforceHermitianSymmetry()
@@ -1242,6 +1245,7 @@ void BackProjector::applyHelicalSymmetry(int nr_helical_asu, RFLOAT helical_twis
 	Complex dx00, dx01, dx10, dx11, dxy0, dxy1, ddd;
 	RFLOAT dd000, dd001, dd010, dd011, dd100, dd101, dd110, dd111;
 	RFLOAT ddx00, ddx01, ddx10, ddx11, ddxy0, ddxy1;
+	std::vector<RFLOAT> shift_cos, shift_sin;
 
     // First symmetry operator (not stored in SL) is the identity matrix
 	sum_weight = weight;
@@ -1256,6 +1260,22 @@ void BackProjector::applyHelicalSymmetry(int nr_helical_asu, RFLOAT helical_twis
 			rotation3DMatrix(rot_ang, 'Z', R);
 			R.setSmallValuesToZero(); // TODO: invert rotation matrix?
 
+			// The phase shift for helical translation along Z only depends on z, so tabulate it for all slices
+			if (ABS(helical_rise) > 0.)
+			{
+				RFLOAT zshift = hh * helical_rise;
+				zshift /= - ori_size * (RFLOAT)padding_factor;
+				shift_cos.resize(ZSIZE(sum_weight));
+				shift_sin.resize(ZSIZE(sum_weight));
+				for (int k = STARTINGZ(sum_weight); k <= FINISHINGZ(sum_weight); k++)
+				{
+					z = (RFLOAT)k;
+					RFLOAT dotp = 2 * PI * (z * zshift);
+					shift_cos[k - STARTINGZ(sum_weight)] = cos(dotp);
+					shift_sin[k - STARTINGZ(sum_weight)] = sin(dotp);
+				}
+			}
+
 			// Loop over all points in the output (i.e. rotated, or summed) array
 	        FOR_ALL_ELEMENTS_IN_ARRAY3D(sum_weight)
 	        {
@@ -1340,11 +1360,8 @@ void BackProjector::applyHelicalSymmetry(int nr_helical_asu, RFLOAT helical_twis
 					// Also apply a phase shift for helical translation along Z
 					if (ABS(helical_rise) > 0.)
 					{
-						RFLOAT zshift = hh * helical_rise;
-						zshift /= - ori_size * (RFLOAT)padding_factor;
-						RFLOAT dotp = 2 * PI * (z * zshift);
-						RFLOAT a = cos(dotp);
-						RFLOAT b = sin(dotp);
+						RFLOAT a = shift_cos[k - STARTINGZ(sum_weight)];
+						RFLOAT b = shift_sin[k - STARTINGZ(sum_weight)];
 						RFLOAT c = ddd.real;
 						RFLOAT d = ddd.imag;
 						RFLOAT ac = a * c;
@@ -1387,7 +1404,144 @@ void BackProjector::applyHelicalSymmetry(int nr_helical_asu, RFLOAT helical_twis
 
 }
 
-void BackProjector::applyPointGroupSymmetry()
+// Point group symmetry applied by multiple threads
+// Each thread takes whole Z slices of the output, and gathers the contributions of all symmetry operators for each voxel in one pass
+class PointGroupSymmetryJob
+{
+public:
+	const MultidimArray<Complex> *data;
+	const MultidimArray<RFLOAT> *weight;
+	MultidimArray<Complex> *sum_data;
+	MultidimArray<RFLOAT> *sum_weight;
+	int rmax2;
+
+	// Rotation matrices (upper-left 3x3 part, row by row) of all symmetry operators except the identity
+	std::vector<RFLOAT> R;
+
+	// Distribute the Z slices over the threads
+	ThreadTaskDistributor *distributor;
+};
+
+void globalThreadApplyPointGroupSymmetry(ThreadArgument &thArg)
+{
+	PointGroupSymmetryJob *job = (PointGroupSymmetryJob*) thArg.workClass;
+	const MultidimArray<Complex>& data = *(job->data);
+	const MultidimArray<RFLOAT>& weight = *(job->weight);
+	MultidimArray<Complex>& sum_data = *(job->sum_data);
+	MultidimArray<RFLOAT>& sum_weight = *(job->sum_weight);
+	int nr_syms = job->R.size() / 9;
+	long int dx = 1, dy = XSIZE(data), dz = YXSIZE(data);
+
+	size_t first_z, last_z;
+	while (job->distributor->getTasks(first_z, last_z))
+	{
+		for (int k = STARTINGZ(sum_weight) + first_z; k <= STARTINGZ(sum_weight) + (int)last_z; k++)
+		{
+			for (int i = STARTINGY(sum_weight); i <= FINISHINGY(sum_weight); i++)
+			{
+				for (int j = STARTINGX(sum_weight); j <= FINISHINGX(sum_weight); j++)
+				{
+					RFLOAT x, y, z, r2;
+					x = (RFLOAT)j; // STARTINGX(sum_weight) is zero!
+					y = (RFLOAT)i;
+					z = (RFLOAT)k;
+					r2 = x*x + y*y + z*z;
+					if (r2 > job->rmax2)
+						continue;
+
+					// Accumulate the real and imaginary parts of the data, and the weight, separately over all symmetry operators
+					// (in the same order as the operators in the list)
+					Complex& sum_d = A3D_ELEM(sum_data, k, i, j);
+					RFLOAT& sum_w = A3D_ELEM(sum_weight, k, i, j);
+					RFLOAT sum_re = sum_d.real, sum_im = sum_d.imag, sum_wgt = sum_w;
+					for (int isym = 0; isym < nr_syms; isym++)
+					{
+						const RFLOAT* R = &(job->R[9 * isym]);
+						RFLOAT xp, yp, zp, fx, fy, fz;
+						int x0, y0, z0;
+
+						// coords_output(x,y) = A * coords_input (xp,yp)
+						xp = x * R[0] + y * R[1] + z * R[2];
+						yp = x * R[3] + y * R[4] + z * R[5];
+						zp = x * R[6] + y * R[7] + z * R[8];
+
+						// Only asymmetric half is stored
+						bool is_neg_x = (xp < 0);
+						if (is_neg_x)
+						{
+							// Get complex conjugated hermitian symmetry pair
+							xp = -xp;
+							yp = -yp;
+							zp = -zp;
+						}
+
+						// Trilinear interpolation (with physical coords)
+						// Subtract STARTINGY and STARTINGZ to accelerate access to data (STARTINGX=0)
+						x0 = FLOOR(xp);
+						fx = xp - x0;
+
+						y0 = FLOOR(yp);
+						fy = yp - y0;
+						y0 -=  STARTINGY(data);
+
+						z0 = FLOOR(zp);
+						fz = zp - z0;
+						z0 -= STARTINGZ(data);
+
+#ifdef CHECK_SIZE
+						if (x0 < 0 || y0 < 0 || z0 < 0 ||
+							x0 + 1 >= XSIZE(data) || y0 + 1 >= YSIZE(data) || z0 + 1 >= ZSIZE(data) )
+						{
+							std::cerr << " x0= " << x0 << " y0= " << y0 << " z0= " << z0 << std::endl;
+							data.printShape();
+							REPORT_ERROR("BackProjector::applyPointGroupSymmetry: checksize!!!");
+						}
+#endif
+						long int n000 = z0 * dz + y0 * dy + x0;
+						const Complex* d = MULTIDIM_ARRAY(data) + n000;
+						const RFLOAT* w = MULTIDIM_ARRAY(weight) + n000;
+
+						// First interpolate (complex) data, its real and imaginary parts one by one
+						RFLOAT dx00, dx01, dx10, dx11, dxy0, dxy1;
+						dx00 = LIN_INTERP(fx, d[0].real, d[dx].real);
+						dx01 = LIN_INTERP(fx, d[dz].real, d[dz + dx].real);
+						dx10 = LIN_INTERP(fx, d[dy].real, d[dy + dx].real);
+						dx11 = LIN_INTERP(fx, d[dz + dy].real, d[dz + dy + dx].real);
+						dxy0 = LIN_INTERP(fy, dx00, dx10);
+						dxy1 = LIN_INTERP(fy, dx01, dx11);
+						sum_re += LIN_INTERP(fz, dxy0, dxy1);
+
+						dx00 = LIN_INTERP(fx, d[0].imag, d[dx].imag);
+						dx01 = LIN_INTERP(fx, d[dz].imag, d[dz + dx].imag);
+						dx10 = LIN_INTERP(fx, d[dy].imag, d[dy + dx].imag);
+						dx11 = LIN_INTERP(fx, d[dz + dy].imag, d[dz + dy + dx].imag);
+						dxy0 = LIN_INTERP(fy, dx00, dx10);
+						dxy1 = LIN_INTERP(fy, dx01, dx11);
+						// Take complex conjugated for half with negative x
+						if (is_neg_x)
+							sum_im += -(LIN_INTERP(fz, dxy0, dxy1));
+						else
+							sum_im += LIN_INTERP(fz, dxy0, dxy1);
+
+						// Then interpolate (real) weight
+						dx00 = LIN_INTERP(fx, w[0], w[dx]);
+						dx01 = LIN_INTERP(fx, w[dz], w[dz + dx]);
+						dx10 = LIN_INTERP(fx, w[dy], w[dy + dx]);
+						dx11 = LIN_INTERP(fx, w[dz + dy], w[dz + dy + dx]);
+						dxy0 = LIN_INTERP(fy, dx00, dx10);
+						dxy1 = LIN_INTERP(fy, dx01, dx11);
+						sum_wgt += LIN_INTERP(fz, dxy0, dxy1);
+					}
+					sum_d.real = sum_re;
+					sum_d.imag = sum_im;
+					sum_w = sum_wgt;
+				}
+			}
+		}
+	}
+}
+
+void BackProjector::applyPointGroupSymmetry(int nr_threads)
 {
 
 //#define DEBUG_SYMM
@@ -1402,130 +1556,35 @@ void BackProjector::applyPointGroupSymmetry()
 		Matrix2D<RFLOAT> L(4, 4), R(4, 4); // A matrix from the list
 		MultidimArray<RFLOAT> sum_weight;
 		MultidimArray<Complex > sum_data;
-        RFLOAT x, y, z, fx, fy, fz, xp, yp, zp, r2;
-        bool is_neg_x;
-        int x0, x1, y0, y1, z0, z1;
-    	Complex d000, d001, d010, d011, d100, d101, d110, d111;
-    	Complex dx00, dx01, dx10, dx11, dxy0, dxy1;
-    	RFLOAT dd000, dd001, dd010, dd011, dd100, dd101, dd110, dd111;
-    	RFLOAT ddx00, ddx01, ddx10, ddx11, ddxy0, ddxy1;
+		PointGroupSymmetryJob job;
 
         // First symmetry operator (not stored in SL) is the identity matrix
 		sum_weight = weight;
 		sum_data = data;
-		// Loop over all other symmetry operators
-	    for (int isym = 0; isym < SL.SymsNo(); isym++)
-	    {
-	        SL.get_matrices(isym, L, R);
-#ifdef DEBUG_SYMM
-	        std::cerr << " isym= " << isym << " R= " << R << std::endl;
-#endif
-
-	        // Loop over all points in the output (i.e. rotated, or summed) array
-	        FOR_ALL_ELEMENTS_IN_ARRAY3D(sum_weight)
-	        {
 
-	        	x = (RFLOAT)j; // STARTINGX(sum_weight) is zero!
-	        	y = (RFLOAT)i;
-	        	z = (RFLOAT)k;
-	        	r2 = x*x + y*y + z*z;
-	        	if (r2 <= rmax2)
-	        	{
-	        		// coords_output(x,y) = A * coords_input (xp,yp)
-					xp = x * R(0, 0) + y * R(0, 1) + z * R(0, 2);
-					yp = x * R(1, 0) + y * R(1, 1) + z * R(1, 2);
-					zp = x * R(2, 0) + y * R(2, 1) + z * R(2, 2);
-
-					// Only asymmetric half is stored
-					if (xp < 0)
-					{
-						// Get complex conjugated hermitian symmetry pair
-						xp = -xp;
-						yp = -yp;
-						zp = -zp;
-						is_neg_x = true;
-					}
-					else
-					{
-						is_neg_x = false;
-					}
-
-					// Trilinear interpolation (with physical coords)
-					// Subtract STARTINGY and STARTINGZ to accelerate access to data (STARTINGX=0)
-					// In that way use DIRECT_A3D_ELEM, rather than A3D_ELEM
-	    			x0 = FLOOR(xp);
-					fx = xp - x0;
-					x1 = x0 + 1;
-
-					y0 = FLOOR(yp);
-					fy = yp - y0;
-					y0 -=  STARTINGY(data);
-					y1 = y0 + 1;
-
-					z0 = FLOOR(zp);
-					fz = zp - z0;
-					z0 -= STARTINGZ(data);
-					z1 = z0 + 1;
-
-#ifdef CHECK_SIZE
-					if (x0 < 0 || y0 < 0 || z0 < 0 ||
-						x1 < 0 || y1 < 0 || z1 < 0 ||
-						x0 >= XSIZE(data) || y0  >= YSIZE(data) || z0 >= ZSIZE(data) ||
-						x1 >= XSIZE(data) || y1  >= YSIZE(data)  || z1 >= ZSIZE(data) 	)
-					{
-						std::cerr << " x0= " << x0 << " y0= " << y0 << " z0= " << z0 << std::endl;
-						std::cerr << " x1= " << x1 << " y1= " << y1 << " z1= " << z1 << std::endl;
-						data.printShape();
-						REPORT_ERROR("BackProjector::applyPointGroupSymmetry: checksize!!!");
-					}
+		// All other symmetry operators
+		for (int isym = 0; isym < SL.SymsNo(); isym++)
+		{
+			SL.get_matrices(isym, L, R);
+#ifdef DEBUG_SYMM
+			std::cerr << " isym= " << isym << " R= " << R << std::endl;
 #endif
-					// First interpolate (complex) data
-					d000 = DIRECT_A3D_ELEM(data, z0, y0, x0);
-					d001 = DIRECT_A3D_ELEM(data, z0, y0, x1);
-					d010 = DIRECT_A3D_ELEM(data, z0, y1, x0);
-					d011 = DIRECT_A3D_ELEM(data, z0, y1, x1);
-					d100 = DIRECT_A3D_ELEM(data, z1, y0, x0);
-					d101 = DIRECT_A3D_ELEM(data, z1, y0, x1);
-					d110 = DIRECT_A3D_ELEM(data, z1, y1, x0);
-					d111 = DIRECT_A3D_ELEM(data, z1, y1, x1);
-
-					dx00 = LIN_INTERP(fx, d000, d001);
-					dx01 = LIN_INTERP(fx, d100, d101);
-					dx10 = LIN_INTERP(fx, d010, d011);
-					dx11 = LIN_INTERP(fx, d110, d111);
-					dxy0 = LIN_INTERP(fy, dx00, dx10);
-					dxy1 = LIN_INTERP(fy, dx01, dx11);
-
-					// Take complex conjugated for half with negative x
-					if (is_neg_x)
-						A3D_ELEM(sum_data, k, i, j) += conj(LIN_INTERP(fz, dxy0, dxy1));
-					else
-						A3D_ELEM(sum_data, k, i, j) += LIN_INTERP(fz, dxy0, dxy1);
-
-					// Then interpolate (real) weight
-					dd000 = DIRECT_A3D_ELEM(weight, z0, y0, x0);
-					dd001 = DIRECT_A3D_ELEM(weight, z0, y0, x1);
-					dd010 = DIRECT_A3D_ELEM(weight, z0, y1, x0);
-					dd011 = DIRECT_A3D_ELEM(weight, z0, y1, x1);
-					dd100 = DIRECT_A3D_ELEM(weight, z1, y0, x0);
-					dd101 = DIRECT_A3D_ELEM(weight, z1, y0, x1);
-					dd110 = DIRECT_A3D_ELEM(weight, z1, y1, x0);
-					dd111 = DIRECT_A3D_ELEM(weight, z1, y1, x1);
-
-					ddx00 = LIN_INTERP(fx, dd000, dd001);
-					ddx01 = LIN_INTERP(fx, dd100, dd101);
-					ddx10 = LIN_INTERP(fx, dd010, dd011);
-					ddx11 = LIN_INTERP(fx, dd110, dd111);
-					ddxy0 = LIN_INTERP(fy, ddx00, ddx10);
-					ddxy1 = LIN_INTERP(fy, ddx01, ddx11);
-
-					A3D_ELEM(sum_weight, k, i, j) +=  LIN_INTERP(fz, ddxy0, ddxy1);
-
-	        	} // end if r2 <= rmax2
-
-	        } // end loop over all elements of sum_weight
+			for (int ii = 0; ii < 3; ii++)
+				for (int jj = 0; jj < 3; jj++)
+					job.R.push_back(R(ii, jj));
+		}
 
-	    } // end loop over symmetry operators
+		// Loop over all points in the output (i.e. rotated, or summed) array
+		job.data = &data;
+		job.weight = &weight;
+		job.sum_data = &sum_data;
+		job.sum_weight = &sum_weight;
+		job.rmax2 = rmax2;
+		job.distributor = new ThreadTaskDistributor(ZSIZE(sum_weight), 1);
+		ThreadManager *threads = new ThreadManager(XMIPP_MAX(1, nr_threads), &job);
+		threads->run(globalThreadApplyPointGroupSymmetry);
+		delete threads;
+		delete job.distributor;
 
 	    data = sum_data;
 	    weight = sum_weight;
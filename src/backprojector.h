@@ -275,7 +275,7 @@ public:
 
 	/*  Enforce Hermitian symmetry, apply helical symmetry as well as point-group symmetry
 	 */
-	void symmetrise(int nr_helical_asu = 1, RFLOAT helical_twist = 0., RFLOAT helical_rise = 0.);
+	void symmetrise(int nr_helical_asu = 1, RFLOAT helical_twist = 0., RFLOAT helical_rise = 0., int nr_threads = 1);
 
 	/* Enforce hermitian symmetry on data and on weight (all points in the x==0 plane)
 	* Because the interpolations are numerical, hermitian symmetry may be broken.
@@ -288,8 +288,9 @@ public:
 	void applyHelicalSymmetry(int nr_helical_asu = 1, RFLOAT helical_twist = 0., RFLOAT helical_rise = 0.);
 
 	/* Applies the symmetry from the SymList object to the weight and the data array
+	 * The Z slices of the output are distributed over nr_threads threads
 	 */
-	void applyPointGroupSymmetry();
+	void applyPointGroupSymmetry(int nr_threads = 1);
 
 
    /* Convolute in Fourier-space with the blob by multiplication in real-space
@@ -18,6 +18,7 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/exp_model.h"
+#include "src/parallel.h"
 #include <sys/statvfs.h>
 
 void ExpOriginalParticle::addParticle(long int _particle_id, int _random_subset, int _order)
@@ -662,32 +663,135 @@ void Experiment::deleteDataOnScratch()
 
 }
 
-void Experiment::copyParticlesToScratch(int verb, bool do_copy, bool also_do_ctf_image, long int keep_free_scratch_Gb)
+// Particles that are copied to the scratch directory by multiple threads
+class ScratchCopyJob
 {
+public:
+	// Names of the particles (and of their CTF images for subtomograms) in the order they will have on scratch
+	std::vector<FileName> fn_imgs, fn_ctfs;
 
-	// This function relies on prepareScratchDirectory() being called before!
+	// Particles are copied in batches of consecutive particles from the same stack,
+	// batch i contains particles batch_start[i] until batch_start[i+1]-1
+	std::vector<long int> batch_start;
 
-	long int nr_part = MDimg.numberOfObjects();
-	int barstep;
-	if (verb > 0)
+	// Where to write the particles
+	FileName fn_scratch;
+
+	bool is_3D, also_do_ctf_image;
+
+	// Size in bytes of one 2D image inside the stack on scratch
+	size_t one_img_size;
+
+	// Statistics of the images written by each thread, for the header of the stack
+	std::vector<ImageStackStatistics> thread_stats;
+
+	// Distribute the batches over the threads
+	ThreadTaskDistributor *distributor;
+
+	// Progress
+	int verb;
+	long int nr_done;
+
+	// First error of any of the threads (empty if none), reported by copyParticlesToScratch once all threads are done
+	std::string error_msg;
+};
+
+static pthread_mutex_t scratch_copy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void globalThreadCopyParticlesToScratch(ThreadArgument &thArg)
+{
+	ScratchCopyJob *job = (ScratchCopyJob*) thArg.workClass;
+
+	// All 2D particles go into a single stack, each thread writes its own images at their final position
+	int fd = -1;
+	try
 	{
-		std::cout << " Copying particles to scratch directory: " << fn_scratch << std::endl;
-		init_progress_bar(nr_part);
-		barstep = XMIPP_MAX(1, nr_part / 60);
+		FileName fn_out_stack = job->fn_scratch + "particles.mrcs";
+		if (!job->is_3D && (fd = open(fn_out_stack.c_str(), O_WRONLY)) == -1)
+			REPORT_ERROR("Experiment::copyParticlesToScratch: cannot open " + fn_out_stack);
+
+		fImageHandler hFile;
+		FileName fn_stack, fn_open_stack = "";
+		long int dump;
+		size_t first_batch, last_batch;
+		bool do_stop = false;
+		while (!do_stop && job->distributor->getTasks(first_batch, last_batch))
+		{
+			for (size_t ibatch = first_batch; ibatch <= last_batch && !do_stop; ibatch++)
+			{
+				for (long int ipart = job->batch_start[ibatch]; ipart < job->batch_start[ibatch+1]; ipart++)
+				{
+					if (job->is_3D)
+					{
+						// For subtomograms, write individual .mrc files, possibly also CTF images
+						Image<RFLOAT> img;
+						img.read(job->fn_imgs[ipart]);
+						img.write(job->fn_scratch + "particle" + integerToString(ipart+1, 5)+".mrc");
+						if (job->also_do_ctf_image)
+						{
+							img.read(job->fn_ctfs[ipart]);
+							img.write(job->fn_scratch + "particle_ctf" + integerToString(ipart+1, 5)+".mrc");
+						}
+					}
+					else
+					{
+						// The particles in one batch come from the same stack: read it sequentially from its memory mapping
+						job->fn_imgs[ipart].decompose(dump, fn_stack);
+						if (fn_stack != fn_open_stack)
+						{
+							hFile.openFile(fn_stack, WRITE_READONLY, true, true);
+							fn_open_stack = fn_stack;
+						}
+						Image<float> img;
+						img.readFromOpenFile(job->fn_imgs[ipart], hFile, -1, false);
+						if (ZYXSIZE(img())*sizeof(float) != job->one_img_size)
+							REPORT_ERROR("Experiment::copyParticlesToScratch: image " + job->fn_imgs[ipart] + " has a different size than the first particle");
+						off_t myoffset = MRCSIZE + ipart * job->one_img_size;
+						if (pwrite(fd, MULTIDIM_ARRAY(img()), job->one_img_size, myoffset) != (ssize_t)job->one_img_size)
+							REPORT_ERROR("Experiment::copyParticlesToScratch: error in writing to " + fn_out_stack);
+						job->thread_stats[thArg.thread_id].addImage(img());
+					}
+				}
+
+				pthread_mutex_lock(&scratch_copy_mutex);
+				job->nr_done += job->batch_start[ibatch+1] - job->batch_start[ibatch];
+				if (job->verb > 0)
+					progress_bar(job->nr_done);
+				// Stop as soon as another thread has failed
+				do_stop = (job->error_msg != "");
+				pthread_mutex_unlock(&scratch_copy_mutex);
+			}
+		}
+	}
+	catch (RelionError XE)
+	{
+		pthread_mutex_lock(&scratch_copy_mutex);
+		if (job->error_msg == "")
+			job->error_msg = XE.msg;
+		pthread_mutex_unlock(&scratch_copy_mutex);
 	}
 
+	if (fd != -1)
+		close(fd);
+}
+
+void Experiment::copyParticlesToScratch(int verb, bool do_copy, bool also_do_ctf_image, long int keep_free_scratch_Gb, int nr_threads)
+{
+
+	// This function relies on prepareScratchDirectory() being called before!
+
+	long int nr_part = MDimg.numberOfObjects();
+
 	long int one_part_space, used_space = 0.;
 	long int max_space = (free_space_Gb - keep_free_scratch_Gb)*1024*1024*1024; // in bytes
 
-	// Loop over all particles and copy them one-by-one
-	FileName fn_open_stack = "";
-	fImageHandler hFile;
+	// First determine how many particles fit on the scratch disk (without reading any images)
+	ScratchCopyJob job;
+	long int one_img_space;
 	nr_parts_on_scratch = 0;
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDimg)
 	{
-		long int imgno;
-		FileName fn_img, fn_ctf, fn_stack, fn_new;
-		Image<RFLOAT> img;
+		FileName fn_img, fn_ctf;
 		MDimg.getValue(EMDL_IMAGE_NAME, fn_img);
 
 		// Get the size of the first particle
@@ -696,6 +800,7 @@ void Experiment::copyParticlesToScratch(int verb, bool do_copy, bool also_do_ctf
 			Image<RFLOAT> tmp;
 			tmp.read(fn_img, false); // false means: only read the header!
 			one_part_space = ZYXSIZE(tmp())*sizeof(float); // MRC images are stored in floats!
+			one_img_space = one_part_space;
 			bool myis3D = (ZSIZE(tmp()) > 1);
 			if (myis3D != is_3D)
 				REPORT_ERROR("BUG: inconsistent is_3D values!");
@@ -709,8 +814,7 @@ void Experiment::copyParticlesToScratch(int verb, bool do_copy, bool also_do_ctf
 			}
 		}
 
-		// Now we have the particle in memory
-		// See how much space it occupies
+		// See how much space this particle occupies
 		used_space += one_part_space;
 		// If there is no more space, exit the loop over all objects to stop copying files and change filenames in MDimg
 		if (used_space > max_space)
@@ -722,59 +826,97 @@ void Experiment::copyParticlesToScratch(int verb, bool do_copy, bool also_do_ctf
 			break;
 		}
 
-		// Read in the particle image, and write out on scratch
 		if (do_copy)
 		{
-			if (is_3D)
+			job.fn_imgs.push_back(fn_img);
+			if (is_3D && also_do_ctf_image)
 			{
-				// For subtomograms, write individual .mrc files,possibly also CTF images
-				img.read(fn_img);
-				fn_new = fn_scratch + "particle" + integerToString(nr_parts_on_scratch+1, 5)+".mrc";
-				img.write(fn_new);
-				if (also_do_ctf_image)
-				{
-					FileName fn_ctf;
-					MDimg.getValue(EMDL_CTF_IMAGE, fn_ctf);
-					img.read(fn_ctf);
-					fn_new = fn_scratch + "particle_ctf" + integerToString(nr_parts_on_scratch+1, 5)+".mrc";
-					img.write(fn_new);
-				}
-			}
-			else
-			{
-				// Only open/close new stacks, so check if this is a new stack
-				fn_img.decompose(imgno, fn_stack);
-				if (fn_stack != fn_open_stack)
-				{
-					// Manual closing isn't necessary: if still open, then openFile will first close the filehandler
-					// Also closing the last one isn't necessary, as destructor will do this.
-					//if (fn_open_stack != "")
-					//	hFile.closeFile();
-					hFile.openFile(fn_stack, WRITE_READONLY);
-					fn_open_stack = fn_stack;
-				}
-				img.readFromOpenFile(fn_img, hFile, -1, false);
-
-				fn_new.compose(nr_parts_on_scratch+1, fn_scratch + "particles.mrcs");
-				if (nr_parts_on_scratch == 0)
-					img.write(fn_new, -1, false, WRITE_OVERWRITE);
-				else
-					img.write(fn_new, -1, true, WRITE_APPEND);
+				MDimg.getValue(EMDL_CTF_IMAGE, fn_ctf);
+				job.fn_ctfs.push_back(fn_ctf);
 			}
 		}
 
-		// Update the counter and progress bar
 		nr_parts_on_scratch++;
+	}
+
+	if (!do_copy || nr_parts_on_scratch == 0)
+		return;
 
-		if (verb > 0 && nr_parts_on_scratch % barstep == 0)
-			progress_bar(nr_parts_on_scratch);
+	if (verb > 0)
+	{
+		std::cout << " Copying particles to scratch directory: " << fn_scratch << std::endl;
+		init_progress_bar(nr_parts_on_scratch);
+	}
 
+	job.fn_scratch = fn_scratch;
+	job.is_3D = is_3D;
+	job.also_do_ctf_image = also_do_ctf_image;
+	job.one_img_size = one_img_space;
+	job.verb = verb;
+	job.nr_done = 0;
+
+	long int first_part = 0;
+	FileName fn_stack_scratch = fn_scratch + "particles.mrcs";
+	ImageStackStatistics stack_stats;
+	if (!is_3D)
+	{
+		// Write the first particle with its header, the threads will write all others directly at their final position
+		Image<float> img;
+		FileName fn_new;
+		img.read(job.fn_imgs[0]);
+		fn_new.compose(1, fn_stack_scratch);
+		img.write(fn_new, -1, false, WRITE_OVERWRITE);
+		stack_stats.addImage(img());
+		first_part = job.nr_done = 1;
+	}
+
+	// Make batches of at most max_batch consecutive particles from the same stack
+	// (they are read sequentially, and small enough to keep all threads busy until the end)
+	const long int max_batch = (is_3D) ? 1 : 256;
+	FileName fn_stack, fn_prev_stack = "";
+	long int dump;
+	for (long int ipart = first_part; ipart < nr_parts_on_scratch; ipart++)
+	{
+		if (!is_3D)
+			job.fn_imgs[ipart].decompose(dump, fn_stack);
+		if (job.batch_start.size() == 0 || fn_stack != fn_prev_stack || ipart - job.batch_start.back() >= max_batch)
+			job.batch_start.push_back(ipart);
+		fn_prev_stack = fn_stack;
+	}
+	job.batch_start.push_back(nr_parts_on_scratch);
+
+	long int nr_batches = job.batch_start.size() - 1;
+	if (nr_batches > 0)
+	{
+		int my_nr_threads = XMIPP_MIN(nr_threads, nr_batches);
+		job.thread_stats.resize(my_nr_threads);
+		job.distributor = new ThreadTaskDistributor(nr_batches, 1);
+		ThreadManager *threads = new ThreadManager(my_nr_threads, &job);
+		threads->run(globalThreadCopyParticlesToScratch);
+		delete threads;
+		delete job.distributor;
+		if (job.error_msg != "")
+			REPORT_ERROR("Experiment::copyParticlesToScratch ERROR: in a thread that copies the particles: " + job.error_msg);
+		for (int ithread = 0; ithread < my_nr_threads; ithread++)
+			stack_stats.addStatistics(job.thread_stats[ithread]);
+	}
+
+	if (!is_3D)
+	{
+		// Set the number of images and the statistics of all particles in the MRC header of the stack on scratch
+		int fd;
+		if ( (fd = open(fn_stack_scratch.c_str(), O_WRONLY)) == -1 )
+			REPORT_ERROR("Experiment::copyParticlesToScratch: cannot open " + fn_stack_scratch);
+		RFLOAT minval, maxval, avg, stddev;
+		stack_stats.getStatistics(minval, maxval, avg, stddev);
+		updateMRCStackHeader(fd, fn_stack_scratch, nr_parts_on_scratch, minval, maxval, avg, stddev);
+		close(fd);
 	}
 
 	if (verb > 0)
-		progress_bar(nr_part);
+		progress_bar(nr_parts_on_scratch);
 
-	if (do_copy && nr_parts_on_scratch>1)
+	if (nr_parts_on_scratch>1)
 	{
 		std::string command = " chmod 777 " + fn_scratch + "particle*";
 		if (system(command.c_str()))
@@ -793,7 +935,7 @@ void Experiment::usage()
 // Read from file
 void Experiment::read(FileName fn_exp, bool do_ignore_original_particle_name,
 		bool do_ignore_group_name, bool do_preread_images,
-		bool need_tiltpsipriors_for_helical_refine)
+		bool need_tiltpsipriors_for_helical_refine, bool do_preread_float16)
 {
 
 //#define DEBUG_READ
@@ -821,6 +963,7 @@ void Experiment::read(FileName fn_exp, bool do_ignore_original_particle_name,
 	// Initialize by emptying everything
 	clear();
 	long int group_id, mic_id, part_id;
+	long int nr_clipped_float16 = 0;
 
 	if (!fn_exp.isStarFile())
 	{
@@ -858,7 +1001,7 @@ void Experiment::read(FileName fn_exp, bool do_ignore_original_particle_name,
 				}
 				img.readFromOpenFile(fn_img, hFile, -1, false);
 				img().setXmippOrigin();
-				particles[part_id].img = img();
+				nr_clipped_float16 += particles[part_id].setPrereadImage(img(), do_preread_float16);
 			}
 			// Also add OriginalParticle
 			(ori_particles[addOriginalParticle("particle")]).addParticle(part_id, 0, -1);
@@ -1037,7 +1180,7 @@ void Experiment::read(FileName fn_exp, bool do_ignore_original_particle_name,
 				}
 				img.readFromOpenFile(fn_img, hFile, -1, false);
 				img().setXmippOrigin();
-				particles[part_id].img = img();
+				nr_clipped_float16 += particles[part_id].setPrereadImage(img(), do_preread_float16);
 			}
 
 			// Add this particle to an existing OriginalParticle, or create a new OriginalParticle
@@ -1130,6 +1273,9 @@ void Experiment::read(FileName fn_exp, bool do_ignore_original_particle_name,
 	//std::cin >> c;
 #endif
 
+	if (nr_clipped_float16 > 0)
+		std::cerr << " + WARNING: " << nr_clipped_float16 << " pixel values of the pre-read particles were beyond the 16-bit float range and have been clipped to +/-65504. Are the particles normalised? If not, do not use --preread_float16" << std::endl;
+
 	// Make sure some things are always set in the MDimg
 	bool have_rot  = MDimg.containsLabel(EMDL_ORIENT_ROT);
 	bool have_tilt = MDimg.containsLabel(EMDL_ORIENT_TILT);
@@ -52,6 +52,9 @@ public:
 	// Pre-read array of the image in RAM
 	MultidimArray<float> img;
 
+	// Alternatively, the pre-read image stored as 16-bit floats (half the memory of img)
+	MultidimArray<unsigned short> img_half;
+
 	// Empty Constructor
 	ExpParticle()
 	{
@@ -70,6 +73,57 @@ public:
 		id = micrograph_id = group_id = -1;
 		random_subset = 0;
 		img.clear();
+		img_half.clear();
+	}
+
+	// Store a pre-read image in RAM, optionally compressed to 16-bit floats
+	// Values beyond the 16-bit range (|x| > 65504) are clipped to it, their number is returned
+	long int setPrereadImage(const MultidimArray<float> &in, bool do_float16 = false)
+	{
+		long int nr_clipped = 0;
+		if (do_float16)
+		{
+			const float max_half = 65504.;
+			img.clear();
+			img_half.reshape(in);
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(in)
+			{
+				float val = DIRECT_MULTIDIM_ELEM(in, n);
+				if (val > max_half || val < -max_half)
+				{
+					val = (val > 0.) ? max_half : -max_half;
+					nr_clipped++;
+				}
+				DIRECT_MULTIDIM_ELEM(img_half, n) = floatToHalf(val);
+			}
+		}
+		else
+		{
+			img_half.clear();
+			img = in;
+		}
+		return nr_clipped;
+	}
+
+	// Decode the pre-read image from RAM
+	void getPrereadImage(MultidimArray<RFLOAT> &out) const
+	{
+		if (MULTIDIM_SIZE(img_half) > 0)
+		{
+			out.reshape(img_half);
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img_half)
+			{
+				DIRECT_MULTIDIM_ELEM(out, n) = (RFLOAT)halfToFloat(DIRECT_MULTIDIM_ELEM(img_half, n));
+			}
+		}
+		else
+		{
+			out.reshape(img);
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img)
+			{
+				DIRECT_MULTIDIM_ELEM(out, n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(img, n);
+			}
+		}
 	}
 
 };
@@ -374,7 +428,8 @@ public:
 	// Copy particles from their original position to a scratch directory
 	// Monitor when the scratch disk gets to have fewer than free_scratch_Gb space,
 	// in that case, stop copying, and keep reading particles from where they were...
-	void copyParticlesToScratch(int verb, bool do_copy = true, bool also_do_ctf_image = false, long int free_scratch_Gb = 10);
+	// Batches of consecutive particles from the same stack are copied in parallel by nr_threads threads
+	void copyParticlesToScratch(int verb, bool do_copy = true, bool also_do_ctf_image = false, long int free_scratch_Gb = 10, int nr_threads = 1);
 
 
 	// Print help message for possible command-line options
@@ -383,7 +438,7 @@ public:
 	// Read from file
 	void read(FileName fn_in, bool do_ignore_original_particle_name = false,
 			bool do_ignore_group_name = false, bool do_preread_images = false,
-			bool need_tiltpsipriors_for_helical_refine = false);
+			bool need_tiltpsipriors_for_helical_refine = false, bool do_preread_float16 = false);
 
 	// Write
 	void write(FileName fn_root);
@@ -48,14 +48,464 @@
 #include "src/args.h"
 #include <string.h>
 #include <math.h>
+#include <map>
+#include <sstream>
+#include <unistd.h>
 
 static pthread_mutex_t fftw_plan_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 //#define DEBUG_PLANS
 
+#ifdef RELION_SINGLE_PRECISION
+typedef fftwf_plan FftwPlan;
+#else
+typedef fftw_plan FftwPlan;
+#endif
+
+#define FFTW_PLAN_R2C 0
+#define FFTW_PLAN_C2C 1
+// In-place 1D c2c transforms along the columns of a 2D array of N[0] rows of N[1] elements
+#define FFTW_PLAN_C2C_COLUMNS 2
+
+// Process-wide cache of FFTW plans ----------------------------------------
+// Key for the plan cache: plans can be re-used (through the new-array execute functions)
+// for all arrays of the same kind, dimensions, batch size and alignment
+class FftwPlanKey
+{
+public:
+	int kind, ndim, howmany, nr_threads, align_in, align_out;
+	int N[3];
+	unsigned int rigour;
+
+	bool operator<(const FftwPlanKey &op) const
+	{
+		if (kind != op.kind) return kind < op.kind;
+		if (ndim != op.ndim) return ndim < op.ndim;
+		for (int i = 0; i < ndim; i++)
+			if (N[i] != op.N[i]) return N[i] < op.N[i];
+		if (howmany != op.howmany) return howmany < op.howmany;
+		if (align_in != op.align_in) return align_in < op.align_in;
+		if (align_out != op.align_out) return align_out < op.align_out;
+		if (nr_threads != op.nr_threads) return nr_threads < op.nr_threads;
+		return rigour < op.rigour;
+	}
+};
+
+class FftwPlanPair
+{
+public:
+	FftwPlan forward, backward;
+	// Number of (Batch)FourierTransformer objects that currently use these plans
+	int users;
+};
+
+static void exportFftwWisdomAtExit();
+
+class FftwPlanCache
+{
+public:
+	std::map<FftwPlanKey, FftwPlanPair> plans;
+
+	// Planner flag for new plans, and whether it was set explicitly (otherwise read from the environment)
+	unsigned int rigour;
+	bool rigour_is_set;
+
+	// Wisdom file, whether it has been read, and whether new wisdom was accumulated since
+	std::string fn_wisdom;
+	bool is_initialised, wisdom_is_new;
+
+	FftwPlanCache(): rigour(FFTW_ESTIMATE), rigour_is_set(false), is_initialised(false), wisdom_is_new(false) {}
+
+	// Write new wisdom to fn_wisdom, if a wisdom file was given (mutex locked by caller)
+	void exportNewWisdom()
+	{
+		if (wisdom_is_new && fn_wisdom != "" && exportFftwWisdom(fn_wisdom))
+			wisdom_is_new = false;
+	}
+
+	// Read planner settings and wisdom, upon creation of the first plan (mutex locked by caller)
+	void initialise()
+	{
+		if (is_initialised)
+			return;
+
+		char *penv;
+		if (!rigour_is_set)
+		{
+			penv = getenv("RELION_FFTW_PLANNER");
+			if (penv != NULL)
+			{
+				std::string planner(penv);
+				if (planner == "estimate")
+					rigour = FFTW_ESTIMATE;
+				else if (planner == "measure")
+					rigour = FFTW_MEASURE;
+				else if (planner == "patient")
+					rigour = FFTW_PATIENT;
+				else
+					std::cerr << " WARNING: unrecognised value for RELION_FFTW_PLANNER: " << planner << "; using estimate" << std::endl;
+			}
+		}
+
+#ifdef HAVE_FFTW_THREADS
+		// This needs to be called once, before any other FFTW function
+		static bool threads_are_initialised = false;
+		if (!threads_are_initialised)
+		{
+#ifdef RELION_SINGLE_PRECISION
+			fftwf_init_threads();
+#else
+			fftw_init_threads();
+#endif
+			threads_are_initialised = true;
+		}
+#endif
+
+		// Wisdom is only read and written if the user asked for it
+		penv = getenv("RELION_FFTW_WISDOM");
+		fn_wisdom = (penv != NULL) ? std::string(penv) : std::string("");
+		if (fn_wisdom != "")
+		{
+			if (exists(fn_wisdom))
+				importFftwWisdom(fn_wisdom);
+			static bool exit_handler_is_set = false;
+			if (!exit_handler_is_set)
+			{
+				atexit(exportFftwWisdomAtExit);
+				exit_handler_is_set = true;
+			}
+		}
+
+		is_initialised = true;
+	}
+
+	// Destroy all plans that are not in use (mutex locked by caller)
+	void destroyUnused()
+	{
+		std::map<FftwPlanKey, FftwPlanPair>::iterator it = plans.begin();
+		while (it != plans.end())
+		{
+			if (it->second.users <= 0)
+			{
+#ifdef RELION_SINGLE_PRECISION
+				fftwf_destroy_plan(it->second.forward);
+				fftwf_destroy_plan(it->second.backward);
+#else
+				fftw_destroy_plan(it->second.forward);
+				fftw_destroy_plan(it->second.backward);
+#endif
+				plans.erase(it++);
+			}
+			else
+				++it;
+		}
+	}
+};
+
+// The cache is made upon first use and never destroyed: FourierTransformer objects with static storage
+// in other files may still release their plans after the static objects of this file have been destroyed
+static FftwPlanCache *fftw_plan_cache = NULL;
+
+// Get the plan cache (mutex locked by caller)
+static FftwPlanCache &getFftwPlanCache()
+{
+	if (fftw_plan_cache == NULL)
+		fftw_plan_cache = new FftwPlanCache();
+	return *fftw_plan_cache;
+}
+
+// Write the new wisdom when the program exits (unless another thread is still planning)
+static void exportFftwWisdomAtExit()
+{
+	if (pthread_mutex_trylock(&fftw_plan_mutex) != 0)
+		return;
+	getFftwPlanCache().exportNewWisdom();
+	pthread_mutex_unlock(&fftw_plan_mutex);
+}
+
+// Number of threads for new FourierTransformer objects
+static int fftw_default_threads = 1;
+
+// Get the alignment (as FFTW sees it) of an array
+static int fftwAlignmentOf(void *ptr)
+{
+#ifdef RELION_SINGLE_PRECISION
+	return fftwf_alignment_of((float *)ptr);
+#else
+	return fftw_alignment_of((double *)ptr);
+#endif
+}
+
+// Allocate a scratch array of nr_bytes with the same FFTW alignment as a user array
+static void *allocateScratchWithAlignment(size_t nr_bytes, int alignment, void **ptr_to_free)
+{
+#ifdef RELION_SINGLE_PRECISION
+	*ptr_to_free = fftwf_malloc(nr_bytes + 64);
+#else
+	*ptr_to_free = fftw_malloc(nr_bytes + 64);
+#endif
+	if (*ptr_to_free == NULL)
+		REPORT_ERROR("FFTW plans cannot be created: out of memory for planning arrays");
+	return (void *)((char *)(*ptr_to_free) + alignment);
+}
+
+static void freeScratch(void *ptr)
+{
+#ifdef RELION_SINGLE_PRECISION
+	fftwf_free(ptr);
+#else
+	fftw_free(ptr);
+#endif
+}
+
+// Get a forward and backward plan from the cache, or make them if they are not there yet.
+// in is the real (r2c) or complex (c2c) array, out the Fourier array.
+// For howmany > 1, the plans transform a contiguous stack of howmany r2c transforms at once.
+// For FFTW_PLAN_C2C_COLUMNS, the plans transform the first howmany columns of an N[0] x N[1]
+// array in place (in == out), with ndim = 2.
+// Only arrays with the same alignment as in and out can be used with the returned plans.
+static void getCachedPlans(int kind, int ndim, int *N, void *in, void *out, int nr_threads,
+		FftwPlan &forward, FftwPlan &backward, int howmany = 1)
+{
+	if (howmany > 1 && kind == FFTW_PLAN_C2C)
+		REPORT_ERROR("getCachedPlans BUG: batched plans are not implemented for complex-to-complex transforms");
+	if (kind == FFTW_PLAN_C2C_COLUMNS && (ndim != 2 || in != out))
+		REPORT_ERROR("getCachedPlans BUG: column transforms should be 2D and in-place");
+
+	FftwPlanKey key;
+	key.kind = kind;
+	key.ndim = ndim;
+	key.howmany = XMIPP_MAX(1, howmany);
+	for (int i = 0; i < 3; i++)
+		key.N[i] = (i < ndim) ? N[i] : 1;
+	key.align_in = fftwAlignmentOf(in);
+	key.align_out = fftwAlignmentOf(out);
+#ifdef HAVE_FFTW_THREADS
+	key.nr_threads = XMIPP_MAX(1, nr_threads);
+#else
+	key.nr_threads = 1;
+#endif
+
+	// Anything to do with plans has to be protected for threads!
+	pthread_mutex_lock(&fftw_plan_mutex);
+
+	getFftwPlanCache().initialise();
+
+	// Without data (e.g. when setReal is only used to size the Fourier array of a large 3D map)
+	// do not spend time and memory on measuring
+	key.rigour = (in == NULL) ? FFTW_ESTIMATE : getFftwPlanCache().rigour;
+
+	std::map<FftwPlanKey, FftwPlanPair>::iterator it = getFftwPlanCache().plans.find(key);
+	if (it != getFftwPlanCache().plans.end())
+	{
+		it->second.users++;
+		forward = it->second.forward;
+		backward = it->second.backward;
+		pthread_mutex_unlock(&fftw_plan_mutex);
+		return;
+	}
+
+	unsigned int rigour = key.rigour;
+	size_t nr_in = 1, nr_out = 1;
+	for (int i = 0; i < ndim; i++)
+	{
+		nr_in *= N[i];
+		nr_out *= (kind == FFTW_PLAN_R2C && i == ndim - 1) ? N[i]/2 + 1 : N[i];
+	}
+	// Distances between consecutive images in the input and output stacks of batched plans
+	int idist = (int)nr_in;
+	int odist = (int)nr_out;
+	size_t bytes_in = (kind == FFTW_PLAN_R2C) ? nr_in * sizeof(RFLOAT) : nr_in * sizeof(Complex);
+	size_t bytes_out = nr_out * sizeof(Complex);
+	if (kind != FFTW_PLAN_C2C_COLUMNS)
+	{
+		bytes_in *= key.howmany;
+		bytes_out *= key.howmany;
+	}
+
+	// Estimated plans do not touch the arrays, measured plans overwrite them: use scratch arrays for the latter
+	void *free_in = NULL, *free_out = NULL;
+	void *plan_in = in, *plan_out = out;
+	if (rigour != FFTW_ESTIMATE)
+	{
+		plan_in = allocateScratchWithAlignment(bytes_in, key.align_in, &free_in);
+		if (kind == FFTW_PLAN_C2C_COLUMNS)
+			plan_out = plan_in;
+		else
+			plan_out = allocateScratchWithAlignment(bytes_out, key.align_out, &free_out);
+	}
+
+	FftwPlanPair pair;
+	pair.users = 1;
+#ifdef HAVE_FFTW_THREADS
+#ifdef RELION_SINGLE_PRECISION
+	fftwf_plan_with_nthreads(key.nr_threads);
+#else
+	fftw_plan_with_nthreads(key.nr_threads);
+#endif
+#endif
+#ifdef RELION_SINGLE_PRECISION
+	if (kind == FFTW_PLAN_C2C_COLUMNS)
+	{
+		pair.forward = fftwf_plan_many_dft(1, N, key.howmany, (fftwf_complex *)plan_in, NULL, N[1], 1,
+				(fftwf_complex *)plan_out, NULL, N[1], 1, FFTW_FORWARD, rigour);
+		pair.backward = fftwf_plan_many_dft(1, N, key.howmany, (fftwf_complex *)plan_out, NULL, N[1], 1,
+				(fftwf_complex *)plan_in, NULL, N[1], 1, FFTW_BACKWARD, rigour);
+	}
+	else if (key.howmany > 1)
+	{
+		pair.forward = fftwf_plan_many_dft_r2c(ndim, N, key.howmany, (float *)plan_in, NULL, 1, idist,
+				(fftwf_complex *)plan_out, NULL, 1, odist, rigour);
+		pair.backward = fftwf_plan_many_dft_c2r(ndim, N, key.howmany, (fftwf_complex *)plan_out, NULL, 1, odist,
+				(float *)plan_in, NULL, 1, idist, rigour);
+	}
+	else if (kind == FFTW_PLAN_R2C)
+	{
+		pair.forward = fftwf_plan_dft_r2c(ndim, N, (float *)plan_in, (fftwf_complex *)plan_out, rigour);
+		pair.backward = fftwf_plan_dft_c2r(ndim, N, (fftwf_complex *)plan_out, (float *)plan_in, rigour);
+	}
+	else
+	{
+		pair.forward = fftwf_plan_dft(ndim, N, (fftwf_complex *)plan_in, (fftwf_complex *)plan_out, FFTW_FORWARD, rigour);
+		pair.backward = fftwf_plan_dft(ndim, N, (fftwf_complex *)plan_out, (fftwf_complex *)plan_in, FFTW_BACKWARD, rigour);
+	}
+#else
+	if (kind == FFTW_PLAN_C2C_COLUMNS)
+	{
+		pair.forward = fftw_plan_many_dft(1, N, key.howmany, (fftw_complex *)plan_in, NULL, N[1], 1,
+				(fftw_complex *)plan_out, NULL, N[1], 1, FFTW_FORWARD, rigour);
+		pair.backward = fftw_plan_many_dft(1, N, key.howmany, (fftw_complex *)plan_out, NULL, N[1], 1,
+				(fftw_complex *)plan_in, NULL, N[1], 1, FFTW_BACKWARD, rigour);
+	}
+	else if (key.howmany > 1)
+	{
+		pair.forward = fftw_plan_many_dft_r2c(ndim, N, key.howmany, (double *)plan_in, NULL, 1, idist,
+				(fftw_complex *)plan_out, NULL, 1, odist, rigour);
+		pair.backward = fftw_plan_many_dft_c2r(ndim, N, key.howmany, (fftw_complex *)plan_out, NULL, 1, odist,
+				(double *)plan_in, NULL, 1, idist, rigour);
+	}
+	else if (kind == FFTW_PLAN_R2C)
+	{
+		pair.forward = fftw_plan_dft_r2c(ndim, N, (double *)plan_in, (fftw_complex *)plan_out, rigour);
+		pair.backward = fftw_plan_dft_c2r(ndim, N, (fftw_complex *)plan_out, (double *)plan_in, rigour);
+	}
+	else
+	{
+		pair.forward = fftw_plan_dft(ndim, N, (fftw_complex *)plan_in, (fftw_complex *)plan_out, FFTW_FORWARD, rigour);
+		pair.backward = fftw_plan_dft(ndim, N, (fftw_complex *)plan_out, (fftw_complex *)plan_in, FFTW_BACKWARD, rigour);
+	}
+#endif
+
+	if (free_in != NULL)
+		freeScratch(free_in);
+	if (free_out != NULL)
+		freeScratch(free_out);
+
+	if (pair.forward == NULL || pair.backward == NULL)
+	{
+		pthread_mutex_unlock(&fftw_plan_mutex);
+		REPORT_ERROR("FFTW plans cannot be created");
+	}
+
+	if (rigour != FFTW_ESTIMATE)
+		getFftwPlanCache().wisdom_is_new = true;
+
+	getFftwPlanCache().plans.insert(std::make_pair(key, pair));
+	forward = pair.forward;
+	backward = pair.backward;
+
+	pthread_mutex_unlock(&fftw_plan_mutex);
+
+#ifdef DEBUG_PLANS
+	std::cerr << " NEW PLANS forward= " << forward << " backward= " << backward << " ndim= " << ndim << " kind= " << kind << " howmany= " << key.howmany << std::endl;
+#endif
+}
+
+// Tell the cache that one user fewer uses these plans (mutex locked by caller)
+static void releaseCachedPlans(FftwPlan forward)
+{
+	std::map<FftwPlanKey, FftwPlanPair>::iterator it;
+	for (it = getFftwPlanCache().plans.begin(); it != getFftwPlanCache().plans.end(); ++it)
+	{
+		if (it->second.forward == forward)
+		{
+			it->second.users--;
+			return;
+		}
+	}
+}
+
+void setFftwPlanningRigour(unsigned int rigour)
+{
+	if (rigour != FFTW_ESTIMATE && rigour != FFTW_MEASURE && rigour != FFTW_PATIENT)
+		REPORT_ERROR("setFftwPlanningRigour ERROR: rigour should be FFTW_ESTIMATE, FFTW_MEASURE or FFTW_PATIENT");
+	pthread_mutex_lock(&fftw_plan_mutex);
+	getFftwPlanCache().rigour = rigour;
+	getFftwPlanCache().rigour_is_set = true;
+	pthread_mutex_unlock(&fftw_plan_mutex);
+}
+
+unsigned int getFftwPlanningRigour()
+{
+	pthread_mutex_lock(&fftw_plan_mutex);
+	getFftwPlanCache().initialise();
+	unsigned int rigour = getFftwPlanCache().rigour;
+	pthread_mutex_unlock(&fftw_plan_mutex);
+	return rigour;
+}
+
+bool importFftwWisdom(const std::string &fn_wisdom)
+{
+#ifdef RELION_SINGLE_PRECISION
+	return (fftwf_import_wisdom_from_filename(fn_wisdom.c_str()) != 0);
+#else
+	return (fftw_import_wisdom_from_filename(fn_wisdom.c_str()) != 0);
+#endif
+}
+
+bool exportFftwWisdom(const std::string &fn_wisdom)
+{
+	// Write to a temporary file and rename, so that MPI ranks exiting together never leave a half-written file
+	std::stringstream fn_tmp;
+	fn_tmp << fn_wisdom << ".tmp" << getpid();
+#ifdef RELION_SINGLE_PRECISION
+	bool is_ok = (fftwf_export_wisdom_to_filename(fn_tmp.str().c_str()) != 0);
+#else
+	bool is_ok = (fftw_export_wisdom_to_filename(fn_tmp.str().c_str()) != 0);
+#endif
+	if (is_ok)
+		is_ok = (rename(fn_tmp.str().c_str(), fn_wisdom.c_str()) == 0);
+	if (!is_ok)
+		remove(fn_tmp.str().c_str());
+	return is_ok;
+}
+
+void setFftwDefaultThreads(int nr_threads)
+{
+	fftw_default_threads = XMIPP_MAX(1, nr_threads);
+}
+
+void clearUnusedFftwPlans()
+{
+	pthread_mutex_lock(&fftw_plan_mutex);
+	getFftwPlanCache().destroyUnused();
+	if (getFftwPlanCache().plans.size() == 0)
+	{
+		// fftw_cleanup also forgets all wisdom: save it first, and re-read it upon the next plan
+		getFftwPlanCache().exportNewWisdom();
+#ifdef RELION_SINGLE_PRECISION
+		fftwf_cleanup();
+#else
+		fftw_cleanup();
+#endif
+		getFftwPlanCache().is_initialised = false;
+	}
+	pthread_mutex_unlock(&fftw_plan_mutex);
+}
+
 // Constructors and destructors --------------------------------------------
 FourierTransformer::FourierTransformer():
-		plans_are_set(false)
+		plans_are_set(false), nr_threads(fftw_default_threads)
 {
     init();
 
@@ -72,12 +522,29 @@ FourierTransformer::~FourierTransformer()
 #endif
 }
 
-FourierTransformer::FourierTransformer(const FourierTransformer& op)
+FourierTransformer::FourierTransformer(const FourierTransformer& op):
+		plans_are_set(false)
 {
-	// Clear current object
-	clear();
-	// New object is an extact copy of op
-    *this = op;
+	init();
+	// New object is an extact copy of op, but it does not share its plans
+	// (these will be taken from the plan cache upon the next setReal)
+	fFourier = op.fFourier;
+	fReal = op.fReal;
+	fComplex = op.fComplex;
+	nr_threads = op.nr_threads;
+}
+
+FourierTransformer& FourierTransformer::operator=(const FourierTransformer& op)
+{
+	if (this != &op)
+	{
+		clear();
+		fFourier = op.fFourier;
+		fReal = op.fReal;
+		fComplex = op.fComplex;
+		nr_threads = op.nr_threads;
+	}
+	return *this;
 }
 
 void FourierTransformer::init()
@@ -88,12 +555,13 @@ void FourierTransformer::init()
     fPlanBackward    = NULL;
     dataPtr          = NULL;
     complexDataPtr   = NULL;
+    fourierDataPtr   = NULL;
 }
 
 void FourierTransformer::clear()
 {
     fFourier.clear();
-    // Clean-up all other FFTW-allocated memory
+    // Release the plans back to the plan cache
     destroyPlans();
     // Initialise all pointers to NULL
     init();
@@ -102,15 +570,11 @@ void FourierTransformer::clear()
 
 void FourierTransformer::cleanup()
 {
-	// First clear object and destroy plans
+	// First clear object and release plans
     clear();
     // Then clean up all the junk fftw keeps lying around
-    // SOMEHOW THE FOLLOWING IS NOT ALLOWED WHEN USING MULTPLE TRANSFORMER OBJECTS....
-#ifdef RELION_SINGLE_PRECISION
-    fftwf_cleanup();
-#else
-    fftw_cleanup();
-#endif
+    // This only calls fftw_cleanup once no other transformer objects use any plans anymore
+    clearUnusedFftwPlans();
 
 #ifdef DEBUG_PLANS
     std::cerr << "CLEANED-UP this= "<<this<< std::endl;
@@ -125,13 +589,10 @@ void FourierTransformer::destroyPlans()
 
     if (plans_are_set)
     {
-#ifdef RELION_SINGLE_PRECISION
-    	fftwf_destroy_plan(fPlanForward);
-    	fftwf_destroy_plan(fPlanBackward);
-#else
-    	fftw_destroy_plan(fPlanForward);
-    	fftw_destroy_plan(fPlanBackward);
-#endif
+    	// Plans are owned by the plan cache, which will keep them for re-use
+    	releaseCachedPlans(fPlanForward);
+    	fPlanForward = NULL;
+    	fPlanBackward = NULL;
     	plans_are_set = false;
     }
 
@@ -139,6 +600,17 @@ void FourierTransformer::destroyPlans()
 
 }
 
+void FourierTransformer::setThreads(int _nr_threads)
+{
+	if (_nr_threads != nr_threads)
+	{
+		nr_threads = XMIPP_MAX(1, _nr_threads);
+		// Make sure new plans are taken upon the next setReal
+		dataPtr = NULL;
+		complexDataPtr = NULL;
+	}
+}
+
 // Initialization ----------------------------------------------------------
 const MultidimArray<RFLOAT> &FourierTransformer::getReal() const
 {
@@ -163,6 +635,11 @@ void FourierTransformer::setReal(MultidimArray<RFLOAT> &input)
 
     fFourier.reshape(ZSIZE(input),YSIZE(input),XSIZE(input)/2+1);
     fReal=&input;
+    fComplex=NULL;
+
+    // The plans are executed on new arrays, so also check whether the Fourier array moved
+    if (fourierDataPtr!=MULTIDIM_ARRAY(fFourier))
+        recomputePlan=true;
 
     if (recomputePlan)
     {
@@ -173,7 +650,7 @@ void FourierTransformer::setReal(MultidimArray<RFLOAT> &input)
             if (YSIZE(input)==1)
                 ndim=1;
         }
-        int *N = new int[ndim];
+        int N[3];
         switch (ndim)
         {
         case 1:
@@ -190,37 +667,22 @@ void FourierTransformer::setReal(MultidimArray<RFLOAT> &input)
             break;
         }
 
-        // Destroy both forward and backward plans if they already exist
+        // Release both forward and backward plans if they already exist
         destroyPlans();
 
-        // Make new plans
-        pthread_mutex_lock(&fftw_plan_mutex);
-#ifdef RELION_SINGLE_PRECISION
-        fPlanForward = fftwf_plan_dft_r2c(ndim, N, MULTIDIM_ARRAY(*fReal),
-                                         (fftwf_complex*) MULTIDIM_ARRAY(fFourier), FFTW_ESTIMATE);
-        fPlanBackward = fftwf_plan_dft_c2r(ndim, N,
-                                          (fftwf_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal),
-                                          FFTW_ESTIMATE);
-#else
+        // Get new plans from the plan cache
+        // Only large 3D transforms are worth the overhead of multiple threads
+        int plan_threads = (ndim == 3 && MULTIDIM_SIZE(input) >= FFTW_MIN_SIZE_FOR_THREADS) ? nr_threads : 1;
+        getCachedPlans(FFTW_PLAN_R2C, ndim, N, MULTIDIM_ARRAY(*fReal), MULTIDIM_ARRAY(fFourier), plan_threads,
+        		fPlanForward, fPlanBackward);
         plans_are_set = true;
 
-        fPlanForward = fftw_plan_dft_r2c(ndim, N, MULTIDIM_ARRAY(*fReal),
-                                         (fftw_complex*) MULTIDIM_ARRAY(fFourier), FFTW_ESTIMATE);
-        fPlanBackward = fftw_plan_dft_c2r(ndim, N,
-                                          (fftw_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal),
-                                          FFTW_ESTIMATE);
-#endif
-        pthread_mutex_unlock(&fftw_plan_mutex);
-
-        if (fPlanForward == NULL || fPlanBackward == NULL)
-            REPORT_ERROR("FFTW plans cannot be created");
-
 #ifdef DEBUG_PLANS
         std::cerr << " SETREAL fPlanForward= " << fPlanForward << " fPlanBackward= " << fPlanBackward  <<" this= "<<this<< std::endl;
 #endif
 
-        delete [] N;
         dataPtr=MULTIDIM_ARRAY(*fReal);
+        fourierDataPtr=MULTIDIM_ARRAY(fFourier);
     }
 }
 
@@ -235,6 +697,10 @@ void FourierTransformer::setReal(MultidimArray<Complex > &input)
         recomputePlan=!(fComplex->sameShape(input));
     fFourier.resize(input);
     fComplex=&input;
+    fReal=NULL;
+
+    if (fourierDataPtr!=MULTIDIM_ARRAY(fFourier))
+        recomputePlan=true;
 
     if (recomputePlan)
     {
@@ -245,7 +711,7 @@ void FourierTransformer::setReal(MultidimArray<Complex > &input)
             if (YSIZE(input)==1)
                 ndim=1;
         }
-        int *N = new int[ndim];
+        int N[3];
         switch (ndim)
         {
         case 1:
@@ -262,48 +728,17 @@ void FourierTransformer::setReal(MultidimArray<Complex > &input)
             break;
         }
 
-        // Destroy both forward and backward plans if they already exist
+        // Release both forward and backward plans if they already exist
         destroyPlans();
 
-        pthread_mutex_lock(&fftw_plan_mutex);
-#ifdef RELION_SINGLE_PRECISION
-        if (fPlanForward!=NULL)
-            fftwf_destroy_plan(fPlanForward);
-        fPlanForward=NULL;
-        fPlanForward = fftwf_plan_dft(ndim, N, (fftwf_complex*) MULTIDIM_ARRAY(*fComplex),
-                                     (fftwf_complex*) MULTIDIM_ARRAY(fFourier), FFTW_FORWARD, FFTW_ESTIMATE);
-        if (fPlanBackward!=NULL)
-            fftwf_destroy_plan(fPlanBackward);
-        fPlanBackward=NULL;
-        fPlanBackward = fftwf_plan_dft(ndim, N, (fftwf_complex*) MULTIDIM_ARRAY(fFourier),
-                                      (fftwf_complex*) MULTIDIM_ARRAY(*fComplex), FFTW_BACKWARD, FFTW_ESTIMATE);
-        if (fPlanForward == NULL || fPlanBackward == NULL)
-            REPORT_ERROR("FFTW plans cannot be created");
-        delete [] N;
-        complexDataPtr=MULTIDIM_ARRAY(*fComplex);
-#else
-        if (plans_are_set)
-        {
-            fftw_destroy_plan(fPlanBackward);
-            fftw_destroy_plan(fPlanForward);
-        }
-
-        fPlanForward=NULL;
-        fPlanForward = fftw_plan_dft(ndim, N, (fftw_complex*) MULTIDIM_ARRAY(*fComplex),
-                                     (fftw_complex*) MULTIDIM_ARRAY(fFourier), FFTW_FORWARD, FFTW_ESTIMATE);
-
-        fPlanBackward=NULL;
-        fPlanBackward = fftw_plan_dft(ndim, N, (fftw_complex*) MULTIDIM_ARRAY(fFourier),
-                                      (fftw_complex*) MULTIDIM_ARRAY(*fComplex), FFTW_BACKWARD, FFTW_ESTIMATE);
-
+        // Get new plans from the plan cache
+        int plan_threads = (ndim == 3 && MULTIDIM_SIZE(input) >= FFTW_MIN_SIZE_FOR_THREADS) ? nr_threads : 1;
+        getCachedPlans(FFTW_PLAN_C2C, ndim, N, MULTIDIM_ARRAY(*fComplex), MULTIDIM_ARRAY(fFourier), plan_threads,
+        		fPlanForward, fPlanBackward);
         plans_are_set = true;
 
-        if (fPlanForward == NULL || fPlanBackward == NULL)
-            REPORT_ERROR("FFTW plans cannot be created");
-        delete [] N;
         complexDataPtr=MULTIDIM_ARRAY(*fComplex);
-#endif
-        pthread_mutex_unlock(&fftw_plan_mutex);
+        fourierDataPtr=MULTIDIM_ARRAY(fFourier);
     }
 }
 
@@ -318,19 +753,30 @@ void FourierTransformer::Transform(int sign)
 {
     if (sign == FFTW_FORWARD)
     {
-#ifdef RELION_SINGLE_PRECISION
-        fftwf_execute_dft_r2c(fPlanForward,MULTIDIM_ARRAY(*fReal),
-                (fftwf_complex*) MULTIDIM_ARRAY(fFourier));
-#else
-        fftw_execute_dft_r2c(fPlanForward,MULTIDIM_ARRAY(*fReal),
-                (fftw_complex*) MULTIDIM_ARRAY(fFourier));
-#endif
         // Normalisation of the transform
         unsigned long int size=0;
         if(fReal!=NULL)
+        {
+#ifdef RELION_SINGLE_PRECISION
+            fftwf_execute_dft_r2c(fPlanForward,MULTIDIM_ARRAY(*fReal),
+                    (fftwf_complex*) MULTIDIM_ARRAY(fFourier));
+#else
+            fftw_execute_dft_r2c(fPlanForward,MULTIDIM_ARRAY(*fReal),
+                    (fftw_complex*) MULTIDIM_ARRAY(fFourier));
+#endif
             size = MULTIDIM_SIZE(*fReal);
+        }
         else if (fComplex!= NULL)
+        {
+#ifdef RELION_SINGLE_PRECISION
+            fftwf_execute_dft(fPlanForward,(fftwf_complex*) MULTIDIM_ARRAY(*fComplex),
+                    (fftwf_complex*) MULTIDIM_ARRAY(fFourier));
+#else
+            fftw_execute_dft(fPlanForward,(fftw_complex*) MULTIDIM_ARRAY(*fComplex),
+                    (fftw_complex*) MULTIDIM_ARRAY(fFourier));
+#endif
             size = MULTIDIM_SIZE(*fComplex);
+        }
         else
             REPORT_ERROR("No complex nor real data defined");
 
@@ -339,13 +785,28 @@ void FourierTransformer::Transform(int sign)
     }
     else if (sign == FFTW_BACKWARD)
     {
+        if (fReal!=NULL)
+        {
 #ifdef RELION_SINGLE_PRECISION
-        fftwf_execute_dft_c2r(fPlanBackward,
-                (fftwf_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal));
+            fftwf_execute_dft_c2r(fPlanBackward,
+                    (fftwf_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal));
 #else
-        fftw_execute_dft_c2r(fPlanBackward,
-                (fftw_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal));
+            fftw_execute_dft_c2r(fPlanBackward,
+                    (fftw_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal));
 #endif
+        }
+        else if (fComplex!=NULL)
+        {
+#ifdef RELION_SINGLE_PRECISION
+            fftwf_execute_dft(fPlanBackward,
+                    (fftwf_complex*) MULTIDIM_ARRAY(fFourier), (fftwf_complex*) MULTIDIM_ARRAY(*fComplex));
+#else
+            fftw_execute_dft(fPlanBackward,
+                    (fftw_complex*) MULTIDIM_ARRAY(fFourier), (fftw_complex*) MULTIDIM_ARRAY(*fComplex));
+#endif
+        }
+        else
+            REPORT_ERROR("No complex nor real data defined");
     }
 }
 
@@ -415,6 +876,322 @@ void FourierTransformer::enforceHermitianSymmetry()
     }
 }
 
+// Batched transforms ------------------------------------------------------
+BatchFourierTransformer::BatchFourierTransformer():
+		plans_are_set(false), nr_threads(fftw_default_threads)
+{
+	init();
+}
+
+BatchFourierTransformer::~BatchFourierTransformer()
+{
+	clear();
+}
+
+BatchFourierTransformer::BatchFourierTransformer(const BatchFourierTransformer& op):
+		plans_are_set(false)
+{
+	init();
+	fFourier = op.fFourier;
+	fReal = op.fReal;
+	nr_threads = op.nr_threads;
+}
+
+BatchFourierTransformer& BatchFourierTransformer::operator=(const BatchFourierTransformer& op)
+{
+	if (this != &op)
+	{
+		clear();
+		fFourier = op.fFourier;
+		fReal = op.fReal;
+		nr_threads = op.nr_threads;
+	}
+	return *this;
+}
+
+void BatchFourierTransformer::init()
+{
+	fReal          = NULL;
+	fPlanForward   = NULL;
+	fPlanBackward  = NULL;
+	dataPtr        = NULL;
+	fourierDataPtr = NULL;
+}
+
+void BatchFourierTransformer::clear()
+{
+	fFourier.clear();
+	destroyPlans();
+	init();
+}
+
+void BatchFourierTransformer::destroyPlans()
+{
+	pthread_mutex_lock(&fftw_plan_mutex);
+	if (plans_are_set)
+	{
+		releaseCachedPlans(fPlanForward);
+		fPlanForward = NULL;
+		fPlanBackward = NULL;
+		plans_are_set = false;
+	}
+	pthread_mutex_unlock(&fftw_plan_mutex);
+}
+
+void BatchFourierTransformer::setThreads(int _nr_threads)
+{
+	if (_nr_threads != nr_threads)
+	{
+		nr_threads = XMIPP_MAX(1, _nr_threads);
+		dataPtr = NULL;
+	}
+}
+
+void BatchFourierTransformer::setReal(MultidimArray<RFLOAT> &stack)
+{
+	bool recomputePlan = (fReal == NULL || dataPtr != MULTIDIM_ARRAY(stack) || !fReal->sameShape(stack));
+
+	fFourier.reshape(NSIZE(stack), ZSIZE(stack), YSIZE(stack), XSIZE(stack)/2+1);
+	fReal = &stack;
+
+	if (fourierDataPtr != MULTIDIM_ARRAY(fFourier))
+		recomputePlan = true;
+
+	if (recomputePlan)
+	{
+		int ndim = 3;
+		int N[3];
+		N[0] = ZSIZE(stack);
+		N[1] = YSIZE(stack);
+		N[2] = XSIZE(stack);
+		if (ZSIZE(stack) == 1)
+		{
+			ndim = 2;
+			N[0] = YSIZE(stack);
+			N[1] = XSIZE(stack);
+			if (YSIZE(stack) == 1)
+			{
+				ndim = 1;
+				N[0] = XSIZE(stack);
+			}
+		}
+
+		destroyPlans();
+
+		int plan_threads = (NZYXSIZE(stack) >= FFTW_MIN_SIZE_FOR_THREADS) ? nr_threads : 1;
+		getCachedPlans(FFTW_PLAN_R2C, ndim, N, MULTIDIM_ARRAY(stack), MULTIDIM_ARRAY(fFourier), plan_threads,
+				fPlanForward, fPlanBackward, NSIZE(stack));
+		plans_are_set = true;
+
+		dataPtr = MULTIDIM_ARRAY(stack);
+		fourierDataPtr = MULTIDIM_ARRAY(fFourier);
+	}
+}
+
+void BatchFourierTransformer::Transform(int sign)
+{
+	if (fReal == NULL)
+		REPORT_ERROR("BatchFourierTransformer::Transform: no real data defined");
+
+	if (sign == FFTW_FORWARD)
+	{
+#ifdef RELION_SINGLE_PRECISION
+		fftwf_execute_dft_r2c(fPlanForward, MULTIDIM_ARRAY(*fReal), (fftwf_complex*) MULTIDIM_ARRAY(fFourier));
+#else
+		fftw_execute_dft_r2c(fPlanForward, MULTIDIM_ARRAY(*fReal), (fftw_complex*) MULTIDIM_ARRAY(fFourier));
+#endif
+		// Normalise each image by its own size, as in FourierTransformer
+		unsigned long int size = ZYXSIZE(*fReal);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(fFourier)
+			DIRECT_MULTIDIM_ELEM(fFourier, n) /= size;
+	}
+	else if (sign == FFTW_BACKWARD)
+	{
+#ifdef RELION_SINGLE_PRECISION
+		fftwf_execute_dft_c2r(fPlanBackward, (fftwf_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal));
+#else
+		fftw_execute_dft_c2r(fPlanBackward, (fftw_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal));
+#endif
+	}
+}
+
+void BatchFourierTransformer::FourierTransform(MultidimArray<RFLOAT> &v, MultidimArray<Complex > &V, bool getCopy)
+{
+	setReal(v);
+	Transform(FFTW_FORWARD);
+	if (getCopy)
+	{
+		V.reshape(fFourier);
+		memcpy(MULTIDIM_ARRAY(V), MULTIDIM_ARRAY(fFourier), NZYXSIZE(fFourier) * sizeof(Complex));
+	}
+	else
+		V.alias(fFourier);
+}
+
+void BatchFourierTransformer::inverseFourierTransform(MultidimArray<Complex > &V, MultidimArray<RFLOAT> &v)
+{
+	setReal(v);
+	if (NZYXSIZE(V) != NZYXSIZE(fFourier))
+		REPORT_ERROR("BatchFourierTransformer::inverseFourierTransform: Fourier stack does not match the real-space stack");
+	// c2r transforms destroy their input: work on the internal copy
+	if (MULTIDIM_ARRAY(V) != MULTIDIM_ARRAY(fFourier))
+		memcpy(MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(V), NZYXSIZE(fFourier) * sizeof(Complex));
+	Transform(FFTW_BACKWARD);
+}
+
+// Pruned transforms -------------------------------------------------------
+PrunedFourierTransformer::PrunedFourierTransformer():
+		plans_are_set(false)
+{
+	init();
+}
+
+PrunedFourierTransformer::~PrunedFourierTransformer()
+{
+	clear();
+}
+
+PrunedFourierTransformer::PrunedFourierTransformer(const PrunedFourierTransformer& op):
+		plans_are_set(false)
+{
+	init();
+	fRows = op.fRows;
+	full_transformer = op.full_transformer;
+}
+
+PrunedFourierTransformer& PrunedFourierTransformer::operator=(const PrunedFourierTransformer& op)
+{
+	if (this != &op)
+	{
+		clear();
+		fRows = op.fRows;
+		full_transformer = op.full_transformer;
+	}
+	return *this;
+}
+
+void PrunedFourierTransformer::init()
+{
+	fPlanRowsForward      = NULL;
+	fPlanRowsBackward     = NULL;
+	fPlanColumnsForward   = NULL;
+	fPlanColumnsBackward  = NULL;
+	dataPtr               = NULL;
+	rowsDataPtr           = NULL;
+	plan_size             = 0;
+	plan_hdim             = 0;
+}
+
+void PrunedFourierTransformer::clear()
+{
+	fRows.clear();
+	full_transformer.clear();
+	destroyPlans();
+	init();
+}
+
+void PrunedFourierTransformer::destroyPlans()
+{
+	pthread_mutex_lock(&fftw_plan_mutex);
+	if (plans_are_set)
+	{
+		releaseCachedPlans(fPlanRowsForward);
+		releaseCachedPlans(fPlanColumnsForward);
+		plans_are_set = false;
+	}
+	pthread_mutex_unlock(&fftw_plan_mutex);
+}
+
+void PrunedFourierTransformer::setPlans(MultidimArray<RFLOAT> &v, long int hdim)
+{
+	long int size = XSIZE(v);
+	fRows.reshape(size, size/2 + 1);
+
+	if (plans_are_set && dataPtr == MULTIDIM_ARRAY(v) && rowsDataPtr == MULTIDIM_ARRAY(fRows) &&
+			plan_size == size && plan_hdim == hdim)
+		return;
+
+	destroyPlans();
+
+	// All rows at once: a batch of 1D real-to-complex transforms
+	int N[2];
+	N[0] = size;
+	getCachedPlans(FFTW_PLAN_R2C, 1, N, MULTIDIM_ARRAY(v), MULTIDIM_ARRAY(fRows), 1,
+			fPlanRowsForward, fPlanRowsBackward, size);
+
+	// Only the first hdim columns, in place
+	N[0] = size;
+	N[1] = size/2 + 1;
+	getCachedPlans(FFTW_PLAN_C2C_COLUMNS, 2, N, MULTIDIM_ARRAY(fRows), MULTIDIM_ARRAY(fRows), 1,
+			fPlanColumnsForward, fPlanColumnsBackward, hdim);
+	plans_are_set = true;
+
+	dataPtr = MULTIDIM_ARRAY(v);
+	rowsDataPtr = MULTIDIM_ARRAY(fRows);
+	plan_size = size;
+	plan_hdim = hdim;
+}
+
+void PrunedFourierTransformer::FourierTransform(MultidimArray<RFLOAT> &v, MultidimArray<Complex > &V, long int newdim)
+{
+	long int newhdim = newdim/2 + 1;
+	if (v.getDim() != 2 || XSIZE(v) != YSIZE(v) || newhdim >= XSIZE(v)/2 + 1)
+	{
+		MultidimArray<Complex > Faux;
+		full_transformer.FourierTransform(v, Faux, false);
+		windowFourierTransform(Faux, V, newdim);
+		return;
+	}
+
+	setPlans(v, newhdim);
+
+#ifdef RELION_SINGLE_PRECISION
+	fftwf_execute_dft_r2c(fPlanRowsForward, MULTIDIM_ARRAY(v), (fftwf_complex*) MULTIDIM_ARRAY(fRows));
+	fftwf_execute_dft(fPlanColumnsForward, (fftwf_complex*) MULTIDIM_ARRAY(fRows), (fftwf_complex*) MULTIDIM_ARRAY(fRows));
+#else
+	fftw_execute_dft_r2c(fPlanRowsForward, MULTIDIM_ARRAY(v), (fftw_complex*) MULTIDIM_ARRAY(fRows));
+	fftw_execute_dft(fPlanColumnsForward, (fftw_complex*) MULTIDIM_ARRAY(fRows), (fftw_complex*) MULTIDIM_ARRAY(fRows));
+#endif
+
+	// Window and normalise, as in FourierTransformer and windowFourierTransform
+	RFLOAT size = (RFLOAT)MULTIDIM_SIZE(v);
+	V.reshape(newdim, newhdim);
+	FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(V)
+	{
+		DIRECT_A2D_ELEM(V, i, j) = FFTW2D_ELEM(fRows, ip, jp) / size;
+	}
+}
+
+void PrunedFourierTransformer::inverseFourierTransform(MultidimArray<Complex > &V, MultidimArray<RFLOAT> &v)
+{
+	if (v.getDim() != 2 || XSIZE(v) != YSIZE(v) || XSIZE(V) >= XSIZE(v)/2 + 1)
+	{
+		MultidimArray<Complex > Faux;
+		windowFourierTransform(V, Faux, XSIZE(v));
+		full_transformer.inverseFourierTransform(Faux, v);
+		return;
+	}
+
+	setPlans(v, XSIZE(V));
+
+	// Pad with zeros, leaving out the corners as windowFourierTransform does
+	fRows.initZeros();
+	long int max_r2 = (XSIZE(V) - 1) * (XSIZE(V) - 1);
+	FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(V)
+	{
+		if (ip*ip + jp*jp <= max_r2)
+			FFTW2D_ELEM(fRows, ip, jp) = DIRECT_A2D_ELEM(V, i, j);
+	}
+
+#ifdef RELION_SINGLE_PRECISION
+	fftwf_execute_dft(fPlanColumnsBackward, (fftwf_complex*) MULTIDIM_ARRAY(fRows), (fftwf_complex*) MULTIDIM_ARRAY(fRows));
+	fftwf_execute_dft_c2r(fPlanRowsBackward, (fftwf_complex*) MULTIDIM_ARRAY(fRows), MULTIDIM_ARRAY(v));
+#else
+	fftw_execute_dft(fPlanColumnsBackward, (fftw_complex*) MULTIDIM_ARRAY(fRows), (fftw_complex*) MULTIDIM_ARRAY(fRows));
+	fftw_execute_dft_c2r(fPlanRowsBackward, (fftw_complex*) MULTIDIM_ARRAY(fRows), MULTIDIM_ARRAY(v));
+#endif
+}
+
 
 void randomizePhasesBeyond(MultidimArray<RFLOAT> &v, int index)
 {
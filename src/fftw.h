@@ -114,6 +114,54 @@
 #define FFTW2D_ELEM(V, ip, jp) \
     (DIRECT_A2D_ELEM((V), ((ip < 0) ? (ip + YSIZE(V)) : (ip)), (jp)))
 
+/** @name FFTW plan cache
+ * @ingroup FourierW
+ *
+ * All FourierTransformer objects in a process share their FFTW plans through a
+ * process-wide cache, keyed on the dimensions and kind of the transform, the
+ * alignment of the real and Fourier arrays, the number of threads and the
+ * planning rigour. Plans are
+ * executed with the new-array interface, so a cached plan serves any pair of
+ * arrays of the same shape and alignment, and creating a new FourierTransformer
+ * for every image or micrograph no longer pays for planning.
+ *
+ * The planning rigour is FFTW_ESTIMATE by default. It can be changed with
+ * setFftwPlanningRigour() or through the environment variable RELION_FFTW_PLANNER
+ * (estimate, measure or patient). Measured plans are made on scratch arrays, so
+ * the user arrays are never overwritten during planning.
+ *
+ * FFTW wisdom is only used if the environment variable RELION_FFTW_WISDOM gives
+ * a file name: the wisdom is then read from that file when the first plan is made,
+ * and if new plans were measured, it is written back to that file when the program exits.
+ */
+//@{
+/** Set the FFTW planner flag for all new plans: FFTW_ESTIMATE, FFTW_MEASURE or FFTW_PATIENT */
+void setFftwPlanningRigour(unsigned int rigour);
+
+/** Get the FFTW planner flag for new plans */
+unsigned int getFftwPlanningRigour();
+
+/** Read FFTW wisdom from a file. Returns false if the file could not be read. */
+bool importFftwWisdom(const std::string &fn_wisdom);
+
+/** Write the accumulated FFTW wisdom to a file. Returns false if the file could not be written. */
+bool exportFftwWisdom(const std::string &fn_wisdom);
+
+/** Set the number of threads with which new FourierTransformer objects transform large 3D arrays (default 1).
+ *  Programs that only run one FFT at a time (e.g. relion_image_handler or relion_postprocess) can set this once,
+ *  so that also the FFTs inside helper functions like getFSC or lowPassFilterMap are multi-threaded.
+ */
+void setFftwDefaultThreads(int nr_threads);
+
+/** Destroy all cached plans that are not used by any FourierTransformer.
+ *  If no plans remain, FFTW's internal memory is released as well (fftw_cleanup).
+ */
+void clearUnusedFftwPlans();
+//@}
+
+/** Minimum number of voxels in a 3D array for its FFTs to be multi-threaded */
+#define FFTW_MIN_SIZE_FOR_THREADS (128 * 128 * 128)
+
 /** Fourier Transformer class.
  * @ingroup FourierW
  *
@@ -160,6 +208,9 @@ public:
 
     bool plans_are_set;
 
+    /** Number of threads for the FFTW plans of large 3D arrays */
+    int nr_threads;
+
 // Public methods
 public:
     /** Default constructor */
@@ -176,6 +227,20 @@ public:
      */
     FourierTransformer(const FourierTransformer& op);
 
+    /** Assignment
+     *
+     * As for the copy constructor, plans are not shared but will be taken from
+     * the plan cache upon the next setReal.
+     */
+    FourierTransformer& operator=(const FourierTransformer& op);
+
+    /** Set the number of threads for the FFTs.
+        Only 3D arrays of at least FFTW_MIN_SIZE_FOR_THREADS voxels are
+        transformed with multiple threads, and only if RELION was linked
+        against the FFTW threads library. Takes effect upon the next setReal.
+        */
+    void setThreads(int _nr_threads);
+
     /** Compute the Fourier transform of a MultidimArray, 2D and 3D.
         If getCopy is false, an alias to the transformed data is returned.
         This is a faster option since a copy of all the data is avoided,
@@ -321,17 +386,21 @@ public:
     /* Pointer to the array of complex<RFLOAT> with which the plan was computed */
     Complex * complexDataPtr;
 
+    /* Pointer to the Fourier array with which the plan was computed */
+    Complex * fourierDataPtr;
+
     /* Initialise all pointers to NULL */
     void init();
 
     /** Clear object */
     void clear();
 
-    /** This calls fftw_cleanup.
+    /** Clear object and destroy all cached plans that are no longer in use.
+        This calls fftw_cleanup if no plans remain in the cache.
     */
     void cleanup();
 
-    /** Destroy both forward and backward fftw planes (mutex locked */
+    /** Release both forward and backward fftw plans back to the plan cache (mutex locked) */
     void destroyPlans();
 
     /** Computes the transform, specified in Init() function
@@ -368,6 +437,188 @@ public:
     void setFourier(MultidimArray<Complex > &imgFourier);
 };
 
+/** Batched Fourier Transformer class.
+ * @ingroup FourierW
+ *
+ * Transforms a contiguous stack of same-size 1D, 2D or 3D images (all NSIZE
+ * images of a MultidimArray) with a single FFTW plan, which is much faster than
+ * transforming the images one by one for small boxes. As for FourierTransformer,
+ * the Fourier stack is handled by this object, whereas the real-space stack is
+ * handled externally. Plans are taken from the process-wide plan cache, so they
+ * are re-used for all stacks of the same size and batch size.
+ *
+ * Each image is normalised in the forward transform as in FourierTransformer,
+ * so that image n of the Fourier stack is identical to the transform of image n
+ * of the real-space stack.
+ *
+ * @code
+ * BatchFourierTransformer transformer;
+ * MultidimArray<RFLOAT> stack(nr_images, 1, ydim, xdim);
+ * MultidimArray<Complex > Fstack, Fimg;
+ * transformer.FourierTransform(stack, Fstack);
+ * Fstack.getImage(n, Fimg);
+ * @endcode
+ */
+class BatchFourierTransformer
+{
+public:
+    /** Real stack, in fact a pointer to the user array is stored. */
+    MultidimArray<RFLOAT> *fReal;
+
+    /** Fourier stack */
+    MultidimArray< Complex > fFourier;
+
+#ifdef RELION_SINGLE_PRECISION
+    /* fftw Forward plan */
+    fftwf_plan fPlanForward;
+
+    /* fftw Backward plan */
+    fftwf_plan fPlanBackward;
+#else
+    /* fftw Forward plan */
+    fftw_plan fPlanForward;
+
+    /* fftw Backward plan */
+    fftw_plan fPlanBackward;
+#endif
+
+    bool plans_are_set;
+
+    /** Number of threads for the FFTW plans of large stacks */
+    int nr_threads;
+
+    /* Pointers to the real and Fourier stacks with which the plans were computed */
+    RFLOAT * dataPtr;
+    Complex * fourierDataPtr;
+
+public:
+    /** Default constructor */
+    BatchFourierTransformer();
+
+    /** Destructor */
+    ~BatchFourierTransformer();
+
+    /** Copy constructor. Plans are not shared but will be taken from the plan cache upon the next setReal. */
+    BatchFourierTransformer(const BatchFourierTransformer& op);
+
+    /** Assignment. Plans are not shared but will be taken from the plan cache upon the next setReal. */
+    BatchFourierTransformer& operator=(const BatchFourierTransformer& op);
+
+    /** Set the number of threads for the FFTs.
+        Only stacks of at least FFTW_MIN_SIZE_FOR_THREADS pixels in total are
+        transformed with multiple threads. Takes effect upon the next setReal.
+        */
+    void setThreads(int _nr_threads);
+
+    /** Compute the Fourier transforms of all images in a stack.
+        V will have the same NSIZE as v. If getCopy is false, an alias
+        to the transformed data is returned.
+        */
+    void FourierTransform(MultidimArray<RFLOAT> &v, MultidimArray<Complex > &V, bool getCopy=true);
+
+    /** Compute the inverse Fourier transforms of all images in a stack.
+        The output stack v should already have the right size. V is not
+        modified (the c2r transforms are done on an internal copy). */
+    void inverseFourierTransform(MultidimArray<Complex > &V, MultidimArray<RFLOAT> &v);
+
+    /** Get Fourier coefficients. */
+    MultidimArray< Complex>& getFourierReference() {return fFourier;}
+
+    /** Clear object and release the plans */
+    void clear();
+
+    /** Set the real-space stack, and (re-)take plans from the plan cache if needed */
+    void setReal(MultidimArray<RFLOAT> &stack);
+
+    /** Transform the stack set with setReal in the direction of sign (FFTW_FORWARD or FFTW_BACKWARD) */
+    void Transform(int sign);
+
+private:
+    void init();
+    void destroyPlans();
+};
+
+/** Pruned Fourier Transformer class.
+ * @ingroup FourierW
+ *
+ * Computes the Fourier transform of a square 2D image only up to a smaller
+ * (windowed) size, and the inverse transform of a windowed Fourier transform
+ * padded with zeros to the full image size. The results are the same as those of
+ * a full-size FourierTransformer combined with windowFourierTransform, but the
+ * 2D transform is split into row and column transforms, and the column
+ * transforms are only done for the columns that are kept (forward) or that are
+ * non-zero (inverse). For small windows this skips almost half of the work.
+ *
+ * Images that are not square 2D images, and windows that are not smaller than
+ * the image, are handled by a full-size FourierTransformer.
+ *
+ * @code
+ * PrunedFourierTransformer transformer;
+ * // Same as transformer.FourierTransform(img, Faux); windowFourierTransform(Faux, Fimg, current_size);
+ * transformer.FourierTransform(img, Fimg, current_size);
+ * // Same as windowFourierTransform(Fimg, Faux, XSIZE(img)); transformer.inverseFourierTransform(Faux, img);
+ * transformer.inverseFourierTransform(Fimg, img);
+ * @endcode
+ */
+class PrunedFourierTransformer
+{
+public:
+    /** Fourier transform of the rows (N x N/2+1), on which the column transforms are done in place */
+    MultidimArray< Complex > fRows;
+
+#ifdef RELION_SINGLE_PRECISION
+    /* fftw plans for the rows and the columns */
+    fftwf_plan fPlanRowsForward, fPlanRowsBackward;
+    fftwf_plan fPlanColumnsForward, fPlanColumnsBackward;
+#else
+    /* fftw plans for the rows and the columns */
+    fftw_plan fPlanRowsForward, fPlanRowsBackward;
+    fftw_plan fPlanColumnsForward, fPlanColumnsBackward;
+#endif
+
+    bool plans_are_set;
+
+    /* Pointers to the arrays with which the plans were computed, the image size and the number of transformed columns */
+    RFLOAT * dataPtr;
+    Complex * rowsDataPtr;
+    long int plan_size, plan_hdim;
+
+    /** Transformer for everything that cannot be pruned */
+    FourierTransformer full_transformer;
+
+public:
+    /** Default constructor */
+    PrunedFourierTransformer();
+
+    /** Destructor */
+    ~PrunedFourierTransformer();
+
+    /** Copy constructor. Plans are not shared but will be taken from the plan cache upon the next transform. */
+    PrunedFourierTransformer(const PrunedFourierTransformer& op);
+
+    /** Assignment. Plans are not shared but will be taken from the plan cache upon the next transform. */
+    PrunedFourierTransformer& operator=(const PrunedFourierTransformer& op);
+
+    /** Compute the Fourier transform of v, windowed to newdim.
+        v itself is not modified. */
+    void FourierTransform(MultidimArray<RFLOAT> &v, MultidimArray<Complex > &V, long int newdim);
+
+    /** Compute the inverse Fourier transform of V, padded with zeros to the size of v.
+        As in windowFourierTransform, only the components within the
+        largest circle in V are used. The output v should already have
+        the right size. V is not modified. */
+    void inverseFourierTransform(MultidimArray<Complex > &V, MultidimArray<RFLOAT> &v);
+
+    /** Clear object and release the plans */
+    void clear();
+
+private:
+    void init();
+    void destroyPlans();
+    // Take plans from the plan cache for images of size x size, keeping hdim columns
+    void setPlans(MultidimArray<RFLOAT> &v, long int hdim);
+};
+
 // Randomize phases beyond the given shell (index)
 void randomizePhasesBeyond(MultidimArray<RFLOAT> &I, int index);
 
@@ -54,6 +54,7 @@
 #include <complex>
 #include <fstream>
 #include <typeinfo>
+#include <stdint.h>
 
 void fitStraightLine(const std::vector<fit_point2D> &points, RFLOAT &slope, RFLOAT &intercept, RFLOAT &corr_coeff)
 {
@@ -624,6 +625,24 @@ float rnd_gaus(float mu, float sigma)
 
 }
 
+float rnd_gaus_r(float mu, float sigma, unsigned int &seed)
+{
+  float U1, U2, W;
+
+  if (sigma == 0)
+	  return mu;
+
+  do
+  {
+      U1 = -1 + ((float) rand_r (&seed) / RAND_MAX) * 2;
+      U2 = -1 + ((float) rand_r (&seed) / RAND_MAX) * 2;
+      W = U1 * U1 + U2 * U2;
+  }
+  while (W >= 1 || W == 0);
+
+  return (mu + sigma * U1 * (float) sqrt ((-2 * log (W)) / W));
+}
+
 float rnd_student_t(RFLOAT nu, float mu, float sigma)
 {
 	REPORT_ERROR("rnd_student_t currently not implemented!");
@@ -760,5 +779,75 @@ void swapbytes(char* v, unsigned long n)
     }
 }
 
+void swapbytesArray(char* v, size_t nr_elements, unsigned long n, const char* src)
+{
+    if (src == NULL)
+        src = v;
+    switch (n)
+    {
+    case 1:
+        if (src != v)
+            memcpy(v, src, nr_elements);
+        break;
+    case 2:
+        {
+            const uint16_t* in = (const uint16_t*) src;
+            uint16_t* out = (uint16_t*) v;
+            for (size_t i = 0; i < nr_elements; i++)
+            {
+                uint16_t x = in[i];
+                out[i] = (uint16_t)((x >> 8) | (x << 8));
+            }
+            break;
+        }
+    case 4:
+        {
+            const uint32_t* in = (const uint32_t*) src;
+            uint32_t* out = (uint32_t*) v;
+            for (size_t i = 0; i < nr_elements; i++)
+            {
+                uint32_t x = in[i];
+                out[i] = (x >> 24) | ((x >> 8) & 0x0000ff00u) | ((x << 8) & 0x00ff0000u) | (x << 24);
+            }
+            break;
+        }
+    case 8:
+        {
+            const uint64_t* in = (const uint64_t*) src;
+            uint64_t* out = (uint64_t*) v;
+            for (size_t i = 0; i < nr_elements; i++)
+            {
+                uint64_t x = in[i];
+                x = ((x & 0x00000000ffffffffULL) << 32) | (x >> 32);
+                x = ((x & 0x0000ffff0000ffffULL) << 16) | ((x >> 16) & 0x0000ffff0000ffffULL);
+                out[i] = ((x & 0x00ff00ff00ff00ffULL) << 8) | ((x >> 8) & 0x00ff00ff00ff00ffULL);
+            }
+            break;
+        }
+    default:
+        {
+            if (src != v)
+                memcpy(v, src, nr_elements * n);
+            for (size_t i = 0; i < nr_elements; i++)
+                swapbytes(v + i * n, n);
+        }
+    }
+}
+
+static std::vector<float> buildHalfToFloatTable()
+{
+    std::vector<float> table(65536);
+    for (unsigned int h = 0; h < 65536; h++)
+        table[h] = halfToFloat((unsigned short)h);
+    return table;
+}
+
+const float* getHalfToFloatTable()
+{
+    // Built on first use (the initialisation of a local static is done only once, also with threads)
+    static const std::vector<float> table = buildHalfToFloatTable();
+    return &table[0];
+}
+
 
 
@@ -55,6 +55,7 @@
 #include <algorithm>
 #include <vector>
 #include <typeinfo>
+#include <cstring>
 
 #include "src/numerical_recipes.h"
 #include "src/macros.h"
@@ -366,6 +367,13 @@ float rnd_unif(float a = 0., float b = 1.);
  */
 float rnd_gaus(float mu = 0., float sigma = 1.);
 
+/** Produce a gaussian random number with mean mu and standard deviation sigma from the generator state in seed
+ *
+ * Unlike rnd_gaus, this does not use the global random generator, so it can be used by multiple threads.
+ * The same seed always gives the same sequence of numbers.
+ */
+float rnd_gaus_r(float mu, float sigma, unsigned int &seed);
+
 /** Produce a gaussian random number with mean mu and standard deviation sigma and nu degrees of freedom
  *
  * @code
@@ -468,6 +476,84 @@ float rnd_log(float a, float b);
  */
 void swapbytes(char* v, unsigned long n);
 
+/** Conversion little-big endian of an array of nr_elements elements of n bytes each
+ *
+ * If src is given, the swapped elements of src are written into v (which should
+ * not overlap with src), otherwise v is swapped in place. The loops for 2, 4 and
+ * 8-byte elements are written such that the compiler can vectorise them.
+ */
+void swapbytesArray(char* v, size_t nr_elements, unsigned long n, const char* src = NULL);
+
+/** Conversion of a float to an IEEE 754 half-precision (16-bit) float
+ *
+ * Rounds to the nearest representable value (ties to even). Values beyond
+ * the half-precision range (|x| >= 65520) become infinity.
+ */
+inline unsigned short floatToHalf(float x)
+{
+    unsigned int f;
+    memcpy(&f, &x, sizeof(float));
+    unsigned short sign = (unsigned short)((f >> 16) & 0x8000);
+    unsigned int absf = f & 0x7fffffff;
+
+    // Infinity and NaN (keep NaN a quiet NaN)
+    if (absf >= 0x7f800000)
+        return sign | 0x7c00 | ((absf > 0x7f800000) ? 0x0200 : 0);
+    // Too large: rounds to infinity
+    if (absf >= 0x477ff000)
+        return sign | 0x7c00;
+    // Subnormal half-precision numbers (or zero)
+    if (absf < 0x38800000)
+    {
+        if (absf < 0x33000000)
+            return sign;
+        unsigned int e = absf >> 23;
+        unsigned int m = (absf & 0x007fffff) | 0x00800000;
+        unsigned int shift = 126 - e;
+        unsigned int h = m >> shift;
+        unsigned int rem = m & ((1u << shift) - 1);
+        unsigned int halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (h & 1)))
+            h++;
+        return sign | (unsigned short)h;
+    }
+    // Normal numbers: re-bias the exponent and round the mantissa from 23 to 10 bits
+    unsigned int h = (absf - 0x38000000) >> 13;
+    unsigned int rem = absf & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++;
+    return sign | (unsigned short)h;
+}
+
+/** Conversion of an IEEE 754 half-precision (16-bit) float to a float
+ */
+inline float halfToFloat(unsigned short h)
+{
+    unsigned int sign = ((unsigned int)(h & 0x8000)) << 16;
+    unsigned int e = (h >> 10) & 0x1f;
+    unsigned int m = h & 0x03ff;
+    unsigned int f;
+    if (e == 0)
+    {
+        // Zero or subnormal: m * 2^-24
+        float result = (float)m * 5.9604644775390625e-8f;
+        return (sign) ? -result : result;
+    }
+    else if (e == 31)
+        f = sign | 0x7f800000 | (m << 13);
+    else
+        f = sign | ((e + 112) << 23) | (m << 13);
+    float result;
+    memcpy(&result, &f, sizeof(float));
+    return result;
+}
+
+/** Table with the float values of all 65536 half-precision (16-bit) floats
+ *
+ * Converting a page of half-precision data is a single lookup per element.
+ */
+const float* getHalfToFloatTable();
+
 //@}
 
 //@}
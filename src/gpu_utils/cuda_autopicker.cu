@@ -425,7 +425,7 @@ void AutoPickerCuda::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 	if (basePckr->do_read_fom_maps)
 	{
 		CTIC(timer,"readFromFomMaps_0");
-		FileName fn_tmp=basePckr->getOutputRootName(fn_mic)+"_"+basePckr->fn_out+"_stddevNoise.spi";
+		FileName fn_tmp = basePckr->getFomMapName(fn_mic, "_stddevNoise");
 		Image<RFLOAT> It;
 		It.read(fn_tmp);
 		Mstddev = It();
@@ -582,10 +582,10 @@ void AutoPickerCuda::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 		{
 			CTIC(timer,"writeToFomMaps");
 			// TMP output
-			FileName fn_tmp=basePckr->getOutputRootName(fn_mic)+"_"+basePckr->fn_out+"_stddevNoise.spi";
+			FileName fn_tmp = basePckr->getFomMapName(fn_mic, "_stddevNoise");
 			Image<RFLOAT> It;
 			It() = Mstddev;
-			It.write(fn_tmp);
+			It.write(fn_tmp, -1, false, WRITE_OVERWRITE, (basePckr->do_compact_fom_maps) ? Float16 : Unknown_Type);
 			CTOC(timer,"writeToFomMaps");
 		}
 
@@ -609,7 +609,7 @@ void AutoPickerCuda::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 			Image<RFLOAT> It_float;
 			Image<int> It_int;
 
-			fn_tmp = basePckr->getOutputRootName(fn_mic)+"_"+basePckr->fn_out+"_combinedCCF.spi";
+			fn_tmp = basePckr->getFomMapName(fn_mic, "_combinedCCF");
 			It_float.read(fn_tmp);
 			Mccf_best_combined = It_float();
 
@@ -652,12 +652,12 @@ void AutoPickerCuda::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 				FileName fn_tmp;
 				Image<RFLOAT> It;
 
-				fn_tmp.compose(basePckr->getOutputRootName(fn_mic)+"_"+basePckr->fn_out+"_ref", iref,"_bestCCF.spi");
+				fn_tmp = basePckr->getFomMapName(fn_mic, "_bestCCF", iref);
 				It.read(fn_tmp);
 				Mccf_best = It();
 				It.MDMainHeader.getValue(EMDL_IMAGE_STATS_MAX, expected_Pratio);  // Retrieve expected_Pratio from the header of the image
 
-				fn_tmp.compose(basePckr->getOutputRootName(fn_mic)+"_"+basePckr->fn_out+"_ref", iref,"_bestPSI.spi");
+				fn_tmp = basePckr->getFomMapName(fn_mic, "_bestPSI", iref);
 				It.read(fn_tmp);
 				Mpsi_best = It();
 				CTOC(timer,"readFromFomMaps");
@@ -891,12 +891,12 @@ void AutoPickerCuda::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 				It() = Mccf_best;
 				// Store expected_Pratio in the header of the image..
 				It.MDMainHeader.setValue(EMDL_IMAGE_STATS_MAX, expected_Pratio);  // Store expected_Pratio in the header of the image
-				fn_tmp.compose(basePckr->getOutputRootName(fn_mic)+"_"+basePckr->fn_out+"_ref", iref,"_bestCCF.spi");
-				It.write(fn_tmp);
+				fn_tmp = basePckr->getFomMapName(fn_mic, "_bestCCF", iref);
+				It.write(fn_tmp, -1, false, WRITE_OVERWRITE, (basePckr->do_compact_fom_maps) ? Float16 : Unknown_Type);
 
 				It() = Mpsi_best;
-				fn_tmp.compose(basePckr->getOutputRootName(fn_mic)+"_"+basePckr->fn_out+"_ref", iref,"_bestPSI.spi");
-				It.write(fn_tmp);
+				fn_tmp = basePckr->getFomMapName(fn_mic, "_bestPSI", iref);
+				It.write(fn_tmp, -1, false, WRITE_OVERWRITE, (basePckr->do_compact_fom_maps) ? Float16 : Unknown_Type);
 				CTOC(timer,"writeFomMaps");
 
 			} // end if do_write_fom_maps
@@ -991,8 +991,8 @@ void AutoPickerCuda::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 			Image<int> It_int;
 
 			It_float() = Mccf_best_combined;
-			fn_tmp = basePckr->getOutputRootName(fn_mic) + "_" + basePckr->fn_out + "_combinedCCF.spi";
-			It_float.write(fn_tmp);
+			fn_tmp = basePckr->getFomMapName(fn_mic, "_combinedCCF");
+			It_float.write(fn_tmp, -1, false, WRITE_OVERWRITE, (basePckr->do_compact_fom_maps) ? Float16 : Unknown_Type);
 
 			It_int() = Mclass_best_combined;
 			fn_tmp = basePckr->getOutputRootName(fn_mic) + + "_" + basePckr->fn_out + "_combinedCLASS.spi";
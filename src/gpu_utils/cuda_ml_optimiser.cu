@@ -151,11 +151,7 @@ void getFourierTransformsAndCtfs(long int my_ori_particle,
 			// If all slaves had preread images into RAM: get those now
 			if (baseMLO->do_preread_images)
 			{
-                img().reshape(baseMLO->mydata.particles[part_id].img);
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(baseMLO->mydata.particles[part_id].img)
-				{
-                	DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(baseMLO->mydata.particles[part_id].img, n);
-				}
+                baseMLO->mydata.particles[part_id].getPrereadImage(img());
 			}
 			else
 			{
@@ -174,7 +170,18 @@ void getFourierTransformsAndCtfs(long int my_ori_particle,
 				}
 				else
 				{
-					img() = baseMLO->exp_imgs[istop];
+					FileName fn_img;
+					if (baseMLO->scratch_reader.isOpen() && baseMLO->mydata.getImageNameOnScratch(part_id, fn_img))
+					{
+						// All threads read their own particles from the stack on the scratch disk
+						img.readFromStackReader(fn_img, baseMLO->scratch_reader);
+						img().setXmippOrigin();
+					}
+					else
+					{
+						baseMLO->waitForImageSomeParticles(istop);
+						img() = baseMLO->exp_imgs[istop];
+					}
 				}
 			}
 			if (baseMLO->has_converged && baseMLO->do_use_reconstruct_images)
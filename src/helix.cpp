@@ -20,6 +20,7 @@
 
 #include "src/macros.h"
 #include "src/helix.h"
+#include "src/parallel.h"
 
 //#define DEBUG_SEARCH_HELICAL_SYMMETRY
 
@@ -112,20 +113,14 @@ void makeHelicalSymmetryList(
 	return;
 };
 
-bool calcCCofHelicalSymmetry(
+void HelicalSymmetryVoxelTable::initialise(
 		const MultidimArray<RFLOAT>& v,
 		RFLOAT r_min_pix,
 		RFLOAT r_max_pix,
-		RFLOAT z_percentage,
-		RFLOAT rise_pix,
-		RFLOAT twist_deg,
-		RFLOAT& cc,
-		int& nr_asym_voxels)
+		RFLOAT z_percentage)
 {
-	// TODO: go through every line to find bugs!!!
-	int rec_len, r_max_XY, startZ, finishZ;
-	RFLOAT dist_r_pix, sum_pw1, sum_pw2;
-	std::vector<RFLOAT> sin_rec, cos_rec, dev_voxel, dev_chunk;
+	int r_max_XY;
+	RFLOAT dist_r_pix;
 
 	if ( (STARTINGZ(v) != FIRST_XMIPP_INDEX(ZSIZE(v))) || (STARTINGY(v) != FIRST_XMIPP_INDEX(YSIZE(v))) || (STARTINGX(v) != FIRST_XMIPP_INDEX(XSIZE(v))) )
 		REPORT_ERROR("helix.cpp::calcCCofHelicalSymmetry(): The origin of input 3D MultidimArray is not at the center (use v.setXmippOrigin() before calling this function)!");
@@ -142,6 +137,32 @@ bool calcCCofHelicalSymmetry(
 	startZ = (startZ <= (STARTINGZ(v))) ? (STARTINGZ(v) + 1) : (startZ);
 	finishZ = (finishZ >= (FINISHINGZ(v))) ? (FINISHINGZ(v) - 1) : (finishZ);
 
+	// Voxels within the cylinder
+	ii.clear();
+	jj.clear();
+	FOR_ALL_ELEMENTS_IN_ARRAY2D(v)
+	{
+		dist_r_pix = sqrt(i * i + j * j);
+		if ( (dist_r_pix < r_min_pix) || (dist_r_pix > r_max_pix) )
+			continue;
+		ii.push_back(i);
+		jj.push_back(j);
+	}
+}
+
+bool calcCCofHelicalSymmetry(
+		const MultidimArray<RFLOAT>& v,
+		const HelicalSymmetryVoxelTable& table,
+		RFLOAT rise_pix,
+		RFLOAT twist_deg,
+		RFLOAT& cc,
+		int& nr_asym_voxels)
+{
+	int rec_len, nr_xy, nr_z, max_rot_len;
+	RFLOAT sum_pw1, sum_pw2;
+	std::vector<RFLOAT> sin_rec, cos_rec, dev_chunk, fx_rec, fy_rec, fz_rec;
+	std::vector<int> x0_rec, y0_rec, z0_rec, rot_len;
+
 	// Calculate tabulated sine and cosine values
 	rec_len = 2 + (CEIL((RFLOAT(ZSIZE(v)) + 2.) / rise_pix));
 	sin_rec.clear();
@@ -158,114 +179,148 @@ bool calcCCofHelicalSymmetry(
 	rise_pix = fabs(rise_pix);
 
 	// Test a chunk of Z length = rise
-	dev_chunk.clear();
-	// Iterate through all coordinates on Z, Y and then X axes
-	FOR_ALL_ELEMENTS_IN_ARRAY3D(v)
+	// For each Z slice in the chunk, tabulate the Z coordinates of the symmetry mates of its voxels
+	// Only slices with at least one symmetry mate before finishZ contribute to the chunk
+	max_rot_len = 0;
+	rot_len.clear();
+	z0_rec.clear();
+	fz_rec.clear();
+	for (int k = table.startZ; (k <= (table.startZ + (FLOOR(rise_pix)))) && (k <= table.finishZ); k++)
 	{
-		RFLOAT xp, yp, zp, fx, fy, fz;
-
-		// Test a chunk of Z length = rise
-		// for(idz = startZ; (idz <= (startZ + ((int)(floor(rise_pix))))) && (idz <= finishZ); idz++)
-		if ( (k < startZ) || (k > (startZ + (FLOOR(rise_pix)))) || (k > finishZ) )
-			continue;
-
-		dist_r_pix = sqrt(i * i + j * j);
-		if ( (dist_r_pix < r_min_pix) || (dist_r_pix > r_max_pix) )
-			continue;
-
-		// Pick a voxel in the chunk
-		dev_voxel.clear();
-		dev_voxel.push_back(A3D_ELEM(v, k, i, j));
-
-		// Pick other voxels according to this voxel and helical symmetry
-		zp = k;
+		RFLOAT zp = k;
 		int rot_id = 0;
 		while (1)
 		{
 			// Rise
 			zp += rise_pix;
-			if (zp > finishZ) // avoid segmentation fault - finishZ is always strictly smaller than FINISHINGZ(v)!
+			if (zp > table.finishZ) // avoid segmentation fault - finishZ is always strictly smaller than FINISHINGZ(v)!
 				break;
-
-			// Twist
 			rot_id++;
-			xp = ((RFLOAT)(j)) * cos_rec[rot_id] - ((RFLOAT)(i)) * sin_rec[rot_id];
-			yp = ((RFLOAT)(j)) * sin_rec[rot_id] + ((RFLOAT)(i)) * cos_rec[rot_id];
-
-			// Trilinear interpolation (with physical coords)
-			// Subtract STARTINGX,Y,Z to accelerate access to data
-			// In that way use DIRECT_A3D_ELEM, rather than A3D_ELEM
-			int x0, y0, z0, x1, y1, z1;
-			x0 = FLOOR(xp); fx = xp - x0; x0 -= STARTINGX(v); x1 = x0 + 1;
-			y0 = FLOOR(yp); fy = yp - y0; y0 -= STARTINGY(v); y1 = y0 + 1;
-			z0 = FLOOR(zp); fz = zp - z0; z0 -= STARTINGZ(v); z1 = z0 + 1;
-			// DEBUG
-			if ( (x0 < 0) || (y0 < 0) || (z0 < 0) || (x1 >= XSIZE(v)) || (y1 >= YSIZE(v)) || (z1 >= ZSIZE(v)) )
-				std::cout << " idzidyidx= " << k << ", " << i << ", " << j << ", x0x1y0y1z0z1= " << x0 << ", " << x1 << ", " << y0 << ", " << y1 << ", " << z0 << ", " << z1 << std::endl;
-
-			RFLOAT d000, d001, d010, d011, d100, d101, d110, d111;
-			d000 = DIRECT_A3D_ELEM(v, z0, y0, x0);
-			d001 = DIRECT_A3D_ELEM(v, z0, y0, x1);
-			d010 = DIRECT_A3D_ELEM(v, z0, y1, x0);
-			d011 = DIRECT_A3D_ELEM(v, z0, y1, x1);
-			d100 = DIRECT_A3D_ELEM(v, z1, y0, x0);
-			d101 = DIRECT_A3D_ELEM(v, z1, y0, x1);
-			d110 = DIRECT_A3D_ELEM(v, z1, y1, x0);
-			d111 = DIRECT_A3D_ELEM(v, z1, y1, x1);
+			int z0 = FLOOR(zp);
+			fz_rec.push_back(zp - z0);
+			z0_rec.push_back(z0 - STARTINGZ(v));
+		}
+		if (rot_id < 1)
+			break;
+		rot_len.push_back(rot_id);
+		max_rot_len = (rot_id > max_rot_len) ? (rot_id) : (max_rot_len);
+	}
+	nr_z = rot_len.size();
+	nr_xy = table.ii.size();
 
-			RFLOAT dx00, dx01, dx10, dx11;
-			dx00 = LIN_INTERP(fx, d000, d001);
-			dx01 = LIN_INTERP(fx, d100, d101);
-			dx10 = LIN_INTERP(fx, d010, d011);
-			dx11 = LIN_INTERP(fx, d110, d111);
+	if ( (nr_z < 1) || (nr_xy < 1) )
+	{
+		cc = (1e10);
+		nr_asym_voxels = 0;
+		return false;
+	}
 
-			RFLOAT dxy0, dxy1, ddd;
-			dxy0 = LIN_INTERP(fy, dx00, dx10);
-			dxy1 = LIN_INTERP(fy, dx01, dx11);
+	// Devs of all voxels in the chunk, in the order of Z, Y and then X axes
+	dev_chunk.resize(nr_z * nr_xy);
+	x0_rec.resize(max_rot_len + 1);
+	y0_rec.resize(max_rot_len + 1);
+	fx_rec.resize(max_rot_len + 1);
+	fy_rec.resize(max_rot_len + 1);
+	for (int ixy = 0; ixy < nr_xy; ixy++)
+	{
+		int i = table.ii[ixy];
+		int j = table.jj[ixy];
 
-			ddd = LIN_INTERP(fz, dxy0, dxy1);
+		// Twist - the XY coordinates of the symmetry mates are the same for all Z slices in the chunk
+		for (int rot_id = 1; rot_id <= max_rot_len; rot_id++)
+		{
+			RFLOAT xp, yp;
+			xp = ((RFLOAT)(j)) * cos_rec[rot_id] - ((RFLOAT)(i)) * sin_rec[rot_id];
+			yp = ((RFLOAT)(j)) * sin_rec[rot_id] + ((RFLOAT)(i)) * cos_rec[rot_id];
 
-			// Record this voxel
-			dev_voxel.push_back(ddd);
+			// Subtract STARTINGX,Y to accelerate access to data
+			int x0 = FLOOR(xp), y0 = FLOOR(yp);
+			fx_rec[rot_id] = xp - x0;
+			fy_rec[rot_id] = yp - y0;
+			x0_rec[rot_id] = x0 - STARTINGX(v);
+			y0_rec[rot_id] = y0 - STARTINGY(v);
 		}
 
-		// Calc dev of this voxel in the chunk
-		if (dev_voxel.size() > 1)
+		int iz_rec = 0;
+		for (int iz = 0; iz < nr_z; iz++)
 		{
+			// Pick a voxel in the chunk
+			RFLOAT ddd = A3D_ELEM(v, table.startZ + iz, i, j);
 			sum_pw1 = sum_pw2 = 0.;
-			for (int id = 0; id < dev_voxel.size(); id++)
+			sum_pw1 += ddd;
+			sum_pw2 += ddd * ddd;
+
+			// Pick other voxels according to this voxel and helical symmetry
+			for (int rot_id = 1; rot_id <= rot_len[iz]; rot_id++, iz_rec++)
 			{
-				sum_pw1 += dev_voxel[id];
-				sum_pw2 += dev_voxel[id] * dev_voxel[id];
+				// Trilinear interpolation (with physical coords)
+				int x0, y0, z0, x1, y1, z1;
+				RFLOAT fx, fy, fz;
+				x0 = x0_rec[rot_id]; fx = fx_rec[rot_id]; x1 = x0 + 1;
+				y0 = y0_rec[rot_id]; fy = fy_rec[rot_id]; y1 = y0 + 1;
+				z0 = z0_rec[iz_rec]; fz = fz_rec[iz_rec]; z1 = z0 + 1;
+
+				RFLOAT d000, d001, d010, d011, d100, d101, d110, d111;
+				d000 = DIRECT_A3D_ELEM(v, z0, y0, x0);
+				d001 = DIRECT_A3D_ELEM(v, z0, y0, x1);
+				d010 = DIRECT_A3D_ELEM(v, z0, y1, x0);
+				d011 = DIRECT_A3D_ELEM(v, z0, y1, x1);
+				d100 = DIRECT_A3D_ELEM(v, z1, y0, x0);
+				d101 = DIRECT_A3D_ELEM(v, z1, y0, x1);
+				d110 = DIRECT_A3D_ELEM(v, z1, y1, x0);
+				d111 = DIRECT_A3D_ELEM(v, z1, y1, x1);
+
+				RFLOAT dx00, dx01, dx10, dx11;
+				dx00 = LIN_INTERP(fx, d000, d001);
+				dx01 = LIN_INTERP(fx, d100, d101);
+				dx10 = LIN_INTERP(fx, d010, d011);
+				dx11 = LIN_INTERP(fx, d110, d111);
+
+				RFLOAT dxy0, dxy1;
+				dxy0 = LIN_INTERP(fy, dx00, dx10);
+				dxy1 = LIN_INTERP(fy, dx01, dx11);
+
+				ddd = LIN_INTERP(fz, dxy0, dxy1);
+
+				// Record this voxel
+				sum_pw1 += ddd;
+				sum_pw2 += ddd * ddd;
 			}
-			sum_pw1 /= dev_voxel.size();
-			sum_pw2 /= dev_voxel.size();
+
+			// Calc dev of this voxel in the chunk
+			sum_pw1 /= (RFLOAT)(rot_len[iz] + 1);
+			sum_pw2 /= (RFLOAT)(rot_len[iz] + 1);
 			// TODO: record stddev or dev???
-			dev_chunk.push_back(sum_pw2 - sum_pw1 * sum_pw1);
+			dev_chunk[iz * nr_xy + ixy] = sum_pw2 - sum_pw1 * sum_pw1;
 		}
-		dev_voxel.clear();
 	}
 
 	// Calc avg of all voxels' devs in this chunk (for a specific helical symmetry)
-	if (dev_chunk.size() < 1)
-	{
-		cc = (1e10);
-		nr_asym_voxels = 0;
-		return false;
-	}
-	else
-	{
-		sum_pw1 = 0.;
-		for (int id = 0; id < dev_chunk.size(); id++)
-			sum_pw1 += dev_chunk[id];
-		cc = (sum_pw1 / dev_chunk.size());
-	}
+	sum_pw1 = 0.;
+	for (int id = 0; id < dev_chunk.size(); id++)
+		sum_pw1 += dev_chunk[id];
+	cc = (sum_pw1 / dev_chunk.size());
 	nr_asym_voxels = dev_chunk.size();
 	dev_chunk.clear();
 
 	return true;
 };
 
+bool calcCCofHelicalSymmetry(
+		const MultidimArray<RFLOAT>& v,
+		RFLOAT r_min_pix,
+		RFLOAT r_max_pix,
+		RFLOAT z_percentage,
+		RFLOAT rise_pix,
+		RFLOAT twist_deg,
+		RFLOAT& cc,
+		int& nr_asym_voxels)
+{
+	HelicalSymmetryVoxelTable table;
+	table.initialise(v, r_min_pix, r_max_pix, z_percentage);
+	return calcCCofHelicalSymmetry(v, table, rise_pix, twist_deg, cc, nr_asym_voxels);
+};
+
 void checkRangesForLocalSearchHelicalSymmetry(
 		RFLOAT rise_A,
 		RFLOAT rise_min_A,
@@ -294,6 +349,52 @@ void checkRangesForLocalSearchHelicalSymmetry(
 		REPORT_ERROR("helix.cpp::checkRangesForLocalSearchHelicalSymmetry(): Initial helical twist and/or rise are out of their specified ranges!");
 };
 
+// Helical symmetries in the search list of localSearchHelicalSymmetry() which are evaluated by multiple threads
+class HelicalSymmetrySearchJob
+{
+public:
+	const MultidimArray<RFLOAT> *v;
+	const HelicalSymmetryVoxelTable *table;
+	std::vector<HelicalSymmetryItem> *list;
+
+	// Indices in the list of all symmetries which have not been calculated before
+	std::vector<int> ids;
+
+	// Distribute these symmetries over the threads
+	ThreadTaskDistributor *distributor;
+};
+
+void globalThreadCalcCCofHelicalSymmetries(ThreadArgument &thArg)
+{
+	HelicalSymmetrySearchJob *job = (HelicalSymmetrySearchJob*) thArg.workClass;
+
+	try
+	{
+		int nr_asym_voxels;
+		size_t first_id, last_id;
+		while (job->distributor->getTasks(first_id, last_id))
+		{
+			for (size_t id = first_id; id <= last_id; id++)
+			{
+				// Each thread only writes the devs of its own symmetries
+				HelicalSymmetryItem& item = (*(job->list))[job->ids[id]];
+				calcCCofHelicalSymmetry(
+						*(job->v),
+						*(job->table),
+						item.rise_pix,
+						item.twist_deg,
+						item.dev,
+						nr_asym_voxels);
+			}
+		}
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE << std::endl << "In a thread that evaluates helical symmetries" << std::endl;
+		exit(1);
+	}
+}
+
 bool localSearchHelicalSymmetry(
 		const MultidimArray<RFLOAT>& v,
 		RFLOAT pixel_size_A,
@@ -308,15 +409,18 @@ bool localSearchHelicalSymmetry(
 		RFLOAT twist_min_deg,
 		RFLOAT twist_max_deg,
 		RFLOAT twist_inistep_deg,
-		RFLOAT& twist_refined_deg)
+		RFLOAT& twist_refined_deg,
+		int nr_threads)
 {
 	// TODO: whether iterations can exit & this function works for negative twist
-	int iter, box_len, nr_asym_voxels, nr_rise_samplings, nr_twist_samplings, nr_min_samplings, nr_max_samplings, best_id, iter_not_converged;
+	int iter, box_len, nr_rise_samplings, nr_twist_samplings, nr_min_samplings, nr_max_samplings, best_id, iter_not_converged;
 	RFLOAT r_min_pix, r_max_pix, best_dev, err_max;
 	RFLOAT rise_min_pix, rise_max_pix, rise_step_pix, rise_inistep_pix, twist_step_deg, rise_refined_pix;
 	RFLOAT rise_local_min_pix, rise_local_max_pix, twist_local_min_deg, twist_local_max_deg;
 	std::vector<HelicalSymmetryItem> helical_symmetry_list;
 	bool out_of_range, search_rise, search_twist;
+	HelicalSymmetryVoxelTable table;
+	HelicalSymmetrySearchJob job;
 
 	// Check input 3D reference
 	if (v.getDim() != 3)
@@ -414,6 +518,10 @@ bool localSearchHelicalSymmetry(
 		return true;
 
 	// Local searches
+	table.initialise(v, r_min_pix, r_max_pix, z_percentage);
+	job.v = &v;
+	job.table = &table;
+	job.list = &helical_symmetry_list;
 	helical_symmetry_list.clear();
 	iter_not_converged = 0;
 	for (iter = 1; iter <= 100; iter++)
@@ -433,33 +541,26 @@ bool localSearchHelicalSymmetry(
 		if (helical_symmetry_list.size() < 1)
 			REPORT_ERROR("helix.cpp::localSearchHelicalSymmetry(): BUG No helical symmetries are found in the search list!");
 
+		// Calculate all symmetries which are not calculated before in parallel
+		job.ids.clear();
+		for (int ii = 0; ii < helical_symmetry_list.size(); ii++)
+		{
+			if (helical_symmetry_list[ii].dev > (1e30))
+				job.ids.push_back(ii);
+		}
+		if (job.ids.size() > 0)
+		{
+			job.distributor = new ThreadTaskDistributor(job.ids.size(), 1);
+			ThreadManager *threads = new ThreadManager(XMIPP_MAX(1, XMIPP_MIN(nr_threads, (int)job.ids.size())), &job);
+			threads->run(globalThreadCalcCCofHelicalSymmetries);
+			delete threads;
+			delete job.distributor;
+		}
+
 		best_dev = (1e30);
 		best_id = -1;
 		for (int ii = 0; ii < helical_symmetry_list.size(); ii++)
 		{
-			// If this symmetry is not calculated before
-			if (helical_symmetry_list[ii].dev > (1e30))
-			{
-				// TODO: please check this!!!
-				calcCCofHelicalSymmetry(
-						v,
-						r_min_pix,
-						r_max_pix,
-						z_percentage,
-						helical_symmetry_list[ii].rise_pix,
-						helical_symmetry_list[ii].twist_deg,
-						helical_symmetry_list[ii].dev,
-						nr_asym_voxels);
-#ifdef DEBUG_SEARCH_HELICAL_SYMMETRY
-				std::cout << " NEW -->" << std::flush;
-#endif
-			}
-			else
-			{
-#ifdef DEBUG_SEARCH_HELICAL_SYMMETRY
-				std::cout << " OLD -->" << std::flush;
-#endif
-			}
 
 			if (helical_symmetry_list[ii].dev < best_dev)
 			{
@@ -702,6 +803,198 @@ void checkHelicalParametersFor3DHelicalReference(
 	}
 };
 
+// Helical symmetry imposed in real space by multiple threads, each thread averages whole XY slices
+class HelicalSymmetryImposeJob
+{
+public:
+	// Input reference, and a copy in which all voxels outside the mask are set to zero
+	const MultidimArray<RFLOAT> *v, *v_masked;
+	MultidimArray<RFLOAT> *vout;
+
+	// Parameters of the mask
+	RFLOAT r_min, r_max, d_min, d_max, D_min, D_max, cosine_width_pix;
+
+	// Y and X coordinates of all voxels within d_min ~ D_max in an XY slice
+	std::vector<int> ii, jj;
+
+	// Helical rise, and the range of asymmetrical units to be averaged for each Z slice
+	RFLOAT rise_pix;
+	std::vector<int> rot_min, rot_max;
+
+	// Tabulated sine and cosine values
+	std::vector<RFLOAT> sin_rec, cos_rec;
+
+	// Distribute the columns over the threads
+	ThreadTaskDistributor *distributor;
+};
+
+// Voxels outside the mask are set to zero in the input reference while imposing helical symmetry voxel by voxel (in the order of Z, Y and then X axes)
+// So the interpolation takes them from v_masked if they come before (k, i, j) in this order, or from v if they come after it
+inline RFLOAT getValueForHelicalSymmetry(
+		const MultidimArray<RFLOAT>& v,
+		const MultidimArray<RFLOAT>& v_masked,
+		long int kk,
+		long int ii,
+		long int jj,
+		long int n)
+{
+	long int nn = kk * YXSIZE(v) + ii * XSIZE(v) + jj;
+	return (nn < n) ? (DIRECT_MULTIDIM_ELEM(v_masked, nn)) : (DIRECT_MULTIDIM_ELEM(v, nn));
+}
+
+void globalThreadImposeHelicalSymmetryInRealSpace(ThreadArgument &thArg)
+{
+	HelicalSymmetryImposeJob *job = (HelicalSymmetryImposeJob*) thArg.workClass;
+	const MultidimArray<RFLOAT>& v = *(job->v);
+	const MultidimArray<RFLOAT>& v_masked = *(job->v_masked);
+	MultidimArray<RFLOAT>& vout = *(job->vout);
+
+	int nr_cols = job->ii.size();
+	std::vector<RFLOAT> d_rec(nr_cols), r_rec(nr_cols), pix_sum(nr_cols);
+
+	size_t first_z, last_z;
+	while (job->distributor->getTasks(first_z, last_z))
+	{
+		for (size_t kz = first_z; kz <= last_z; kz++)
+		{
+			int k = kz + STARTINGZ(v);
+			RFLOAT zi = (RFLOAT)(k);
+
+			// Voxels out of the mask stay zero in the output
+			for (int icol = 0; icol < nr_cols; icol++)
+			{
+				int i = job->ii[icol];
+				int j = job->jj[icol];
+				RFLOAT dd = (RFLOAT)(i * i + j * j);
+				RFLOAT rr = dd + (RFLOAT)(k * k);
+				d_rec[icol] = sqrt(dd);
+				r_rec[icol] = sqrt(rr);
+				pix_sum[icol] = 0.;
+			}
+
+			// Add all asymmetrical units one after the other to the voxels of this slice
+			// All voxels of one asymmetrical unit are interpolated from the same two Z slices of the input
+			RFLOAT pix_weight = 0.;
+			for (int id = job->rot_min[kz]; id <= job->rot_max[kz]; id++)
+			{
+				// Get the sine and cosine value
+				RFLOAT sin_val, cos_val;
+				if (id >= 0)
+				{
+					sin_val = job->sin_rec[id];
+					cos_val = job->cos_rec[id];
+				}
+				else
+				{
+					sin_val = (-1.) * job->sin_rec[-id];
+					cos_val = job->cos_rec[-id];
+				}
+
+				RFLOAT zp = zi + ((RFLOAT)(id)) * job->rise_pix;
+				int z0, z1;
+				RFLOAT fz;
+				z0 = FLOOR(zp); fz = zp - z0; z0 -= STARTINGZ(v); z1 = z0 + 1;
+
+				// Do all eight voxels come before or after (k, i, j)?
+				const MultidimArray<RFLOAT>* vin = NULL;
+				if (z1 < (int)kz)
+					vin = &v_masked;
+				else if (z0 > (int)kz)
+					vin = &v;
+
+				for (int icol = 0; icol < nr_cols; icol++)
+				{
+					if (r_rec[icol] > job->r_max)
+						continue;
+
+					// Get the voxel coordinates
+					RFLOAT yi = (RFLOAT)(job->ii[icol]);
+					RFLOAT xi = (RFLOAT)(job->jj[icol]);
+					RFLOAT yp = xi * sin_val + yi * cos_val;
+					RFLOAT xp = xi * cos_val - yi * sin_val;
+
+					// Trilinear interpolation (with physical coords)
+					// Subtract STARTINGX,Y to accelerate access to data
+					int x0, y0, x1, y1;
+					RFLOAT fx, fy;
+					x0 = FLOOR(xp); fx = xp - x0; x0 -= STARTINGX(v); x1 = x0 + 1;
+					y0 = FLOOR(yp); fy = yp - y0; y0 -= STARTINGY(v); y1 = y0 + 1;
+
+					RFLOAT d000, d001, d010, d011, d100, d101, d110, d111;
+					if (vin != NULL)
+					{
+						const RFLOAT* ptr = MULTIDIM_ARRAY(*vin) + z0 * YXSIZE(v) + y0 * XSIZE(v) + x0;
+						d000 = ptr[0];
+						d001 = ptr[1];
+						d010 = ptr[XSIZE(v)];
+						d011 = ptr[XSIZE(v) + 1];
+						d100 = ptr[YXSIZE(v)];
+						d101 = ptr[YXSIZE(v) + 1];
+						d110 = ptr[YXSIZE(v) + XSIZE(v)];
+						d111 = ptr[YXSIZE(v) + XSIZE(v) + 1];
+					}
+					else
+					{
+						long int n = kz * YXSIZE(v) + (job->ii[icol] - STARTINGY(v)) * XSIZE(v) + (job->jj[icol] - STARTINGX(v));
+						d000 = getValueForHelicalSymmetry(v, v_masked, z0, y0, x0, n);
+						d001 = getValueForHelicalSymmetry(v, v_masked, z0, y0, x1, n);
+						d010 = getValueForHelicalSymmetry(v, v_masked, z0, y1, x0, n);
+						d011 = getValueForHelicalSymmetry(v, v_masked, z0, y1, x1, n);
+						d100 = getValueForHelicalSymmetry(v, v_masked, z1, y0, x0, n);
+						d101 = getValueForHelicalSymmetry(v, v_masked, z1, y0, x1, n);
+						d110 = getValueForHelicalSymmetry(v, v_masked, z1, y1, x0, n);
+						d111 = getValueForHelicalSymmetry(v, v_masked, z1, y1, x1, n);
+					}
+
+					RFLOAT dx00, dx01, dx10, dx11;
+					dx00 = LIN_INTERP(fx, d000, d001);
+					dx01 = LIN_INTERP(fx, d100, d101);
+					dx10 = LIN_INTERP(fx, d010, d011);
+					dx11 = LIN_INTERP(fx, d110, d111);
+
+					RFLOAT dxy0, dxy1;
+					dxy0 = LIN_INTERP(fy, dx00, dx10);
+					dxy1 = LIN_INTERP(fy, dx01, dx11);
+
+					pix_sum[icol] += LIN_INTERP(fz, dxy0, dxy1);
+				}
+				pix_weight += 1.;
+			}
+
+			if (pix_weight < 0.9)
+				continue;
+			for (int icol = 0; icol < nr_cols; icol++)
+			{
+				RFLOAT d = d_rec[icol];
+				RFLOAT r = r_rec[icol];
+				if (r > job->r_max)
+					continue;
+
+				int i = job->ii[icol];
+				int j = job->jj[icol];
+				A3D_ELEM(vout, k, i, j) = pix_sum[icol] / pix_weight;
+
+				if ( (d > job->d_max) && (d < job->D_min) && (r < job->r_min) )
+				{}
+				else // The pixel is within cosine edge(s)
+				{
+					RFLOAT w = 1.;
+					if (d < job->d_max)  // d_min < d < d_max : w=(0~1)
+						w = 0.5 + (0.5 * cos(PI * ((job->d_max - d) / job->cosine_width_pix)));
+					else if (d > job->D_min) // D_min < d < D_max : w=(1~0)
+						w = 0.5 + (0.5 * cos(PI * ((d - job->D_min) / job->cosine_width_pix)));
+					if (r > job->r_min) // r_min < r < r_max
+					{
+						RFLOAT wr = 0.5 + (0.5 * cos(PI * ((r - job->r_min) / job->cosine_width_pix)));
+						w = (wr < w) ? (wr) : (w);
+					}
+					A3D_ELEM(vout, k, i, j) *= w;
+				}
+			}
+		}
+	}
+}
+
 void imposeHelicalSymmetryInRealSpace(
 		MultidimArray<RFLOAT>& v,
 		RFLOAT pixel_size_A,
@@ -711,14 +1004,15 @@ void imposeHelicalSymmetryInRealSpace(
 		RFLOAT z_percentage,
 		RFLOAT rise_A,
 		RFLOAT twist_deg,
-		RFLOAT cosine_width_pix)
+		RFLOAT cosine_width_pix,
+		int nr_threads)
 {
 	long int Xdim, Ydim, Zdim, Ndim, box_len;
 	RFLOAT rise_pix, sphere_radius_pix, cyl_inner_radius_pix, cyl_outer_radius_pix, r_min, r_max, d_min, d_max, D_min, D_max, z_min, z_max;
 
 	int rec_len;
-	std::vector<RFLOAT> sin_rec, cos_rec;
-	MultidimArray<RFLOAT> vout;
+	MultidimArray<RFLOAT> vout, v_masked;
+	HelicalSymmetryImposeJob job;
 
 	if (v.getDim() != 3)
 		REPORT_ERROR("helix.cpp::imposeHelicalSymmetryInRealSpace(): Input helical reference is not 3D! (vol.getDim() = " + integerToString(v.getDim()) + ")");
@@ -768,124 +1062,80 @@ void imposeHelicalSymmetryInRealSpace(
 
 	// Calculate tabulated sine and cosine values
 	rec_len = 2 + (CEIL((RFLOAT(Zdim) + 2.) / rise_pix));
-	sin_rec.clear();
-	cos_rec.clear();
-	sin_rec.resize(rec_len);
-	cos_rec.resize(rec_len);
+	job.sin_rec.resize(rec_len);
+	job.cos_rec.resize(rec_len);
 	for (int id = 0; id < rec_len; id++)
 #ifdef RELION_SINGLE_PRECISION
-		SINCOSF(DEG2RAD(((RFLOAT)(id)) * twist_deg), &sin_rec[id], &cos_rec[id]);
+		SINCOSF(DEG2RAD(((RFLOAT)(id)) * twist_deg), &job.sin_rec[id], &job.cos_rec[id]);
 #else
-		SINCOS(DEG2RAD(((RFLOAT)(id)) * twist_deg), &sin_rec[id], &cos_rec[id]);
+		SINCOS(DEG2RAD(((RFLOAT)(id)) * twist_deg), &job.sin_rec[id], &job.cos_rec[id]);
 #endif
 
+	// Columns of voxels within the cylindrical mask, and a copy of the reference with all voxels out of the mask set to zero
+	v_masked = v;
 	FOR_ALL_ELEMENTS_IN_ARRAY3D(v)
 	{
-		// Out of the mask
 		RFLOAT dd = (RFLOAT)(i * i + j * j);
 		RFLOAT rr = dd + (RFLOAT)(k * k);
 		RFLOAT d = sqrt(dd);
 		RFLOAT r = sqrt(rr);
 		if ( (r > r_max) || (d < d_min) || (d > D_max) )
-		{
-			A3D_ELEM(v, k, i, j) = 0.;
+			A3D_ELEM(v_masked, k, i, j) = 0.;
+	}
+	FOR_ALL_ELEMENTS_IN_ARRAY2D(v)
+	{
+		RFLOAT d = sqrt((RFLOAT)(i * i + j * j));
+		if ( (d < d_min) || (d > D_max) )
 			continue;
-		}
+		job.ii.push_back(i);
+		job.jj.push_back(j);
+	}
 
-		// How many voxels should be used to calculate the average?
+	// How many voxels should be used to calculate the average?
+	for (int k = STARTINGZ(v); k <= FINISHINGZ(v); k++)
+	{
 		RFLOAT zi = (RFLOAT)(k);
-		RFLOAT yi = (RFLOAT)(i);
-		RFLOAT xi = (RFLOAT)(j);
 		int rot_max = -(CEIL((zi - z_max) / rise_pix));
 		int rot_min = -(FLOOR((zi - z_min) / rise_pix));
-		if (rot_max < rot_min)
-			REPORT_ERROR("helix.cpp::makeHelicalReferenceInRealSpace(): ERROR in imposing symmetry!");
+		job.rot_min.push_back(rot_min);
+		job.rot_max.push_back(rot_max);
 
-		// Do the average
-		RFLOAT pix_sum, pix_weight;
-		pix_sum = pix_weight = 0.;
-		for (int id = rot_min; id <= rot_max; id++)
+		if (rot_max < rot_min)
 		{
-			// Get the sine and cosine value
-			RFLOAT sin_val, cos_val;
-			if (id >= 0)
-			{
-				sin_val = sin_rec[id];
-				cos_val = cos_rec[id];
-			}
-			else
-			{
-				sin_val = (-1.) * sin_rec[-id];
-				cos_val = cos_rec[-id];
-			}
-
-			// Get the voxel coordinates
-			RFLOAT zp = zi + ((RFLOAT)(id)) * rise_pix;
-			RFLOAT yp = xi * sin_val + yi * cos_val;
-			RFLOAT xp = xi * cos_val - yi * sin_val;
-
-			// Trilinear interpolation (with physical coords)
-			// Subtract STARTINGY and STARTINGZ to accelerate access to data (STARTINGX=0)
-			// In that way use DIRECT_A3D_ELEM, rather than A3D_ELEM
-			int x0, y0, z0, x1, y1, z1;
-			RFLOAT fx, fy, fz;
-			x0 = FLOOR(xp); fx = xp - x0; x0 -= STARTINGX(v); x1 = x0 + 1;
-			y0 = FLOOR(yp); fy = yp - y0; y0 -= STARTINGY(v); y1 = y0 + 1;
-			z0 = FLOOR(zp); fz = zp - z0; z0 -= STARTINGZ(v); z1 = z0 + 1;
-
-			RFLOAT d000, d001, d010, d011, d100, d101, d110, d111;
-			d000 = DIRECT_A3D_ELEM(v, z0, y0, x0);
-			d001 = DIRECT_A3D_ELEM(v, z0, y0, x1);
-			d010 = DIRECT_A3D_ELEM(v, z0, y1, x0);
-			d011 = DIRECT_A3D_ELEM(v, z0, y1, x1);
-			d100 = DIRECT_A3D_ELEM(v, z1, y0, x0);
-			d101 = DIRECT_A3D_ELEM(v, z1, y0, x1);
-			d110 = DIRECT_A3D_ELEM(v, z1, y1, x0);
-			d111 = DIRECT_A3D_ELEM(v, z1, y1, x1);
-
-			RFLOAT dx00, dx01, dx10, dx11;
-			dx00 = LIN_INTERP(fx, d000, d001);
-			dx01 = LIN_INTERP(fx, d100, d101);
-			dx10 = LIN_INTERP(fx, d010, d011);
-			dx11 = LIN_INTERP(fx, d110, d111);
-
-			RFLOAT dxy0, dxy1;
-			dxy0 = LIN_INTERP(fy, dx00, dx10);
-			dxy1 = LIN_INTERP(fy, dx01, dx11);
-
-			pix_sum += LIN_INTERP(fz, dxy0, dxy1);
-			pix_weight += 1.;
-		}
-
-		if (pix_weight > 0.9)
-		{
-			A3D_ELEM(vout, k, i, j) = pix_sum / pix_weight;
-
-			if ( (d > d_max) && (d < D_min) && (r < r_min) )
-			{}
-			else // The pixel is within cosine edge(s)
+			// Only an error if there are voxels within the mask in this slice
+			for (int icol = 0; icol < job.ii.size(); icol++)
 			{
-				pix_weight = 1.;
-				if (d < d_max)  // d_min < d < d_max : w=(0~1)
-					pix_weight = 0.5 + (0.5 * cos(PI * ((d_max - d) / cosine_width_pix)));
-				else if (d > D_min) // D_min < d < D_max : w=(1~0)
-					pix_weight = 0.5 + (0.5 * cos(PI * ((d - D_min) / cosine_width_pix)));
-				if (r > r_min) // r_min < r < r_max
-				{
-					pix_sum = 0.5 + (0.5 * cos(PI * ((r - r_min) / cosine_width_pix)));
-					pix_weight = (pix_sum < pix_weight) ? (pix_sum) : (pix_weight);
-				}
-				A3D_ELEM(vout, k, i, j) *= pix_weight;
+				RFLOAT rr = (RFLOAT)(job.ii[icol] * job.ii[icol] + job.jj[icol] * job.jj[icol]) + (RFLOAT)(k * k);
+				if (sqrt(rr) <= r_max)
+					REPORT_ERROR("helix.cpp::makeHelicalReferenceInRealSpace(): ERROR in imposing symmetry!");
 			}
 		}
-		else
-			A3D_ELEM(vout, k, i, j) = 0.;
-    }
+	}
+
+	// Do the average
+	job.v = &v;
+	job.v_masked = &v_masked;
+	job.vout = &vout;
+	job.r_min = r_min;
+	job.r_max = r_max;
+	job.d_min = d_min;
+	job.d_max = d_max;
+	job.D_min = D_min;
+	job.D_max = D_max;
+	job.cosine_width_pix = cosine_width_pix;
+	job.rise_pix = rise_pix;
+	if (job.ii.size() > 0)
+	{
+		job.distributor = new ThreadTaskDistributor(Zdim, 1);
+		ThreadManager *threads = new ThreadManager(XMIPP_MAX(1, nr_threads), &job);
+		threads->run(globalThreadImposeHelicalSymmetryInRealSpace);
+		delete threads;
+		delete job.distributor;
+	}
 
 	// Copy and exit
 	v = vout;
-	sin_rec.clear();
-	cos_rec.clear();
+	v_masked.clear();
 	vout.clear();
 
 	return;
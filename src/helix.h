@@ -69,6 +69,32 @@ void makeHelicalSymmetryList(
 		RFLOAT twist_step_deg,
 		bool search_twist);
 
+// Voxels of a 3D helical reference which are compared with their symmetry mates in calcCCofHelicalSymmetry()
+// They only depend on the reference and the cylindrical mask, so they are calculated once for all (twist, rise) candidates
+class HelicalSymmetryVoxelTable
+{
+public:
+	// Central part of the reference along Z
+	int startZ, finishZ;
+
+	// Y and X coordinates of all voxels between r_min_pix and r_max_pix in an XY slice (in the same order as FOR_ALL_ELEMENTS_IN_ARRAY3D)
+	std::vector<int> ii, jj;
+
+	void initialise(
+			const MultidimArray<RFLOAT>& v,
+			RFLOAT r_min_pix,
+			RFLOAT r_max_pix,
+			RFLOAT z_percentage);
+};
+
+bool calcCCofHelicalSymmetry(
+		const MultidimArray<RFLOAT>& v,
+		const HelicalSymmetryVoxelTable& table,
+		RFLOAT rise_pix,
+		RFLOAT twist_deg,
+		RFLOAT& cc,
+		int& nr_asym_voxels);
+
 bool calcCCofHelicalSymmetry(
 		const MultidimArray<RFLOAT>& v,
 		RFLOAT r_min_pix,
@@ -101,7 +127,8 @@ bool localSearchHelicalSymmetry(
 		RFLOAT twist_min_deg,
 		RFLOAT twist_max_deg,
 		RFLOAT twist_inistep_deg,
-		RFLOAT& twist_refined_deg);
+		RFLOAT& twist_refined_deg,
+		int nr_threads = 1);
 
 RFLOAT getHelicalSigma2Rot(
 		RFLOAT helical_rise_pix,
@@ -143,7 +170,8 @@ void imposeHelicalSymmetryInRealSpace(
 		RFLOAT z_percentage,
 		RFLOAT rise_A,
 		RFLOAT twist_deg,
-		RFLOAT cosine_width_pix);
+		RFLOAT cosine_width_pix,
+		int nr_threads = 1);
 
 /*
 void searchCnZSymmetry(
@@ -18,6 +18,7 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/image.h"
+#include <cstddef>
 
 //#define DEBUG_REGULARISE_HELICAL_SEGMENTS
 
@@ -31,6 +32,7 @@ unsigned long  gettypesize(DataType type)
         case UShort: case Short: size = sizeof(short); break;
         case UInt:	 case Int:   size = sizeof(int); break;
         case Float:              size = sizeof(float); break;
+        case Float16:            size = sizeof(unsigned short); break;
         case Double:             size = sizeof(RFLOAT); break;
         case Bool:				  size = sizeof(bool); break;
         default: size = 0;
@@ -66,11 +68,192 @@ int datatypeString2Int(std::string s)
   {
     return Float;
   }
+  else if (!strcmp(s.c_str(),"float16"))
+  {
+    return Float16;
+  }
   else REPORT_ERROR("datatypeString2int; unknown datatype");
 
 
 }
 
+
+void ImageStackStatistics::getStatistics(RFLOAT &_minval, RFLOAT &_maxval, RFLOAT &avg, RFLOAT &stddev) const
+{
+	_minval = minval;
+	_maxval = maxval;
+	avg = (nr_pixels > 0) ? sum / nr_pixels : 0.;
+	if (nr_pixels > 1)
+	{
+		double var = sum2 / nr_pixels - (sum / nr_pixels) * (sum / nr_pixels);
+		stddev = sqrt(ABS(var));
+	}
+	else
+		stddev = 0.;
+}
+
+void updateMRCStackHeader(int fd, const FileName &fn_stack, long int nr_images,
+		RFLOAT minval, RFLOAT maxval, RFLOAT avg, RFLOAT stddev)
+{
+	typedef Image<float>::MRChead MRChead;
+	int nz = nr_images;
+	float stats[3] = {(float)minval, (float)maxval, (float)avg};
+	float rms = (float)stddev;
+	if (pwrite(fd, &nz, sizeof(int), offsetof(MRChead, nz)) != sizeof(int) ||
+		pwrite(fd, &nz, sizeof(int), offsetof(MRChead, mz)) != sizeof(int) ||
+		pwrite(fd, stats, 3*sizeof(float), offsetof(MRChead, amin)) != 3*sizeof(float) ||
+		pwrite(fd, &rms, sizeof(float), offsetof(MRChead, arms)) != sizeof(float))
+		REPORT_ERROR("updateMRCStackHeader ERROR: cannot write header of " + fn_stack);
+}
+
+void * globalThreadWriteImageStack(void *self)
+{
+	ImageStackWriter *writer = (ImageStackWriter*) self;
+	writer->writeBuffer();
+	return NULL;
+}
+
+void ImageStackWriter::openStack(const FileName &name, DataType _datatype, long int _nr_buffer_images, bool _do_background)
+{
+	if (fn_stack != "")
+		closeStack();
+
+	if (_datatype != Float && _datatype != Float16 && _datatype != UInt4)
+		REPORT_ERROR("ImageStackWriter::openStack ERROR: stacks can only be written as Float, Float16 or UInt4");
+	if (!name.contains(".mrcs"))
+		REPORT_ERROR("ImageStackWriter::openStack ERROR: stacks can only be written in MRC format, i.e. as .mrcs: " + name);
+
+	fn_stack = name;
+	datatype = _datatype;
+	nr_buffer_images = XMIPP_MAX(1, _nr_buffer_images);
+	do_background = _do_background;
+	nr_images = nr_in_buffer = 0;
+	first_image_in_buffer = 1;
+	current_buffer = 0;
+	write_error = 0;
+	is_writing = false;
+	pixel_stats.clear();
+	have_stats = false;
+}
+
+void ImageStackWriter::allocateBuffers()
+{
+	if ((fd = open(fn_stack.c_str(), O_WRONLY)) == -1)
+		REPORT_ERROR("ImageStackWriter ERROR: cannot open " + fn_stack);
+
+	for (int i = 0; i < ((do_background) ? 2 : 1); i++)
+		buffers[i] = (char *) askMemory(nr_buffer_images * one_img_size);
+}
+
+void ImageStackWriter::setStatistics(RFLOAT minval, RFLOAT maxval, RFLOAT avg, RFLOAT stddev)
+{
+	have_stats = true;
+	stats_min = minval;
+	stats_max = maxval;
+	stats_avg = avg;
+	stats_stddev = stddev;
+}
+
+void ImageStackWriter::writeBuffer()
+{
+	// pwrite may write fewer bytes than requested
+	size_t written = 0;
+	while (written < write_size)
+	{
+		ssize_t result = pwrite(fd, write_buffer + written, write_size - written, write_offset + written);
+		if (result <= 0)
+		{
+			write_error = 1;
+			return;
+		}
+		written += result;
+	}
+}
+
+void ImageStackWriter::waitForBackgroundWrite()
+{
+	if (is_writing)
+	{
+		pthread_join(write_thread, NULL);
+		is_writing = false;
+	}
+	if (write_error)
+		REPORT_ERROR("ImageStackWriter ERROR: cannot write to " + fn_stack);
+}
+
+void ImageStackWriter::flush()
+{
+	if (nr_in_buffer == 0)
+		return;
+
+	// Only one buffer is written at the same time
+	waitForBackgroundWrite();
+
+	write_buffer = buffers[current_buffer];
+	write_size = nr_in_buffer * one_img_size;
+	write_offset = MRCSIZE + first_image_in_buffer * one_img_size;
+	if (do_background)
+	{
+		if (pthread_create(&write_thread, NULL, globalThreadWriteImageStack, (void *)this) != 0)
+			REPORT_ERROR("ImageStackWriter::flush ERROR: cannot create thread to write " + fn_stack);
+		is_writing = true;
+		current_buffer = 1 - current_buffer;
+	}
+	else
+	{
+		writeBuffer();
+		if (write_error)
+			REPORT_ERROR("ImageStackWriter ERROR: cannot write to " + fn_stack);
+	}
+
+	first_image_in_buffer += nr_in_buffer;
+	nr_in_buffer = 0;
+}
+
+void ImageStackWriter::closeStack()
+{
+	// Release the file and the buffers before reporting any error, so that a failed close leaves no open stack behind
+	std::string error_msg = "";
+	if (nr_images > 0)
+	{
+		try
+		{
+			flush();
+			waitForBackgroundWrite();
+
+			// Only now set the number of images and the statistics in the header
+			if (!have_stats)
+				pixel_stats.getStatistics(stats_min, stats_max, stats_avg, stats_stddev);
+			updateMRCStackHeader(fd, fn_stack, nr_images, stats_min, stats_max, stats_avg, stats_stddev);
+		}
+		catch (RelionError XE)
+		{
+			error_msg = XE.msg;
+		}
+
+		if (is_writing)
+		{
+			pthread_join(write_thread, NULL);
+			is_writing = false;
+		}
+		if (close(fd) != 0 && error_msg == "")
+			error_msg = "ImageStackWriter::closeStack ERROR: cannot close " + fn_stack;
+
+		for (int i = 0; i < 2; i++)
+		{
+			if (buffers[i] != NULL)
+				freeMemory(buffers[i], nr_buffer_images * one_img_size);
+			buffers[i] = NULL;
+		}
+	}
+	fd = -1;
+	fn_stack = "";
+	nr_images = 0;
+
+	if (error_msg != "")
+		REPORT_ERROR(error_msg);
+}
+
 // Some image-specific operations
 void normalise(
 		Image<RFLOAT> &I,
@@ -81,7 +264,8 @@ void normalise(
 		bool is_helical_segment,
 		RFLOAT helical_mask_tube_outer_radius_pix,
 		RFLOAT tilt_deg,
-		RFLOAT psi_deg)
+		RFLOAT psi_deg,
+		unsigned int *dust_seed)
 {
 	RFLOAT avg, stddev;
 
@@ -105,9 +289,9 @@ void normalise(
 
 		// Remove white and black noise
 		if (white_dust_stddev > 0.)
-			removeDust(I, true, white_dust_stddev, avg, stddev);
+			removeDust(I, true, white_dust_stddev, avg, stddev, dust_seed);
 		if (black_dust_stddev > 0.)
-			removeDust(I, false, black_dust_stddev, avg, stddev);
+			removeDust(I, false, black_dust_stddev, avg, stddev, dust_seed);
 	}
 
 	if (do_ramp)
@@ -333,15 +517,13 @@ void subtractBackgroundRamp(
 }
 
 
-void removeDust(Image<RFLOAT> &I, bool is_white, RFLOAT thresh, RFLOAT avg, RFLOAT stddev)
+void removeDust(Image<RFLOAT> &I, bool is_white, RFLOAT thresh, RFLOAT avg, RFLOAT stddev, unsigned int *dust_seed)
 {
 	FOR_ALL_ELEMENTS_IN_ARRAY3D(I())
 	{
 		RFLOAT aux =  A3D_ELEM(I(), k, i, j);
-		if (is_white && aux - avg > thresh * stddev)
-			A3D_ELEM(I(), k, i, j) = rnd_gaus(avg, stddev);
-		else if (!is_white && aux - avg < -thresh * stddev)
-			A3D_ELEM(I(), k, i, j) = rnd_gaus(avg, stddev);
+		if ((is_white && aux - avg > thresh * stddev) || (!is_white && aux - avg < -thresh * stddev))
+			A3D_ELEM(I(), k, i, j) = (dust_seed != NULL) ? rnd_gaus_r(avg, stddev, *dust_seed) : rnd_gaus(avg, stddev);
 	}
 }
 
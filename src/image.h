@@ -52,8 +52,10 @@
 #include <typeinfo>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "src/funcs.h"
 #include "src/memory.h"
 #include "src/filename.h"
@@ -81,6 +83,8 @@ typedef enum
     Float = 8,              // Floating point (4-byte)
     Double = 9,             // Double precision floating point (8-byte)
     Bool = 10,              // Boolean (1-byte?)
+    Float16 = 11,           // Half precision floating point (2-byte, MRC mode 12)
+    UInt4 = 12,             // Unsigned 4-bit integers, packed two per byte (MRC mode 101)
     LastEntry = 15          // This must be the last entry
 } DataType;
 
@@ -106,6 +110,8 @@ public:
     FILE*     fhed;       // Image File header handler
     FileName  ext_name;   // Filename extension
     bool     exist;       // Shows if the file exists
+    char*    fmap;        // Read-only memory mapping of fimg (NULL if not mapped)
+    size_t   fmapSize;    // Size of the mapping
 
     /** Empty constructor
      */
@@ -113,6 +119,8 @@ public:
     {
         fimg=NULL;
         fhed=NULL;
+        fmap=NULL;
+        fmapSize=0;
         ext_name="";
         exist=false;
     }
@@ -124,7 +132,14 @@ public:
     	closeFile();
     }
 
-    void openFile(const FileName &name, int mode = WRITE_READONLY)
+    /** Open a file
+     *
+     * With do_mmap, a file opened as WRITE_READONLY is also mapped read-only and shared into memory.
+     * Images are then converted directly from the page cache, so that multiple processes reading
+     * the same stack share a single copy of it. Set is_sequential if the images will be read in order
+     * (this increases read-ahead). If the mapping fails, images are read with fread as usual.
+     */
+    void openFile(const FileName &name, int mode = WRITE_READONLY, bool do_mmap = false, bool is_sequential = false)
     {
 
     	// Close any file that was left open in this handler
@@ -190,6 +205,21 @@ public:
 		else
 			fhed = NULL;
 
+		if (do_mmap && mode == WRITE_READONLY)
+		{
+			struct stat file_stat;
+			if (fstat(fileno(fimg), &file_stat) == 0 && file_stat.st_size > 0)
+			{
+				void* map = mmap(0, file_stat.st_size, PROT_READ, MAP_SHARED, fileno(fimg), 0);
+				if (map != MAP_FAILED)
+				{
+					fmap = (char*) map;
+					fmapSize = file_stat.st_size;
+					madvise(fmap, fmapSize, (is_sequential) ? MADV_SEQUENTIAL : MADV_NORMAL);
+				}
+			}
+		}
+
 	}
 
     void closeFile()
@@ -197,6 +227,13 @@ public:
         ext_name="";
         exist=false;
 
+        if (fmap != NULL)
+        {
+            munmap(fmap, fmapSize);
+            fmap = NULL;
+            fmapSize = 0;
+        }
+
         // Check whether the file was closed already
     	if (fimg == NULL && fhed == NULL)
         	return;
@@ -215,6 +252,75 @@ public:
 
 };
 
+/** Thread-safe reader for the images in a single stack
+ *
+ * Many threads can read different images of the same stack through one handle
+ * (see Image::readFromStackReader). The header of an MRC stack is read only once
+ * and kept in the handle, after which the images are read with pread, which
+ * does not use (or move) the position in the file. Other formats, and the
+ * first image of an MRC stack, are read one at a time through the open file.
+ */
+class ImageStackReader
+{
+public:
+    fImageHandler   hFile;      // The open stack
+    FileName        fn_stack;   // Name of the open stack (empty if none)
+    pthread_mutex_t mutex;      // Serialises reads through hFile
+
+    // Header cache (only used for MRC stacks)
+    bool            have_header;
+    MetaDataTable   MDMainHeader;
+    long int        xdim, ydim, zdim, ndim;
+    DataType        datatype;
+    int             swap;
+    unsigned long   offset;
+
+    ImageStackReader()
+    {
+        pthread_mutex_init(&mutex, NULL);
+        fn_stack = "";
+        have_header = false;
+    }
+
+    ~ImageStackReader()
+    {
+        closeStack();
+        pthread_mutex_destroy(&mutex);
+    }
+
+    /** Open a stack (without the @ of an image number)
+     *
+     * This is not thread-safe: open the stack before the threads start reading from it.
+     */
+    void openStack(const FileName &name)
+    {
+        closeStack();
+        hFile.openFile(name, WRITE_READONLY);
+        fn_stack = name;
+    }
+
+    void closeStack()
+    {
+        if (fn_stack != "")
+            hFile.closeFile();
+        fn_stack = "";
+        have_header = false;
+        MDMainHeader.clear();
+    }
+
+    bool isOpen()
+    {
+        return (fn_stack != "");
+    }
+
+    /** Can images be read with pread from the cached header? */
+    bool isMRC()
+    {
+        return hFile.ext_name.contains("mrc");
+    }
+
+};
+
 /** Returns memory size of datatype
  */
 unsigned long gettypesize(DataType type);
@@ -252,6 +358,8 @@ private:
     bool                mmapOn;      // Mapping when loading from file
     int                 mFd;         // Handle the file in reading method and mmap
     size_t              mappedSize;  // Size of the mapped file
+    char*               fmap;        // Read-only mapping of fimg from its fImageHandler (NULL if not mapped)
+    size_t              fmapSize;    // Size of that mapping
 
 public:
     /** Empty constructor
@@ -265,6 +373,8 @@ public:
     Image()
     {
         mmapOn = false;
+        fmap = NULL;
+        fmapSize = 0;
         clear();
         MDMainHeader.addObject();
     }
@@ -281,6 +391,8 @@ public:
     Image(long int Xdim, long int Ydim, long int Zdim=1, long int Ndim=1)
     {
         mmapOn = false;
+        fmap = NULL;
+        fmapSize = 0;
         clear();
         data.resize(Ndim, Zdim, Ydim, Xdim);
         MDMainHeader.addObject();
@@ -381,30 +493,143 @@ public:
     	return err;
     }
 
+    /** Read one image (n@stack) from a stack that has been opened in an ImageStackReader
+     *
+     * This is thread-safe: many threads may read from the same reader at the same time.
+     * The header of an MRC stack is parsed only once, with the first image. It is not copied into the image
+     * for the subsequent images (their MDMainHeader is empty): use reader.MDMainHeader instead.
+     */
+    int readFromStackReader(const FileName &name, ImageStackReader &reader)
+    {
+        long int select_img;
+        FileName fn_stack;
+        name.decompose(select_img, fn_stack);
+        if (fn_stack != reader.fn_stack)
+            REPORT_ERROR("Image::readFromStackReader ERROR: " + name + " is not in the open stack " + reader.fn_stack);
+
+        pthread_mutex_lock(&reader.mutex);
+        if (!reader.have_header || !reader.isMRC() || select_img < 1)
+        {
+            // Read through the open file, and store the header of MRC stacks for all subsequent reads
+            int err;
+            try
+            {
+                err = readFromOpenFile(name, reader.hFile, -1);
+            }
+            catch (RelionError XE)
+            {
+                pthread_mutex_unlock(&reader.mutex);
+                throw XE;
+            }
+            if (err >= 0 && reader.isMRC() && select_img > 0 && !reader.have_header)
+            {
+                reader.MDMainHeader = MDMainHeader;
+                reader.xdim = XSIZE(data);
+                reader.ydim = YSIZE(data);
+                reader.zdim = ZSIZE(data);
+                reader.ndim = replaceNsize;
+                int dtype;
+                MDMainHeader.getValue(EMDL_IMAGE_DATATYPE, dtype);
+                reader.datatype = (DataType)dtype;
+                reader.swap = swap;
+                reader.offset = offset;
+                reader.have_header = true;
+            }
+            pthread_mutex_unlock(&reader.mutex);
+            return err;
+        }
+        pthread_mutex_unlock(&reader.mutex);
+
+        // Subtract 1 to have numbering 0...N-1 instead of 1...N
+        select_img--;
+        if (select_img >= reader.ndim)
+            REPORT_ERROR("Image::readFromStackReader ERROR: image number of " + name + " exceeds the stack size");
+
+        filename = name;
+        dataflag = 1;
+        if (!MDMainHeader.isEmpty())
+            MDMainHeader.clear();
+        swap = reader.swap;
+        offset = reader.offset;
+        replaceNsize = reader.ndim;
+        DataType datatype = reader.datatype;
+        data.setDimensions(reader.xdim, reader.ydim, reader.zdim, 1);
+        data.coreAllocateReuse();
+
+        // Without swapping or conversion, read straight into the image
+        size_t pagesize = getPageSizeInFile(datatype);
+        bool do_read_direct = (!swap && isDatatypeOfT(datatype));
+        char* page = (do_read_direct) ? (char *)MULTIDIM_ARRAY(data) : (char *) askMemory(pagesize*sizeof(char));
+
+        // pread may return fewer bytes than requested
+        int fd = fileno(reader.hFile.fimg);
+        off_t myoffset = offset + select_img * pagesize;
+        size_t haveread = 0;
+        int err = 0;
+        while (haveread < pagesize)
+        {
+            ssize_t result = pread(fd, page + haveread, pagesize - haveread, myoffset + haveread);
+            if (result <= 0)
+            {
+                err = -2;
+                break;
+            }
+            haveread += result;
+        }
+
+        if (err == 0 && !do_read_direct)
+        {
+            if (datatype == UInt4)
+                unpackPage4Bit2T(page, MULTIDIM_ARRAY(data), ZSIZE(data)*YSIZE(data));
+            else
+            {
+                if (canSwapInCast(datatype))
+                    castPage2T(page, MULTIDIM_ARRAY(data), datatype, ZYXSIZE(data), true);
+                else
+                {
+                    if (swap)
+                        swapPage(page, pagesize, datatype);
+                    castPage2T(page, MULTIDIM_ARRAY(data), datatype, ZYXSIZE(data));
+                }
+            }
+        }
+        if (!do_read_direct)
+            freeMemory(page, pagesize*sizeof(char));
+
+        return err;
+    }
+
     /** General write function
      * select_img= which slice should I replace
      * overwrite = 0, append slice
      * overwrite = 1 overwrite slice
+     * datatype = Float16 or UInt4 to write MRC files in mode 12 or 101
+     * (by default: Float, or the datatype of the existing stack when appending or replacing)
      */
     void write(FileName name="",
                long int select_img=-1,
                bool isStack=false,
-               int mode=WRITE_OVERWRITE)
+               int mode=WRITE_OVERWRITE,
+               DataType datatype=Unknown_Type)
     {
 
         const FileName &fname = (name == "") ? filename : name;
         fImageHandler hFile;
         hFile.openFile(name, mode);
-        _write(fname, hFile, select_img, isStack, mode);
+        _write(fname, hFile, select_img, isStack, mode, datatype);
         // the destructor of fImageHandler will close the file
 
     }
 
     /** Cast a page of data from type dataType to type Tdest
      *    input pointer  char *
+     *  With do_swap, the bytes of 1- and 2-byte datatypes are swapped while casting (see canSwapInCast)
      */
-    void castPage2T(char * page, T * ptrDest, DataType datatype, size_t pageSize )
+    void castPage2T(char * page, T * ptrDest, DataType datatype, size_t pageSize, bool do_swap = false )
     {
+        if (do_swap && gettypesize(datatype) > 2)
+            REPORT_ERROR("castPage2T BUG: only 1- and 2-byte datatypes can be swapped while casting");
+
         switch (datatype)
         {
         case Unknown_Type:
@@ -416,7 +641,7 @@ public:
                 else
                 {
                     unsigned char * ptr = (unsigned char *) page;
-                    for(int i=0; i<pageSize; i++)
+                    for(size_t i=0; i<pageSize; i++)
                         ptrDest[i]=(T) ptr[i];
                 }
                 break;
@@ -430,35 +655,47 @@ public:
                     else
                     {
                         signed char * ptr = (signed char *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptrDest[i]=(T) ptr[i];
                     }
                 break;
             }
         case UShort:
                 {
-                    if (typeid(T) == typeid(unsigned short))
+                    if (do_swap)
+                    {
+                        unsigned short * ptr = (unsigned short *) page;
+                        for(size_t i=0; i<pageSize; i++)
+                            ptrDest[i]=(T) (unsigned short)((ptr[i] >> 8) | (ptr[i] << 8));
+                    }
+                    else if (typeid(T) == typeid(unsigned short))
                 {
                     memcpy(ptrDest, page, pageSize*sizeof(T));
                     }
                     else
                     {
                         unsigned short * ptr = (unsigned short *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptrDest[i]=(T) ptr[i];
                     }
                 break;
             }
         case Short:
                 {
-                    if (typeid(T) == typeid(short))
+                    if (do_swap)
+                    {
+                        unsigned short * ptr = (unsigned short *) page;
+                        for(size_t i=0; i<pageSize; i++)
+                            ptrDest[i]=(T) (short)((ptr[i] >> 8) | (ptr[i] << 8));
+                    }
+                    else if (typeid(T) == typeid(short))
                 {
                     memcpy(ptrDest, page, pageSize*sizeof(T));
                     }
                     else
                     {
                         short * ptr = (short *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptrDest[i]=(T) ptr[i];
                     }
                 break;
@@ -472,7 +709,7 @@ public:
                     else
                     {
                         unsigned int * ptr = (unsigned int *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptrDest[i]=(T) ptr[i];
                     }
                 break;
@@ -486,7 +723,7 @@ public:
                     else
                     {
                         int * ptr = (int *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptrDest[i]=(T) ptr[i];
                     }
                 break;
@@ -500,7 +737,7 @@ public:
                     else
                     {
                         long * ptr = (long *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptrDest[i]=(T) ptr[i];
                     }
                 break;
@@ -514,7 +751,7 @@ public:
                     else
                     {
                         float * ptr = (float *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptrDest[i]=(T) ptr[i];
                     }
                 break;
@@ -528,11 +765,28 @@ public:
                     else
                     {
                         RFLOAT * ptr = (RFLOAT *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptrDest[i]=(T) ptr[i];
                     }
                 break;
             }
+        case Float16:
+                {
+                    // One table lookup per element
+                    const float * table = getHalfToFloatTable();
+                    unsigned short * ptr = (unsigned short *) page;
+                    if (do_swap)
+                    {
+                        for(size_t i=0; i<pageSize; i++)
+                            ptrDest[i]=(T) table[(unsigned short)((ptr[i] >> 8) | (ptr[i] << 8))];
+                    }
+                    else
+                    {
+                        for(size_t i=0; i<pageSize; i++)
+                            ptrDest[i]=(T) table[ptr[i]];
+                    }
+                break;
+            }
         default:
                 {
                     std::cerr<<"Datatype= "<<datatype<<std::endl;
@@ -558,7 +812,7 @@ public:
                 else
                 {
                     float * ptr = (float *) page;
-                    for(int i=0; i<pageSize; i++)
+                    for(size_t i=0; i<pageSize; i++)
                         ptr[i] = (float)srcPtr[i];
                 }
                 break;
@@ -572,11 +826,18 @@ public:
                     else
                     {
                         RFLOAT * ptr = (RFLOAT *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptr[i] = (RFLOAT)srcPtr[i];
                     }
                 break;
             }
+        case Float16:
+            {
+                unsigned short * ptr = (unsigned short *) page;
+                for(size_t i=0; i<pageSize; i++)
+                    ptr[i] = floatToHalf((float)srcPtr[i]);
+                break;
+            }
        case UShort:
                 {
                     if (typeid(T) == typeid(unsigned short))
@@ -586,7 +847,7 @@ public:
                     else
                     {
                         unsigned short * ptr = (unsigned short *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptr[i] = (unsigned short)srcPtr[i];
                     }
                 break;
@@ -600,7 +861,7 @@ public:
                     else
                     {
                         unsigned char * ptr = (unsigned char *) page;
-                        for(int i=0; i<pageSize; i++)
+                        for(size_t i=0; i<pageSize; i++)
                             ptr[i] = (unsigned char)srcPtr[i];
                     }
                 break;
@@ -613,6 +874,55 @@ public:
             }
     }
 
+    /** Number of bytes in the file for one image of datatype
+     *
+     * Rows of 4-bit data are padded to a whole number of bytes
+     */
+    size_t getPageSizeInFile(DataType datatype)
+    {
+        if (datatype == UInt4)
+            return ZSIZE(data) * YSIZE(data) * ((XSIZE(data) + 1) / 2);
+        else
+            return ZYXSIZE(data) * gettypesize(datatype);
+    }
+
+    /** Unpack a page of 4-bit data into nrows rows of XSIZE(data) elements T
+     *
+     * The first pixel of each pair is in the lower 4 bits of the byte.
+     */
+    void unpackPage4Bit2T(char * page, T * ptrDest, size_t nrows)
+    {
+        size_t xdim = XSIZE(data);
+        size_t bytes_per_row = (xdim + 1) / 2;
+        unsigned char * ptr = (unsigned char *) page;
+        for (size_t r = 0; r < nrows; r++, ptr += bytes_per_row, ptrDest += xdim)
+        {
+            for (size_t i = 0; i < xdim; i++)
+                ptrDest[i] = (T) ((i % 2 == 0) ? (ptr[i/2] & 0x0F) : (ptr[i/2] >> 4));
+        }
+    }
+
+    /** Pack nrows rows of XSIZE(data) elements T into a page of 4-bit data
+     *
+     * Values are rounded and clipped to the range [0, 15].
+     */
+    void packPageT24Bit(T * srcPtr, char * page, size_t nrows)
+    {
+        size_t xdim = XSIZE(data);
+        size_t bytes_per_row = (xdim + 1) / 2;
+        unsigned char * ptr = (unsigned char *) page;
+        memset(page, 0, nrows * bytes_per_row);
+        for (size_t r = 0; r < nrows; r++, ptr += bytes_per_row, srcPtr += xdim)
+        {
+            for (size_t i = 0; i < xdim; i++)
+            {
+                int val = ROUND((float)srcPtr[i]);
+                val = XMIPP_MIN(15, XMIPP_MAX(0, val));
+                ptr[i/2] |= (i % 2 == 0) ? val : (val << 4);
+            }
+        }
+    }
+
     /** Check file Datatype is same as T type to use mmap.
      */
     bool checkMmapT(DataType datatype)
@@ -685,6 +995,9 @@ public:
                 else
                     return 0;
             }
+        case Float16:
+        case UInt4:
+            return 0;
         default:
             {
                 std::cerr<<"Datatype= "<<datatype<<std::endl;
@@ -709,10 +1022,20 @@ public:
         freeMemory(fdata, datasize);
     }
 
+    /** Can castPage2T swap the bytes of datatype while casting?
+     *  This saves a separate pass over the page for the 1- and 2-byte datatypes
+     */
+    bool canSwapInCast(DataType datatype)
+    {
+        return (swap == 1 && (datatype == UChar || datatype == SChar ||
+                              datatype == UShort || datatype == Short || datatype == Float16));
+    }
+
     /** Swap an entire page
       * input pointer char *
+      * If src is given, the swapped bytes of src are copied into page
       */
-    void swapPage(char * page, size_t pageNrElements, DataType datatype)
+    void swapPage(char * page, size_t pageNrElements, DataType datatype, const char * src = NULL)
     {
         unsigned long datatypesize = gettypesize(datatype);
 #ifdef DEBUG
@@ -727,14 +1050,40 @@ public:
 
         // Swap bytes if required
         if ( swap == 1 )
-        {
-            for ( unsigned long i=0; i<pageNrElements; i+=datatypesize )
-                swapbytes(page+i, datatypesize);
-        }
+            swapbytesArray(page, pageNrElements/datatypesize, datatypesize, src);
         else if ( swap > 1 )
+            swapbytesArray(page, pageNrElements/swap, swap, src);
+        else if ( src != NULL )
+            memcpy(page, src, pageNrElements);
+    }
+
+    /** Is the datatype in the file the same as T?
+     *  Then the data can be read directly into the image without conversion
+     */
+    bool isDatatypeOfT(DataType datatype)
+    {
+        switch (datatype)
         {
-            for ( unsigned long i=0; i<pageNrElements; i+=swap )
-                swapbytes(page+i, swap);
+        case UChar:
+            return typeid(T) == typeid(unsigned char);
+        case SChar:
+            return typeid(T) == typeid(signed char);
+        case UShort:
+            return typeid(T) == typeid(unsigned short);
+        case Short:
+            return typeid(T) == typeid(short);
+        case UInt:
+            return typeid(T) == typeid(unsigned int);
+        case Int:
+            return typeid(T) == typeid(int);
+        case Long:
+            return typeid(T) == typeid(long);
+        case Float:
+            return typeid(T) == typeid(float);
+        case Double:
+            return typeid(T) == typeid(RFLOAT);
+        default:
+            return false;
         }
     }
 
@@ -753,7 +1102,7 @@ public:
 
         size_t myoffset, readsize, readsize_n, pagemax = 1073741824; //1Gb
         size_t datatypesize=gettypesize(datatype);
-        size_t pagesize  =ZYXSIZE(data)*datatypesize;
+        size_t pagesize  =getPageSizeInFile(datatype);
         size_t haveread_n=0;
 
         //Multidimarray mmapOn is priority over image mmapOn
@@ -789,6 +1138,48 @@ public:
                 REPORT_ERROR("Image Class::ReadData: mmap of image file failed.");
             data.data = reinterpret_cast<T*> (map+offset);
         }
+        else if (fmap != NULL)
+        {
+            // The file was mapped read-only by its fImageHandler: convert directly from the page cache
+            if ( select_img < 0 )
+                select_img = 0;
+
+            data.coreAllocateReuse();
+            myoffset = offset + select_img*(pagesize + pad);
+            size_t mysize = NSIZE(data)*(pagesize + pad) - pad;
+            if (myoffset + mysize > fmapSize)
+                return -2;
+
+            // Start reading the pages of these images from disc
+            size_t syspagesize = sysconf(_SC_PAGESIZE);
+            size_t mapstart = (myoffset / syspagesize) * syspagesize;
+            madvise(fmap + mapstart, myoffset + mysize - mapstart, MADV_WILLNEED);
+
+            // Swapping cannot be done in the read-only mapping: copy to a page first,
+            // unless the bytes are swapped while casting
+            bool do_swap_in_cast = canSwapInCast(datatype);
+            char* page = NULL;
+            if (swap && !do_swap_in_cast)
+                page = (char *) askMemory(pagesize*sizeof(char));
+
+            for ( size_t myn=0; myn<NSIZE(data); myn++ )
+            {
+                char* src = fmap + myoffset + myn*(pagesize + pad);
+                if (swap && !do_swap_in_cast)
+                {
+                    // Copy and swap in a single pass
+                    swapPage(page, pagesize, datatype, src);
+                    src = page;
+                }
+                if (datatype == UInt4)
+                    unpackPage4Bit2T(src, MULTIDIM_ARRAY(data) + myn*ZYXSIZE(data), ZSIZE(data)*YSIZE(data));
+                else
+                    castPage2T(src, MULTIDIM_ARRAY(data) + myn*ZYXSIZE(data), datatype, ZYXSIZE(data), do_swap_in_cast);
+            }
+
+            if (page != NULL)
+                freeMemory(page, pagesize*sizeof(char));
+        }
         else
         {
             // Reset select to get the correct offset
@@ -811,7 +1202,16 @@ public:
             printf("DEBUG: myoffset = %d select_img= %d \n", myoffset, select_img);
 #endif
 
-            if (pagesize > pagemax)
+            // 4-bit data are unpacked per whole image
+            if (datatype == UInt4 && pagesize > pagemax)
+                REPORT_ERROR("Image Class::ReadData: 4-bit images larger than 1Gb are not supported.");
+
+            // Without swapping or conversion, read straight into the image
+            bool do_read_direct = (!swap && isDatatypeOfT(datatype));
+
+            if (do_read_direct)
+                page = NULL;
+            else if (pagesize > pagemax)
                 page = (char *) askMemory(pagemax*sizeof(char));
             else
                 page = (char *) askMemory(pagesize*sizeof(char));
@@ -828,18 +1228,42 @@ public:
                     readsize = pagesize - myj;
                     if ( readsize > pagemax )
                         readsize = pagemax;
-                    readsize_n = readsize/datatypesize;
+
+                    if (do_read_direct)
+                    {
+                        if (fread( (char *)(MULTIDIM_ARRAY(data) + haveread_n), readsize, 1, fimg ) != 1)
+                            return -2;
+                        haveread_n += readsize/datatypesize;
+                        continue;
+                    }
 
                     //Read page from disc
                     size_t result = fread( page, readsize, 1, fimg );
                     if (result != 1)
                     	return -2;
 
-                    //swap per page
-                    if (swap)
-                        swapPage(page, readsize, datatype);
-                    // cast to T per page
-                    castPage2T(page, MULTIDIM_ARRAY(data) + haveread_n, datatype, readsize_n);
+                    if (datatype == UInt4)
+                    {
+                        readsize_n = ZYXSIZE(data);
+                        unpackPage4Bit2T(page, MULTIDIM_ARRAY(data) + haveread_n, ZSIZE(data)*YSIZE(data));
+                    }
+                    else
+                    {
+                        readsize_n = readsize/datatypesize;
+                        if (canSwapInCast(datatype))
+                        {
+                            // swap and cast to T in a single pass
+                            castPage2T(page, MULTIDIM_ARRAY(data) + haveread_n, datatype, readsize_n, true);
+                        }
+                        else
+                        {
+                            //swap per page
+                            if (swap)
+                                swapPage(page, readsize, datatype);
+                            // cast to T per page
+                            castPage2T(page, MULTIDIM_ARRAY(data) + haveread_n, datatype, readsize_n);
+                        }
+                    }
                     haveread_n += readsize_n;
                 }
                 if ( pad > 0 )
@@ -852,7 +1276,7 @@ public:
             }
             //if ( pad > 0 )
             //    freeMemory(padpage, pad*sizeof(char));
-            if ( page > 0 )
+            if ( page != NULL )
                 freeMemory(page, pagesize*sizeof(char));
 
 #ifdef DEBUG
@@ -1089,6 +1513,12 @@ public:
         case Bool:
             o << "Boolean (1-byte?)";
             break;
+        case Float16:
+            o << "Half precision floating point (2-byte)";
+            break;
+        case UInt4:
+            o << "Unsigned 4-bit integer (two per byte)";
+            break;
         }
         o << std::endl;
 
@@ -1226,6 +1656,8 @@ private:
         FileName ext_name = hFile.ext_name;
         fimg = hFile.fimg;
         fhed = hFile.fhed;
+        fmap = hFile.fmap;
+        fmapSize = hFile.fmapSize;
 
         long int dump;
         name.decompose(dump, filename);
@@ -1275,7 +1707,7 @@ private:
 
 
     void _write(const FileName &name, fImageHandler &hFile, long int select_img=-1,
-                bool isStack=false, int mode=WRITE_OVERWRITE)
+                bool isStack=false, int mode=WRITE_OVERWRITE, DataType datatype=Unknown_Type)
     {
         int err = 0;
 
@@ -1361,6 +1793,15 @@ private:
             if(auxI.replaceNsize <1 &&
                (mode==WRITE_REPLACE || mode==WRITE_APPEND))
                 REPORT_ERROR("write: output file is not an stack");
+            // Keep the datatype of the existing stack
+            int _datatype;
+            if (auxI.MDMainHeader.getValue(EMDL_IMAGE_DATATYPE, _datatype))
+            {
+                if (datatype == Unknown_Type)
+                    datatype = (DataType)_datatype;
+                else if (datatype != (DataType)_datatype)
+                    REPORT_ERROR("write: target and source objects have different datatypes");
+            }
         }
         else if(!_exists && mode==WRITE_APPEND)
         {
@@ -1379,9 +1820,9 @@ private:
            ext_name.contains("stk") || ext_name.contains("vol"))
             err = writeSPIDER(select_img,isStack,mode);
         else if (ext_name.contains("mrcs"))
-            writeMRC(select_img,true,mode);
+            writeMRC(select_img,true,mode,datatype);
         else if (ext_name.contains("mrc"))
-            writeMRC(select_img,false,mode);
+            writeMRC(select_img,false,mode,datatype);
         else if (ext_name.contains("img") || ext_name.contains("hed"))
             writeIMAGIC(select_img,mode);
         else
@@ -1401,6 +1842,202 @@ private:
 
 };
 
+/** Minimum, maximum, average and stddev over all pixels of a stack that is written image by image
+ *
+ * Statistics of parts of the stack (e.g. those written by different threads) can be combined with addStatistics.
+ */
+class ImageStackStatistics
+{
+public:
+    long int nr_pixels;
+    double   sum, sum2;
+    RFLOAT   minval, maxval;
+
+    ImageStackStatistics()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        nr_pixels = 0;
+        sum = sum2 = 0.;
+        minval = LARGE_NUMBER;
+        maxval = -LARGE_NUMBER;
+    }
+
+    template <typename T>
+    void addImage(const MultidimArray<T> &img)
+    {
+        double mysum = 0., mysum2 = 0.;
+        RFLOAT mymin = LARGE_NUMBER, mymax = -LARGE_NUMBER;
+        FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img)
+        {
+            RFLOAT val = (RFLOAT)DIRECT_MULTIDIM_ELEM(img, n);
+            mysum += val;
+            mysum2 += val * val;
+            mymin = XMIPP_MIN(mymin, val);
+            mymax = XMIPP_MAX(mymax, val);
+        }
+        nr_pixels += NZYXSIZE(img);
+        sum += mysum;
+        sum2 += mysum2;
+        minval = XMIPP_MIN(minval, mymin);
+        maxval = XMIPP_MAX(maxval, mymax);
+    }
+
+    void addStatistics(const ImageStackStatistics &other)
+    {
+        nr_pixels += other.nr_pixels;
+        sum += other.sum;
+        sum2 += other.sum2;
+        minval = XMIPP_MIN(minval, other.minval);
+        maxval = XMIPP_MAX(maxval, other.maxval);
+    }
+
+    /** The stddev is calculated as in MultidimArray::computeStats, which gives the statistics
+     *  that Image::write puts in the header of a whole stack
+     */
+    void getStatistics(RFLOAT &_minval, RFLOAT &_maxval, RFLOAT &avg, RFLOAT &stddev) const;
+};
+
+/** Set the number of images (nz and mz) and the statistics in the header of an MRC stack
+ *
+ * For stacks of which the header was written with the first image and all other images were added behind it.
+ * fd is a file descriptor of fn_stack that is open for writing.
+ */
+void updateMRCStackHeader(int fd, const FileName &fn_stack, long int nr_images,
+		RFLOAT minval, RFLOAT maxval, RFLOAT avg, RFLOAT stddev);
+
+/** Writer of a stack of 2D images in MRC format
+ *
+ * The images are collected in a buffer of nr_buffer_images images, which is written to disc
+ * with a single large write once it is full. The header of the stack is written with the first
+ * image; its number of images and statistics are only updated when the stack is closed. The
+ * statistics are those of all written images, unless they are set with setStatistics. With do_background, a full buffer is written by a background thread while the next
+ * images are collected in a second buffer.
+ */
+class ImageStackWriter
+{
+public:
+    FileName  fn_stack;          // The open stack (empty if none)
+    DataType  datatype;          // Float, Float16 or UInt4
+    int       fd;                // File descriptor of the open stack
+    long int  nr_images;         // Number of images written so far (including the buffered ones)
+    long int  nr_buffer_images;  // Size of the buffer in images
+    size_t    one_img_size;      // Size of one image in the file (in bytes)
+    bool      do_background;     // Write full buffers in a background thread
+
+    // Two buffers: one is being filled while the other may be written in the background
+    char*     buffers[2];
+    int       current_buffer;
+    long int  nr_in_buffer, first_image_in_buffer;
+
+    // The write that is (or was last) done by the background thread
+    pthread_t write_thread;
+    bool      is_writing;
+    char*     write_buffer;
+    size_t    write_size;
+    off_t     write_offset;
+    int       write_error;
+
+    // Statistics for the header: those of all written images, or those set with setStatistics
+    ImageStackStatistics pixel_stats;
+    bool      have_stats;
+    RFLOAT    stats_min, stats_max, stats_avg, stats_stddev;
+
+    ImageStackWriter()
+    {
+        fn_stack = "";
+        fd = -1;
+        buffers[0] = buffers[1] = NULL;
+        is_writing = false;
+    }
+
+    /** Callers should close the stack with closeStack(), which reports errors.
+     *  A stack that is still open is closed here, but errors can only be printed.
+     */
+    ~ImageStackWriter()
+    {
+        if (fn_stack != "")
+        {
+            FileName fn_open_stack = fn_stack;
+            try
+            {
+                closeStack();
+            }
+            catch (RelionError XE)
+            {
+                std::cerr << XE << std::endl << "ImageStackWriter: error in closing " << fn_open_stack << std::endl;
+            }
+        }
+    }
+
+    /** Start a new stack (it is written when the first image comes in)
+     */
+    void openStack(const FileName &name, DataType datatype = Float, long int nr_buffer_images = 64, bool do_background = false);
+
+    /** Add an image to the end of the stack
+     */
+    template <typename T>
+    void writeImage(Image<T> &img)
+    {
+        if (fn_stack == "")
+            REPORT_ERROR("ImageStackWriter::writeImage ERROR: no stack has been opened");
+        if (NSIZE(img()) != 1 || ZSIZE(img()) != 1)
+            REPORT_ERROR("ImageStackWriter::writeImage ERROR: only single 2D images can be written to " + fn_stack);
+
+        if (nr_images == 0)
+        {
+            // The first image also writes the header
+            img.write(fn_stack, -1, true, WRITE_OVERWRITE, datatype);
+            one_img_size = img.getPageSizeInFile(datatype);
+            allocateBuffers();
+        }
+        else
+        {
+            if (img.getPageSizeInFile(datatype) != one_img_size)
+                REPORT_ERROR("ImageStackWriter::writeImage ERROR: image has a different size than the first image in " + fn_stack);
+            char* dest = buffers[current_buffer] + nr_in_buffer * one_img_size;
+            if (datatype == UInt4)
+                img.packPageT24Bit(MULTIDIM_ARRAY(img()), dest, YSIZE(img()));
+            else
+                img.castPage2Datatype(MULTIDIM_ARRAY(img()), dest, datatype, ZYXSIZE(img()));
+            nr_in_buffer++;
+            if (nr_in_buffer == nr_buffer_images)
+                flush();
+        }
+        if (!have_stats)
+            pixel_stats.addImage(img());
+        nr_images++;
+    }
+
+    /** Set the minimum, maximum, average and stddev that will be written in the header upon closing
+     */
+    void setStatistics(RFLOAT minval, RFLOAT maxval, RFLOAT avg, RFLOAT stddev);
+
+    /** Write the remaining images, update the header and close the stack
+     */
+    void closeStack();
+
+    /** Write the buffered images (in the background if do_background)
+     */
+    void flush();
+
+    /** Write write_size bytes from write_buffer at write_offset (sets write_error)
+     */
+    void writeBuffer();
+
+private:
+    void allocateBuffers();
+    void waitForBackgroundWrite();
+
+    // Not copyable: a writer owns its file descriptor, buffers and background thread (not implemented)
+    ImageStackWriter(const ImageStackWriter &op);
+    ImageStackWriter& operator=(const ImageStackWriter &op);
+
+};
+
 // Some image-specific operations
 
 // For image normalisation
@@ -1413,7 +2050,8 @@ void normalise(
 		bool is_helical_segment = false,
 		RFLOAT helical_mask_tube_outer_radius_pix = -1.,
 		RFLOAT tilt_deg = 0.,
-		RFLOAT psi_deg = 0.);
+		RFLOAT psi_deg = 0.,
+		unsigned int *dust_seed = NULL);
 void calculateBackgroundAvgStddev(
 		Image<RFLOAT> &I,
 		RFLOAT &avg,
@@ -1434,7 +2072,8 @@ void subtractBackgroundRamp(
 
 
 // For dust removal
-void removeDust(Image<RFLOAT> &I, bool is_white, RFLOAT thresh, RFLOAT avg, RFLOAT stddev);
+// The noise is drawn from the global random generator, or with rnd_gaus_r from dust_seed if that is given
+void removeDust(Image<RFLOAT> &I, bool is_white, RFLOAT thresh, RFLOAT avg, RFLOAT stddev, unsigned int *dust_seed = NULL);
 
 // for contrast inversion
 void invert_contrast(Image<RFLOAT> &I);
@@ -42,6 +42,9 @@
 //Some global threads management variables
 static pthread_mutex_t global_mutex2[NR_CLASS_MUTEXES] = { PTHREAD_MUTEX_INITIALIZER };
 static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
+// For the background reading of the pooled images
+static pthread_mutex_t exp_imgs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t exp_imgs_cond = PTHREAD_COND_INITIALIZER;
 Barrier * global_barrier;
 ThreadManager * global_ThreadManager;
 
@@ -59,6 +62,13 @@ void globalThreadExpectationSomeParticles(ThreadArgument &thArg)
 		MLO->doThreadExpectationSomeParticles(thArg.thread_id);
 }
 
+void * globalThreadReadImagesSomeParticles(void *self)
+{
+	MlOptimiser *MLO = (MlOptimiser*) self;
+	MLO->readImagesSomeParticles();
+	return NULL;
+}
+
 
 /** ========================== I/O operations  =========================== */
 
@@ -78,6 +88,7 @@ void MlOptimiser::read(int argc, char **argv, int rank)
 	{
 		// Do this before reading in the data.star file below!
 		do_preread_images   = checkParameter(argc, argv, "--preread_images");
+		do_preread_float16  = checkParameter(argc, argv, "--preread_float16");
 		do_parallel_disc_io = !checkParameter(argc, argv, "--no_parallel_disc_io");
 
 		parser.addSection("Continue options");
@@ -278,6 +289,9 @@ void MlOptimiser::parseContinue(int argc, char **argv)
 	combine_weights_thru_disc = !parser.checkOption("--dont_combine_weights_via_disc", "Send the large arrays of summed weights through the MPI network, instead of writing large files to disc");
 	do_shifts_onthefly = parser.checkOption("--onthefly_shifts", "Calculate shifted images on-the-fly, do not store precalculated ones in memory");
 	do_preread_images  = parser.checkOption("--preread_images", "Use this to let the master process read all particles into memory. Be careful you have enough RAM for large data sets!");
+	do_preread_float16 = parser.checkOption("--preread_float16", "Store pre-read particles in RAM as 16-bit floats (half the memory, ~3 significant digits precision)");
+	if (do_preread_float16 && !do_preread_images)
+		REPORT_ERROR("ERROR: --preread_float16 only works in combination with --preread_images");
 	fn_scratch = parser.getOption("--scratch_dir", "If provided, particle stacks will be copied to this local scratch disk prior to refinement.", "");
 	keep_free_scratch_Gb = textToInteger(parser.getOption("--keep_free_scratch", "Space available for copying particle stacks (in Gb)", "10"));
 	do_reuse_scratch = parser.checkOption("--reuse_scratch", "Re-use data on scratchdir, instead of wiping it and re-copying all data.");
@@ -480,6 +494,9 @@ void MlOptimiser::parseInitial(int argc, char **argv)
 	do_shifts_onthefly = parser.checkOption("--onthefly_shifts", "Calculate shifted images on-the-fly, do not store precalculated ones in memory");
 	do_parallel_disc_io = !parser.checkOption("--no_parallel_disc_io", "Do NOT let parallel (MPI) processes access the disc simultaneously (use this option with NFS)");
 	do_preread_images  = parser.checkOption("--preread_images", "Use this to let the master process read all particles into memory. Be careful you have enough RAM for large data sets!");
+	do_preread_float16 = parser.checkOption("--preread_float16", "Store pre-read particles in RAM as 16-bit floats (half the memory, ~3 significant digits precision)");
+	if (do_preread_float16 && !do_preread_images)
+		REPORT_ERROR("ERROR: --preread_float16 only works in combination with --preread_images");
 	fn_scratch = parser.getOption("--scratch_dir", "If provided, particle stacks will be copied to this local scratch disk prior to refinement.", "");
 	keep_free_scratch_Gb = textToInteger(parser.getOption("--keep_free_scratch", "Space available for copying particle stacks (in Gb)", "10"));
 	do_reuse_scratch = parser.checkOption("--reuse_scratch", "Re-use data on scratchdir, instead of wiping it and re-copying all data.");
@@ -704,7 +721,7 @@ void MlOptimiser::read(FileName fn_in, int rank)
 #endif
     bool do_preread = (do_preread_images) ? (do_parallel_disc_io || rank == 0) : false;
     bool is_helical_segment = (do_helical_refine) || ((mymodel.ref_dim == 2) && (helical_tube_outer_diameter > 0.));
-    mydata.read(fn_data, false, false, do_preread, is_helical_segment);
+    mydata.read(fn_data, false, false, do_preread, is_helical_segment, do_preread_float16);
 
 #ifdef DEBUG_READ
     std::cerr<<"MlOptimiser::readStar before model."<<std::endl;
@@ -1156,7 +1173,7 @@ void MlOptimiser::initialiseGeneral(int rank)
 		if (do_realign_movies)
 			do_preread = false; // as we will overwrite mydata.read with the movies anyway....
 		bool is_helical_segment = (do_helical_refine) || ((mymodel.ref_dim == 2) && (helical_tube_outer_diameter > 0.));
-		mydata.read(fn_data, true, false, do_preread, is_helical_segment); // true means ignore original particle name
+		mydata.read(fn_data, true, false, do_preread, is_helical_segment, do_preread_float16); // true means ignore original particle name
 
 		if (fn_body_masks != "")
 		{
@@ -1235,7 +1252,7 @@ void MlOptimiser::initialiseGeneral(int rank)
 		if (verb > 0)
 			std::cout << " Reading in pre-expanded data model for movie frames... " << std::endl;
 
-		mydata.read(fn_data_movie, false, false, do_preread_images);
+		mydata.read(fn_data_movie, false, false, do_preread_images, false, do_preread_float16);
 
 		// The group numbering might be different: re-assign groups based on group_names
 		mymodel.reassignGroupsForMovies(mydata, movie_identifier);
@@ -1518,7 +1535,7 @@ void MlOptimiser::initialiseWorkLoad()
     {
     	mydata.prepareScratchDirectory(fn_scratch);
     	bool also_do_ctfimage = (mymodel.data_dim == 3 && do_ctf_correction);
-    	mydata.copyParticlesToScratch(1, true, also_do_ctfimage, keep_free_scratch_Gb);
+    	mydata.copyParticlesToScratch(1, true, also_do_ctfimage, keep_free_scratch_Gb, nr_threads);
     }
 
 }
@@ -1589,11 +1606,7 @@ void MlOptimiser::calculateSumOfPowerSpectraAndAverageImage(MultidimArray<RFLOAT
             Image<RFLOAT> img;
 			if (do_preread_images && do_parallel_disc_io)
             {
-                img().reshape(mydata.particles[part_id].img);
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mydata.particles[part_id].img)
-				{
-                	DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(mydata.particles[part_id].img, n);
-				}
+                mydata.particles[part_id].getPrereadImage(img());
             }
             else
             {
@@ -2478,15 +2491,18 @@ void MlOptimiser::expectationSomeParticles(long int my_first_ori_particle, long
     	}
 	}
 
-	// Only open/close stacks once
-    fImageHandler hFile;
-	long int dump;
-	FileName fn_img, fn_stack, fn_open_stack="";
+	FileName fn_img;
+	std::istringstream split_fn_img(exp_fn_img);
+
+	// Open the stack with all particles on the scratch disk only once
+	if (mymodel.data_dim != 3 && mydata.nr_parts_on_scratch > 0 && !scratch_reader.isOpen())
+		scratch_reader.openStack(mydata.fn_scratch + "particles.mrcs");
 
 	// Store total number of particle images in this bunch of SomeParticles, and set translations and orientations for skip_align/rotate
     exp_nr_images = 0;
-    long int istop = 0;
+    long int istop = 0, nr_imgs_to_read = 0;
     exp_imgs.clear();
+    exp_fn_imgs_to_read.clear();
     for (long int ori_part_id = my_first_ori_particle; ori_part_id <= my_last_ori_particle; ori_part_id++)
 	{
 
@@ -2538,36 +2554,26 @@ void MlOptimiser::expectationSomeParticles(long int my_first_ori_particle, long
 		exp_nr_images += mydata.ori_particles[ori_part_id].particles_id.size();
 
 		// Sjors 7 March 2016 to prevent too high disk access... Read in all pooled images simultaneously
-		// TODO: open and close stacks only once!
 		// Don't do this for sub-tomograms to save RAM!
 		if (do_parallel_disc_io && !do_preread_images && mymodel.data_dim != 3)
 		{
-			// Read in all images, only open/close common stacks once
+			// Only get the filenames here: the images are read by a background thread (see below)
 			for (int ipart = 0; ipart < mydata.ori_particles[ori_part_id].particles_id.size(); ipart++, istop++)
 			{
 
 				long int part_id = mydata.ori_particles[ori_part_id].particles_id[ipart];
 
-				// Read from disc
-				// Get the filename
+				// Get the filename (the lines in exp_fn_img are in the same order as the images)
+				FileName fn_line;
+				getline(split_fn_img, fn_line);
 				if (!mydata.getImageNameOnScratch(part_id, fn_img))
-				{
-					std::istringstream split(exp_fn_img);
-					for (int i = 0; i <= istop; i++)
-						getline(split, fn_img);
-				}
-
-				// Only open again a new stackname
-				fn_img.decompose(dump, fn_stack);
-				if (fn_stack != fn_open_stack)
-				{
-					hFile.openFile(fn_stack, WRITE_READONLY);
-					fn_open_stack = fn_stack;
-				}
-			    Image<RFLOAT> img;
-				img.readFromOpenFile(fn_img, hFile, -1, false);
-				img().setXmippOrigin();
-				exp_imgs.push_back(img());
+					exp_fn_imgs_to_read.push_back(fn_line);
+				else if (scratch_reader.isOpen())
+					exp_fn_imgs_to_read.push_back(""); // read by the expectation threads themselves
+				else
+					exp_fn_imgs_to_read.push_back(fn_img);
+				if (exp_fn_imgs_to_read.back() != "")
+					nr_imgs_to_read++;
 
 			} // end loop over all particles of this ori_particle
 
@@ -2581,10 +2587,30 @@ void MlOptimiser::expectationSomeParticles(long int my_first_ori_particle, long
 	std::cerr << " exp_nr_images= " << exp_nr_images << std::endl;
 #endif
 
+	// Read the images in one background thread (which opens each stack only once),
+	// while the expectation threads already start on the images that have been read
+	pthread_t read_thread;
+	bool do_read_in_background = (nr_imgs_to_read > 0);
+	exp_nr_imgs_read = 0;
+	exp_imgs_read_error = "";
+	exp_imgs.resize(exp_fn_imgs_to_read.size());
+	if (do_read_in_background)
+	{
+		if (pthread_create(&read_thread, NULL, globalThreadReadImagesSomeParticles, (void *)this) != 0)
+			REPORT_ERROR("MlOptimiser::expectationSomeParticles ERROR: cannot create thread to read the images");
+	}
+
 	exp_ipart_ThreadTaskDistributor->resize(my_last_ori_particle - my_first_ori_particle + 1, 1);
 	exp_ipart_ThreadTaskDistributor->reset();
     global_ThreadManager->run(globalThreadExpectationSomeParticles);
 
+    if (do_read_in_background)
+    {
+    	pthread_join(read_thread, NULL);
+    	if (exp_imgs_read_error != "")
+    		REPORT_ERROR("MlOptimiser::expectationSomeParticles ERROR: in the thread that reads the particle images: " + exp_imgs_read_error);
+    }
+
 #ifdef TIMING
     timer.toc(TIMING_ESP);
 #endif
@@ -2593,6 +2619,64 @@ void MlOptimiser::expectationSomeParticles(long int my_first_ori_particle, long
 }
 
 
+void MlOptimiser::readImagesSomeParticles()
+{
+	// Only open/close stacks once
+	fImageHandler hFile;
+	long int dump;
+	FileName fn_stack, fn_open_stack="";
+
+	try
+	{
+		for (size_t i = 0; i < exp_fn_imgs_to_read.size(); i++)
+		{
+			// Images without a name are read from the scratch stack by the expectation threads
+			if (exp_fn_imgs_to_read[i] != "")
+			{
+				// Only open again a new stackname
+				exp_fn_imgs_to_read[i].decompose(dump, fn_stack);
+				if (fn_stack != fn_open_stack)
+				{
+					hFile.openFile(fn_stack, WRITE_READONLY);
+					fn_open_stack = fn_stack;
+				}
+				Image<RFLOAT> img;
+				img.readFromOpenFile(exp_fn_imgs_to_read[i], hFile, -1, false);
+				img().setXmippOrigin();
+				exp_imgs[i] = img();
+			}
+
+			pthread_mutex_lock(&exp_imgs_mutex);
+			exp_nr_imgs_read = i + 1;
+			pthread_cond_broadcast(&exp_imgs_cond);
+			pthread_mutex_unlock(&exp_imgs_mutex);
+		}
+	}
+	catch (RelionError XE)
+	{
+		// The expectation threads would otherwise wait forever for this image: let them finish on empty images,
+		// and leave it to expectationSomeParticles to report the error once they are done
+		pthread_mutex_lock(&exp_imgs_mutex);
+		exp_imgs_read_error = XE.msg;
+		for (size_t i = exp_nr_imgs_read; i < exp_imgs.size(); i++)
+		{
+			exp_imgs[i].initZeros(mymodel.ori_size, mymodel.ori_size);
+			exp_imgs[i].setXmippOrigin();
+		}
+		exp_nr_imgs_read = exp_imgs.size();
+		pthread_cond_broadcast(&exp_imgs_cond);
+		pthread_mutex_unlock(&exp_imgs_mutex);
+	}
+}
+
+void MlOptimiser::waitForImageSomeParticles(long int istop)
+{
+	pthread_mutex_lock(&exp_imgs_mutex);
+	while (exp_nr_imgs_read <= istop)
+		pthread_cond_wait(&exp_imgs_cond, &exp_imgs_mutex);
+	pthread_mutex_unlock(&exp_imgs_mutex);
+}
+
 void MlOptimiser::doThreadExpectationSomeParticles(int thread_id)
 {
 
@@ -2715,7 +2799,9 @@ void MlOptimiser::expectationOneParticle(long int my_ori_particle, int thread_id
 		MultidimArray<RFLOAT> exp_Mweight;
 		MultidimArray<bool> exp_Mcoarse_significant;
 		// And from storeWeightedSums
-		std::vector<RFLOAT> exp_sum_weight, exp_significant_weight, exp_max_weight;
+		// Sums of weights over all orientations and translations are always kept in double-precision
+		std::vector<double> exp_sum_weight;
+		std::vector<RFLOAT> exp_significant_weight, exp_max_weight;
 		std::vector<Matrix1D<RFLOAT> > exp_old_offset, exp_prior;
 		std::vector<RFLOAT> exp_wsum_norm_correction;
 		std::vector<MultidimArray<RFLOAT> > exp_wsum_scale_correction_XA, exp_wsum_scale_correction_AA, exp_power_imgs;
@@ -3016,7 +3102,7 @@ void MlOptimiser::symmetriseReconstructions()
 			{
 				// Immediately after expectation process. Do rise and twist for all asymmetrical units in Fourier space
 				// Also convert helical rise to pixels for BPref object
-				wsum_model.BPref[ith_recons].symmetrise(mymodel.helical_nr_asu, mymodel.helical_twist[ith_recons], mymodel.helical_rise[ith_recons] / mymodel.pixel_size);
+				wsum_model.BPref[ith_recons].symmetrise(mymodel.helical_nr_asu, mymodel.helical_twist[ith_recons], mymodel.helical_rise[ith_recons] / mymodel.pixel_size, nr_threads);
 			}
 		}
 	}
@@ -3052,7 +3138,8 @@ void MlOptimiser::makeGoodHelixForEachRef()
 							mymodel.helical_twist_min,
 							mymodel.helical_twist_max,
 							mymodel.helical_twist_inistep,
-							mymodel.helical_twist[iclass]);
+							mymodel.helical_twist[iclass],
+							nr_threads);
 				}
 				imposeHelicalSymmetryInRealSpace(
 						mymodel.Iref[ith_recons],
@@ -3063,7 +3150,8 @@ void MlOptimiser::makeGoodHelixForEachRef()
 						helical_z_percentage,
 						mymodel.helical_rise[iclass],
 						mymodel.helical_twist[iclass],
-						width_mask_edge);
+						width_mask_edge,
+						nr_threads);
 			}
 		}
 	}
@@ -3135,7 +3223,7 @@ void MlOptimiser::maximizationOtherParameters()
 #endif
 
 	// Calculate total sum of weights, and average CTF for each class (for SSNR estimation)
-	RFLOAT sum_weight = 0.;
+	double sum_weight = 0.;
 	for (int iclass = 0; iclass < mymodel.nr_classes; iclass++)
 		sum_weight += wsum_model.pdf_class[iclass];
 
@@ -3666,6 +3754,8 @@ void MlOptimiser::getFourierTransformsAndCtfs(long int my_ori_particle, int ibod
 {
 
 	FourierTransformer transformer;
+	// For the unmasked images only the Fourier components up to current_size are calculated
+	PrunedFourierTransformer pruned_transformer;
 
 	for (int ipart = 0; ipart < mydata.ori_particles[my_ori_particle].particles_id.size(); ipart++)
 	{
@@ -3783,11 +3873,7 @@ void MlOptimiser::getFourierTransformsAndCtfs(long int my_ori_particle, int ibod
 			// If all slaves had preread images into RAM: get those now
 			if (do_preread_images)
 			{
-                img().reshape(mydata.particles[part_id].img);
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mydata.particles[part_id].img)
-				{
-                	DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(mydata.particles[part_id].img, n);
-				}
+                mydata.particles[part_id].getPrereadImage(img());
 			}
 			else
 			{
@@ -3803,6 +3889,7 @@ void MlOptimiser::getFourierTransformsAndCtfs(long int my_ori_particle, int ibod
 				img().setXmippOrigin();
 
 				// Check that this is the same as the image in exp_imgs vector
+				waitForImageSomeParticles(istop);
 				Image<RFLOAT> diff;
 				if (istop >= exp_imgs.size())
 				{
@@ -3835,7 +3922,18 @@ void MlOptimiser::getFourierTransformsAndCtfs(long int my_ori_particle, int ibod
 				}
 				else
 				{
-					img() = exp_imgs[istop];
+					FileName fn_img;
+					if (scratch_reader.isOpen() && mydata.getImageNameOnScratch(part_id, fn_img))
+					{
+						// All threads read their own particles from the stack on the scratch disk
+						img.readFromStackReader(fn_img, scratch_reader);
+						img().setXmippOrigin();
+					}
+					else
+					{
+						waitForImageSomeParticles(istop);
+						img() = exp_imgs[istop];
+					}
 				}
 #endif
 			}
@@ -4035,8 +4133,7 @@ void MlOptimiser::getFourierTransformsAndCtfs(long int my_ori_particle, int ibod
 		MultidimArray<RFLOAT> img_aux;
 		img_aux = (has_converged && do_use_reconstruct_images) ? rec_img() : img();
 		CenterFFT(img_aux, true);
-		transformer.FourierTransform(img_aux, Faux);
-		windowFourierTransform(Faux, Fimg, mymodel.current_size);
+		pruned_transformer.FourierTransform(img_aux, Fimg, mymodel.current_size);
 
 		// Here apply the beamtilt correction if necessary
 		// This will only be used for reconstruction, not for alignment
@@ -5033,13 +5130,14 @@ void MlOptimiser::getAllSquaredDifferences(long int my_ori_particle, int ibody,
 											if (my_ori_particle == exp_my_first_ori_particle)
 												timer.tic(TIMING_DIFF_DIFF2);
 #endif
-											RFLOAT diff2;
+											// In single-precision builds, the terms are calculated in float, but summed in double
+											double diff2;
 											if ((iter == 1 && do_firstiter_cc) || do_always_cc)
 											{
 												// Do not calculate squared-differences, but signal product
 												// Negative values because smaller is worse in this case
 												diff2 = 0.;
-												RFLOAT suma2 = 0.;
+												double suma2 = 0.;
 												FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Frefctf)
 												{
 													diff2 -= (DIRECT_MULTIDIM_ELEM(Frefctf, n)).real * (*(Fimg_shift + n)).real;
@@ -5204,7 +5302,7 @@ void MlOptimiser::convertAllSquaredDifferencesToWeights(long int my_ori_particle
 		int exp_idir_min, int exp_idir_max, int exp_ipsi_min, int exp_ipsi_max,
 		int exp_itrans_min, int exp_itrans_max, int exp_iclass_min, int exp_iclass_max,
 		MultidimArray<RFLOAT> &exp_Mweight, MultidimArray<bool> &exp_Mcoarse_significant,
-		std::vector<RFLOAT> &exp_significant_weight, std::vector<RFLOAT> &exp_sum_weight,
+		std::vector<RFLOAT> &exp_significant_weight, std::vector<double> &exp_sum_weight,
 		std::vector<Matrix1D<RFLOAT> > &exp_old_offset, std::vector<Matrix1D<RFLOAT> > &exp_prior,
 		std::vector<RFLOAT> &exp_min_diff2,
 		std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
@@ -5245,7 +5343,7 @@ void MlOptimiser::convertAllSquaredDifferencesToWeights(long int my_ori_particle
 	for (long int ipart = 0; ipart < exp_nr_particles; ipart++)
 	{
 		long int part_id = mydata.ori_particles[my_ori_particle].particles_id[ipart];
-		RFLOAT exp_thisparticle_sumweight = 0.;
+		double exp_thisparticle_sumweight = 0.;
 
 		RFLOAT old_offset_z;
 		RFLOAT old_offset_x = XX(exp_old_offset[ipart]);
@@ -5633,7 +5731,7 @@ void MlOptimiser::convertAllSquaredDifferencesToWeights(long int my_ori_particle
 		if (my_ori_particle == exp_my_first_ori_particle)
 			timer.toc(TIMING_WEIGHT_SORT);
 #endif
-		RFLOAT frac_weight = 0.;
+		double frac_weight = 0.;
 		RFLOAT my_significant_weight;
 		long int my_nr_significant_coarse_samples = 0;
 		for (long int i = XSIZE(sorted_weight) - 1; i >= 0; i--)
@@ -5751,7 +5849,7 @@ void MlOptimiser::storeWeightedSums(long int my_ori_particle, int ibody, int exp
 		MultidimArray<RFLOAT> &exp_Mweight,
 		MultidimArray<bool> &exp_Mcoarse_significant,
 		std::vector<RFLOAT> &exp_significant_weight,
-		std::vector<RFLOAT> &exp_sum_weight,
+		std::vector<double> &exp_sum_weight,
 		std::vector<RFLOAT> &exp_max_weight,
 		std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
 		std::vector<RFLOAT> &exp_directions_prior, std::vector<RFLOAT> &exp_psi_prior,
@@ -5845,8 +5943,9 @@ void MlOptimiser::storeWeightedSums(long int my_ori_particle, int ibody, int exp
 	// Make local copies of weighted sums (except BPrefs, which are too big)
 	// so that there are not too many mutex locks below
 	std::vector<MultidimArray<RFLOAT> > thr_wsum_sigma2_noise, thr_wsum_pdf_direction;
-	std::vector<RFLOAT> thr_wsum_norm_correction, thr_sumw_group, thr_wsum_pdf_class, thr_wsum_prior_offsetx_class, thr_wsum_prior_offsety_class;
-	RFLOAT thr_wsum_sigma2_offset;
+	// Sums over all particles and orientations are always kept in double-precision
+	std::vector<double> thr_wsum_norm_correction, thr_sumw_group, thr_wsum_pdf_class, thr_wsum_prior_offsetx_class, thr_wsum_prior_offsety_class;
+	double thr_wsum_sigma2_offset;
 	MultidimArray<RFLOAT> thr_metadata, zeroArray;
 	// Wsum_sigma_noise2 is a 1D-spectrum for each group
 	zeroArray.initZeros(mymodel.ori_size/2 + 1);
@@ -6430,8 +6529,8 @@ void MlOptimiser::storeWeightedSums(long int my_ori_particle, int ibody, int exp
 	// Extend norm_correction and sigma2_noise estimation to higher resolutions for all particles
 	// Also calculate dLL for each particle and store in metadata
 	// loop over all particles inside this ori_particle
-	RFLOAT thr_avg_norm_correction = 0.;
-	RFLOAT thr_sum_dLL = 0., thr_sum_Pmax = 0.;
+	double thr_avg_norm_correction = 0.;
+	double thr_sum_dLL = 0., thr_sum_Pmax = 0.;
 	for (long int ipart = 0; ipart < mydata.ori_particles[my_ori_particle].particles_id.size(); ipart++)
 	{
 		long int part_id = mydata.ori_particles[my_ori_particle].particles_id[ipart];
@@ -7548,19 +7647,15 @@ void MlOptimiser::getMetaAndImageDataSubset(int first_ori_particle_id, int last_
 				Image<RFLOAT> img, rec_img;
 				if (do_preread_images)
 				{
-					img().reshape(mydata.particles[part_id].img);
-					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mydata.particles[part_id].img)
-					{
-						DIRECT_MULTIDIM_ELEM(img(), n) = (RFLOAT)DIRECT_MULTIDIM_ELEM(mydata.particles[part_id].img, n);
-					}
+					mydata.particles[part_id].getPrereadImage(img());
 				}
 				else
 				{
-					// only open new stacks
+					// only open new stacks, and map them read-only so that all processes on a node share them in the page cache
 					fn_img.decompose(dump, fn_stack);
 					if (fn_stack != fn_open_stack)
 					{
-						hFile.openFile(fn_stack, WRITE_READONLY);
+						hFile.openFile(fn_stack, WRITE_READONLY, true);
 						fn_open_stack = fn_stack;
 					}
 					img.readFromOpenFile(fn_img, hFile, -1, false);
@@ -293,6 +293,9 @@ public:
 	// Or preread all images into RAM on the master node?
 	bool do_preread_images;
 
+	// Store the pre-read images as 16-bit floats to halve their memory footprint?
+	bool do_preread_float16;
+
 	// Place on scratch disk to copy particle stacks temporarily
 	FileName fn_scratch;
 
@@ -480,6 +483,14 @@ public:
 	MultidimArray<RFLOAT> exp_metadata, exp_imagedata;
 	std::string exp_fn_img, exp_fn_ctf, exp_fn_recimg;
 	std::vector<MultidimArray<RFLOAT> > exp_imgs;
+	// Filenames of the images in exp_imgs, which are read by a background thread while the expectation threads already run
+	std::vector<FileName> exp_fn_imgs_to_read;
+	// Number of images in exp_imgs that have been read so far
+	long int exp_nr_imgs_read;
+	// Error of the background thread that reads exp_imgs (empty if all images could be read)
+	std::string exp_imgs_read_error;
+	// All 2D particles on the scratch disk are in a single stack, from which the expectation threads read concurrently
+	ImageStackReader scratch_reader;
 	std::vector<int> exp_random_class_some_particles;
 	int exp_nr_images;
 
@@ -694,6 +705,12 @@ public:
 	/* Perform expectation step for some particles using threads */
 	void doThreadExpectationSomeParticles(int thread_id);
 
+	/* Read all images in exp_fn_imgs_to_read into exp_imgs (run in a background thread by expectationSomeParticles) */
+	void readImagesSomeParticles();
+
+	/* Wait until the background thread has read image istop of exp_imgs */
+	void waitForImageSomeParticles(long int istop);
+
 	/* Perform the expectation integration over all k, phi and series elements for a given particle */
 	void expectationOneParticle(long int my_ori_particle, int thread_id);
 
@@ -804,7 +821,7 @@ public:
 			int exp_idir_min, int exp_idir_max, int exp_ipsi_min, int exp_ipsi_max,
 			int exp_itrans_min, int exp_itrans_max, int my_iclass_min, int my_iclass_max,
 			MultidimArray<RFLOAT> &exp_Mweight, MultidimArray<bool> &exp_Mcoarse_significant,
-			std::vector<RFLOAT> &exp_significant_weight, std::vector<RFLOAT> &exp_sum_weight,
+			std::vector<RFLOAT> &exp_significant_weight, std::vector<double> &exp_sum_weight,
 			std::vector<Matrix1D<RFLOAT> > &exp_old_offset, std::vector<Matrix1D<RFLOAT> > &exp_prior,
 			std::vector<RFLOAT> &exp_min_diff2,
 			std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
@@ -826,7 +843,7 @@ public:
 			MultidimArray<RFLOAT> &exp_Mweight,
 			MultidimArray<bool> &exp_Mcoarse_significant,
 			std::vector<RFLOAT> &exp_significant_weight,
-			std::vector<RFLOAT> &exp_sum_weight,
+			std::vector<double> &exp_sum_weight,
 			std::vector<RFLOAT> &exp_max_weight,
 			std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
 			std::vector<RFLOAT> &exp_directions_prior, std::vector<RFLOAT> &exp_psi_prior,
@@ -573,7 +573,7 @@ void MlOptimiserMpi::initialiseWorkLoad()
     		int myverb = (node->rank == 1) ? 1 : 0; // Only the first slave
     		if (!node->isMaster())
     		{
-    			mydata.copyParticlesToScratch(myverb, need_to_copy, also_do_ctfimage, keep_free_scratch_Gb);
+    			mydata.copyParticlesToScratch(myverb, need_to_copy, also_do_ctfimage, keep_free_scratch_Gb, nr_threads);
     		}
 		}
 		else
@@ -582,7 +582,7 @@ void MlOptimiserMpi::initialiseWorkLoad()
 			if (node->isMaster())
 			{
 				mydata.prepareScratchDirectory(fn_scratch);
-				mydata.copyParticlesToScratch(1, true, also_do_ctfimage, keep_free_scratch_Gb);
+				mydata.copyParticlesToScratch(1, true, also_do_ctfimage, keep_free_scratch_Gb, nr_threads);
 			}
 		}
     }
@@ -1782,7 +1782,8 @@ void MlOptimiserMpi::maximization()
 								mymodel.helical_twist_min,
 								mymodel.helical_twist_max,
 								mymodel.helical_twist_inistep,
-								mymodel.helical_twist[ith_recons]);
+								mymodel.helical_twist[ith_recons],
+								nr_threads);
 					}
 					// Sjors & Shaoda Apr 2015 - Apply real space helical symmetry and real space Z axis expansion.
 					if ( (do_helical_refine) && (!has_converged) )
@@ -1796,7 +1797,8 @@ void MlOptimiserMpi::maximization()
 								helical_z_percentage,
 								mymodel.helical_rise[ith_recons],
 								mymodel.helical_twist[ith_recons],
-								width_mask_edge);
+								width_mask_edge,
+								nr_threads);
 					}
 					helical_rise_half1 = mymodel.helical_rise[ith_recons];
 					helical_twist_half1 = mymodel.helical_twist[ith_recons];
@@ -1857,7 +1859,8 @@ void MlOptimiserMpi::maximization()
 									mymodel.helical_twist_min,
 									mymodel.helical_twist_max,
 									mymodel.helical_twist_inistep,
-									helical_twist_half2);
+									helical_twist_half2,
+									nr_threads);
 						}
 						// Sjors & Shaoda Apr 2015 - Apply real space helical symmetry and real space Z axis expansion.
 						if( (do_helical_refine) && (!has_converged) )
@@ -1871,7 +1874,8 @@ void MlOptimiserMpi::maximization()
 									helical_z_percentage,
 									helical_rise_half2,
 									helical_twist_half2,
-									width_mask_edge);
+									width_mask_edge,
+									nr_threads);
 						}
 
 					}
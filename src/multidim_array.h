@@ -4289,6 +4289,32 @@ public:
         return *this;
     }
 
+    /** Swap the contents of two arrays without copying their data.
+     *
+     * @code
+     * v1.swap(v2);
+     * @endcode
+     */
+    void swap(MultidimArray<T>& op1)
+    {
+        std::swap(data, op1.data);
+        std::swap(destroyData, op1.destroyData);
+        std::swap(ndim, op1.ndim);
+        std::swap(zdim, op1.zdim);
+        std::swap(ydim, op1.ydim);
+        std::swap(xdim, op1.xdim);
+        std::swap(yxdim, op1.yxdim);
+        std::swap(zyxdim, op1.zyxdim);
+        std::swap(nzyxdim, op1.nzyxdim);
+        std::swap(zinit, op1.zinit);
+        std::swap(yinit, op1.yinit);
+        std::swap(xinit, op1.xinit);
+        std::swap(mmapOn, op1.mmapOn);
+        std::swap(mapFile, op1.mapFile);
+        std::swap(mFd, op1.mFd);
+        std::swap(nzyxdimAlloc, op1.nzyxdimAlloc);
+    }
+
     /** Unary minus.
      *
      * It is used to build arithmetic expressions. You can make a minus
@@ -765,8 +765,10 @@ void ParticlePolisher::calculateSingleFrameReconstruction(int iframe, int this_h
 		RFLOAT xtrans, ytrans;
 		RFLOAT rot, tilt, psi;
 		int i_half;
-		long int my_frame;
-		FileName fn_img, fn_mic;
+		long int my_frame, dump;
+		FileName fn_img, fn_mic, fn_stack;
+		// The movie-frame particles of this micrograph are read from their stack, which is only opened once
+		ImageStackReader stack_reader;
 		FOR_ALL_OBJECTS_IN_METADATA_TABLE(exp_model.MDimg)
 		{
 
@@ -776,7 +778,10 @@ void ParticlePolisher::calculateSingleFrameReconstruction(int iframe, int this_h
 			if (ABS(my_frame - this_frame) <= frame_running_average/2 && i_half == this_half)
 			{
 				exp_model.MDimg.getValue(EMDL_IMAGE_NAME, fn_img);
-				img.read(fn_img);
+				fn_img.decompose(dump, fn_stack);
+				if (fn_stack != stack_reader.fn_stack)
+					stack_reader.openStack(fn_stack);
+				img.readFromStackReader(fn_img, stack_reader);
 				CenterFFT(img(), true);
 				FourierTransformer transformer;
 				transformer.FourierTransform(img(), F2Dp);
@@ -1081,21 +1086,30 @@ void ParticlePolisher::polishParticlesOneMicrograph(long int imic)
 	// Then read in all individual movie frames, apply frame x,y-movements as phase shifts and calculate polished (shiny) particles
 	// as average of the re-aligned frames
 	RFLOAT x_off_p, y_off_p, x_off_prior_p, y_off_prior_p;
-	FileName fn_img, fn_part;
+	FileName fn_img, fn_part, fn_stack, fn_open_stack = "";
+	fImageHandler hFile;
+	ImageStackWriter stack_writer;
+	long int dump;
 	Image<RFLOAT> img;
 	FourierTransformer transformer;
-	MultidimArray<Complex > Fimg, Fwsum;
+	// All movie frames of one particle are Fourier transformed together
+	BatchFourierTransformer batch_transformer;
+	MultidimArray<RFLOAT> Iframes;
+	MultidimArray<Complex > Fimg, Fwsum, Fframes;
 	MultidimArray<RFLOAT> Fsumw;
-	RFLOAT xtrans, ytrans;
+	std::vector<RFLOAT> xtrans, ytrans;
 	RFLOAT all_minval = 99999., all_maxval = -99999., all_avg = 0., all_stddev = 0.;
 
 	// Loop over all original_particles in this micrograph
 	for (long int ipar = 0; ipar < exp_model.micrographs[0].ori_particle_ids.size(); ipar++)
 	{
 		long int ori_part_id = exp_model.micrographs[0].ori_particle_ids[ipar];
+		long int nr_frames = exp_model.ori_particles[ori_part_id].particles_id.size();
+		xtrans.resize(nr_frames);
+		ytrans.resize(nr_frames);
 
-		// Loop over all frames for motion corrections and possibly dose-dependent weighting
-		for (long int iframe = 0; iframe < exp_model.ori_particles[ori_part_id].particles_id.size(); iframe++)
+		// First read all frames into a single stack
+		for (long int iframe = 0; iframe < nr_frames; iframe++)
 		{
 			long int part_id = exp_model.ori_particles[ori_part_id].particles_id[iframe];
 
@@ -1106,12 +1120,21 @@ void ParticlePolisher::polishParticlesOneMicrograph(long int imic)
 			exp_model.MDimg.getValue(EMDL_ORIENT_ORIGIN_X, x_off_p, part_id);
 			exp_model.MDimg.getValue(EMDL_ORIENT_ORIGIN_Y, y_off_p, part_id);
 
-			img.read(fn_img);
-			RFLOAT ori_size= XSIZE(img());
+			// Only open (and map read-only) new stacks
+			fn_img.decompose(dump, fn_stack);
+			if (fn_stack != fn_open_stack)
+			{
+				hFile.openFile(fn_stack, WRITE_READONLY, true);
+				fn_open_stack = fn_stack;
+			}
+			img.readFromOpenFile(fn_img, hFile, -1);
+			if (iframe == 0)
+				Iframes.resize(nr_frames, 1, YSIZE(img()), XSIZE(img()));
+			Iframes.setImage(iframe, img());
 
 			// Get the image shifts relative to the prior
-			xtrans = x_off_p - x_off_prior_p;
-			ytrans = y_off_p - y_off_prior_p;
+			xtrans[iframe] = x_off_p - x_off_prior_p;
+			ytrans[iframe] = y_off_p - y_off_prior_p;
 
 #ifdef DEBUG
 			if (fn_part =="000001@Particles/Micrographs/Falcon_2012_06_13-01_05_13_0_rh15particles.mrcs")
@@ -1124,9 +1147,17 @@ void ParticlePolisher::polishParticlesOneMicrograph(long int imic)
 				std::cerr << " iframe= " << iframe << " XX(trans)= " << XX(trans) << " YY(trans)= " << YY(trans) << std::endl;
 			}
 #endif
+		}
+
+		// Fourier transform all frames at once
+		batch_transformer.FourierTransform(Iframes, Fframes, false);
+		RFLOAT ori_size= XSIZE(Iframes);
 
+		// Loop over all frames for motion corrections and possibly dose-dependent weighting
+		for (long int iframe = 0; iframe < nr_frames; iframe++)
+		{
 			// Apply the phase shifts for this translation in Fourier space
-			transformer.FourierTransform(img(), Fimg);
+			Fframes.getImage(iframe, Fimg);
 
 			if (iframe == 0)
 			{
@@ -1134,7 +1165,7 @@ void ParticlePolisher::polishParticlesOneMicrograph(long int imic)
 				Fsumw.initZeros(Fimg);
 			}
 
-			shiftImageInFourierTransform(Fimg, Fimg, ori_size, xtrans, ytrans);
+			shiftImageInFourierTransform(Fimg, Fimg, ori_size, xtrans[iframe], ytrans[iframe]);
 
 			// Apply (positive!!) B-factor weighting and store weighted sums
 			RFLOAT bfactor = (do_weighting) ? DIRECT_A1D_ELEM(perframe_bfactors, 3 * iframe + 0) : 0.;
@@ -1174,7 +1205,6 @@ void ParticlePolisher::polishParticlesOneMicrograph(long int imic)
 
 		// write the new average (i.e. the shiny, or polished particle)
 		changeParticleStackName(fn_part);
-		fn_img.compose(ipar + 1, fn_part);
 
 		// Only make directory if needed
 		if (ipar == 0)
@@ -1188,21 +1218,19 @@ void ParticlePolisher::polishParticlesOneMicrograph(long int imic)
 			}
 		}
 
+		// The shiny particles are written in large batches in the background
+		if (ipar == 0)
+			stack_writer.openStack(fn_part, Float, 64, true);
+		stack_writer.writeImage(img);
+
 		// When last particle, also write the correct header
 		if (ipar == exp_model.micrographs[0].ori_particle_ids.size() - 1)
 		{
 			all_avg /= exp_model.micrographs[0].ori_particle_ids.size();
 			all_stddev = sqrt(all_stddev/exp_model.micrographs[0].ori_particle_ids.size());
-			img.MDMainHeader.setValue(EMDL_IMAGE_STATS_MIN, all_minval);
-			img.MDMainHeader.setValue(EMDL_IMAGE_STATS_MAX, all_maxval);
-			img.MDMainHeader.setValue(EMDL_IMAGE_STATS_AVG, all_avg);
-			img.MDMainHeader.setValue(EMDL_IMAGE_STATS_STDDEV, all_stddev);
+			stack_writer.setStatistics(all_minval, all_maxval, all_avg, all_stddev);
+			stack_writer.closeStack();
 		}
-
-		if (ipar == 0)
-			img.write(fn_img, -1, false, WRITE_OVERWRITE);
-		else
-			img.write(fn_img, -1, true, WRITE_APPEND);
 	}
 
 }
@@ -1287,7 +1315,10 @@ void ParticlePolisher::reconstructShinyParticlesOneHalf(int this_half, Experimen
 	RFLOAT xtrans, ytrans;
 	RFLOAT rot, tilt, psi;
 	int i_half;
-	FileName fn_img;
+	long int dump;
+	FileName fn_img, fn_stack;
+	// The shiny particles are read from their stacks, each of which is only opened once
+	ImageStackReader stack_reader;
 
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(exp_model.MDimg)
 	{
@@ -1296,7 +1327,10 @@ void ParticlePolisher::reconstructShinyParticlesOneHalf(int this_half, Experimen
 		if (i_half == this_half)
 		{
 			exp_model.MDimg.getValue(EMDL_IMAGE_NAME, fn_img);
-			img.read(fn_img);
+			fn_img.decompose(dump, fn_stack);
+			if (fn_stack != stack_reader.fn_stack)
+				stack_reader.openStack(fn_stack);
+			img.readFromStackReader(fn_img, stack_reader);
 			CenterFFT(img(), true);
 			transformer.FourierTransform(img(), F2D);
 
@@ -352,15 +352,15 @@ void ParticleSorter::calculateFeaturesOneParticle(long int ipart)
 			DIRECT_MULTIDIM_ELEM(Fref, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
 		}
 	}
+	Mref_rot.resize(img());
 	if (lowpass > 0.)
 	{
-		// Set the Fourier transform back to its original size...
-		MultidimArray<Complex > Frefp;
-		windowFourierTransform(Fref, Frefp, XSIZE(img()));
-		Fref = Frefp;
+		// Pad the Fourier transform back to its original size, only transforming the non-zero columns
+		PrunedFourierTransformer pruned_transformer;
+		pruned_transformer.inverseFourierTransform(Fref, Mref_rot);
 	}
-	Mref_rot.resize(img());
-	transformer.inverseFourierTransform(Fref, Mref_rot);
+	else
+		transformer.inverseFourierTransform(Fref, Mref_rot);
 	CenterFFT(Mref_rot, true);
 
 #ifdef DEBUG
@@ -61,11 +61,15 @@ void Postprocessing::read(int argc, char **argv)
 	randomize_fsc_at = textToFloat(parser.getOption("--randomize_at_fsc", "Randomize phases from the resolution where FSC drops below this value", "0.8"));
 	filter_edge_width = textToInteger(parser.getOption("--filter_edge_width", "Width of the raised cosine on the low-pass filter edge (in resolution shells)", "2"));
 	verb = textToInteger(parser.getOption("--verb", "Verbosity", "1"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to use for FFTs", "1"));
 
 	// Check for errors in the command-line option
 	if (parser.checkForErrors())
 		REPORT_ERROR("Errors encountered on the command line (see above), exiting...");
 
+	// All FFTs in this program are done one at a time
+	setFftwDefaultThreads(nr_threads);
+
 }
 
 void Postprocessing::usage()
@@ -92,6 +96,7 @@ void Postprocessing::clear()
 	randomize_fsc_at = 0.8;
 	filter_edge_width = 2.;
 	verb = 1;
+	nr_threads = 1;
 	do_ampl_corr = false;
 }
 
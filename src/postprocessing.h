@@ -43,6 +43,9 @@ public:
 	// Verbosity
 	int verb;
 
+	// Number of threads for the 3D FFTs
+	int nr_threads;
+
 	// Input & Output rootname
 	FileName fn_in, fn_out, fn_I1, fn_I2;
 
@@ -42,6 +42,19 @@
 #define TIMING_TOC(id)
 #endif
 
+void globalThreadExtractParticles(ThreadArgument &thArg)
+{
+	Preprocessing *prm = (Preprocessing*) thArg.workClass;
+	prm->doThreadExtractParticles(thArg.thread_id);
+}
+
+void * globalThreadReadMicrograph(void *self)
+{
+	Preprocessing *prm = (Preprocessing*) self;
+	prm->readMicrographInBackground();
+	return NULL;
+}
+
 void Preprocessing::read(int argc, char **argv, int rank)
 {
 
@@ -75,6 +88,7 @@ void Preprocessing::read(int argc, char **argv, int rank)
 	movie_last_frame--; // (start counting at 0, not 1)
 	fn_movie = parser.getOption("--movie_rootname", "Common name to relate movies to the single micrographs (e.g. mic001_movie.mrcs related to mic001.mrc)", "movie");
 	only_extract_unfinished = parser.checkOption("--only_extract_unfinished", "Extract only particles if the STAR file for that micrograph does not yet exist.");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to process the particles of each micrograph in parallel", "1"));
 
 	int perpart_section = parser.addSection("Particle operations");
 	do_project_3d = parser.checkOption("--project3d", "Project sub-tomograms along Z to generate 2D particles");
@@ -86,6 +100,7 @@ void Preprocessing::read(int argc, char **argv, int rank)
 	white_dust_stddev = textToFloat(parser.getOption("--white_dust", "Sigma-values above which white dust will be removed (negative value means no dust removal)","-1"));
 	black_dust_stddev = textToFloat(parser.getOption("--black_dust", "Sigma-values above which black dust will be removed (negative value means no dust removal)","-1"));
 	do_invert_contrast = parser.checkOption("--invert_contrast", "Invert the contrast in the input images");
+	do_write_float16 = parser.checkOption("--float16", "Write the particle stacks as 16-bit floats (MRC mode 12), which halves their size");
 	fn_operate_in = parser.getOption("--operate_on", "Use this option to operate on an input stack/STAR file", "");
 	fn_operate_out = parser.getOption("--operate_out", "Output rootname when operating on an input stack/STAR file", "preprocessed");
 
@@ -418,6 +433,11 @@ void Preprocessing::runExtractParticles()
 		if (verb > 0 && imic % barstep == 0)
 			progress_bar(imic);
 
+		// The next micrograph can already be read while extracting from this one
+		fn_mic_next = "";
+		if (!do_movie_extract && imic + 1 < nr_mics)
+			MDmics.getValue(EMDL_MICROGRAPH_NAME, fn_mic_next, imic + 1);
+
 		TIMING_TIC(TIMING_TOP);
 		extractParticlesFromFieldOfView(fn_mic, imic);
 		TIMING_TOC(TIMING_TOP);
@@ -707,7 +727,7 @@ void Preprocessing::extractParticlesFromOneFrame(MetaDataTable &MD,
 		RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval)
 {
 
-	Image<RFLOAT> Ipart, Imic, Itmp;
+	Image<RFLOAT> Imic, Itmp;
 
 	TIMING_TIC(TIMING_READ_IMG);
 
@@ -715,6 +735,9 @@ void Preprocessing::extractParticlesFromOneFrame(MetaDataTable &MD,
 	// If movies, then average over avg_n_frames
 	if (n_frames > 1)
 	{
+		// Map the movie read-only once for all frames to be averaged
+		fImageHandler hFile;
+		hFile.openFile(fn_mic, WRITE_READONLY, true, true);
 		for (int ii =0; ii < avg_n_frames; ii++)
 		{
 			int iiframe = iframe + ii;
@@ -724,11 +747,11 @@ void Preprocessing::extractParticlesFromOneFrame(MetaDataTable &MD,
 			fn_frame.compose(iiframe + 1, fn_mic);
 			if (ii==0)
 			{
-				Imic.read(fn_frame, true, -1, false, true); // readData = true, select_image = -1, mapData= false, is_2D = true
+				Imic.readFromOpenFile(fn_frame, hFile, -1, true); // select_image = -1, is_2D = true
 			}
 			else
 			{
-				Itmp.read(fn_frame, true, -1, false, true); // readData = true, select_image = -1, mapData= false, is_2D = true
+				Itmp.readFromOpenFile(fn_frame, hFile, -1, true); // select_image = -1, is_2D = true
 				Imic() += Itmp();
 				Itmp.clear();
 			}
@@ -737,7 +760,7 @@ void Preprocessing::extractParticlesFromOneFrame(MetaDataTable &MD,
 	else
 	{
 		fn_frame = fn_mic;
-		Imic.read(fn_frame);
+		readMicrograph(fn_frame, Imic);
 	}
 	TIMING_TOC(TIMING_READ_IMG);
 
@@ -781,12 +804,17 @@ void Preprocessing::extractParticlesFromOneFrame(MetaDataTable &MD,
 					LAST_XMIPP_INDEX(ori_ysize),  LAST_XMIPP_INDEX(ori_xsize));
 	}
 
-	// Now window all particles from the micrograph
+	// Get the positions of all particles (the threads cannot loop over the MetaDataTable)
+	extract_xpos.clear();
+	extract_ypos.clear();
+	extract_zpos.clear();
+	extract_tilt_deg.clear();
+	extract_psi_deg.clear();
 	int ipos = 0;
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
 	{
 		RFLOAT dxpos, dypos, dzpos;
-		long int xpos, ypos, zpos;
+		long int xpos, ypos, zpos = 0;
 		long int x0, xF, y0, yF, z0, zF;
 		MD.getValue(EMDL_IMAGE_COORD_X, dxpos);
 		MD.getValue(EMDL_IMAGE_COORD_Y, dypos);
@@ -804,14 +832,6 @@ void Preprocessing::extractParticlesFromOneFrame(MetaDataTable &MD,
 			zF = zpos + LAST_XMIPP_INDEX(extract_size);
 		}
 
-		TIMING_TIC(TIMING_WINDOW);
-		// extract one particle in Ipart
-		if (dimensionality == 3)
-			Imic().window(Ipart(), z0, y0, x0, zF, yF, xF);
-		else
-			Imic().window(Ipart(), y0, x0, yF, xF);
-		TIMING_TOC(TIMING_WINDOW);
-
 		// Discard particles that are completely outside the micrograph and print a warning
 		if (yF < 0 || y0 >= YSIZE(Imic()) || xF < 0 || x0 >= XSIZE(Imic()) ||
 				(dimensionality==3 &&
@@ -826,137 +846,116 @@ void Preprocessing::extractParticlesFromOneFrame(MetaDataTable &MD,
 			std::cerr << std::endl;
 					REPORT_ERROR("Preprocessing::extractParticlesFromOneFrame ERROR: particle" + integerToString(ipos+1) + " lies completely outside micrograph " + fn_mic);
 		}
-		else
+
+		// Jun24,2015 - Shaoda, extract helical segments
+		RFLOAT tilt_deg, psi_deg;
+		tilt_deg = psi_deg = 0.;
+		if (do_extract_helix) // If priors do not exist, errors will occur in 'readHelicalCoordinates()'.
 		{
+			MD.getValue(EMDL_ORIENT_TILT_PRIOR, tilt_deg);
+			MD.getValue(EMDL_ORIENT_PSI_PRIOR, psi_deg);
+		}
 
-			TIMING_TIC(TIMING_BOUNDARY);
-			// Check boundaries: fill pixels outside the boundary with the nearest ones inside
-			// This will create lines at the edges, rather than zeros
-			Ipart().setXmippOrigin();
+		extract_xpos.push_back(xpos);
+		extract_ypos.push_back(ypos);
+		extract_zpos.push_back(zpos);
+		extract_tilt_deg.push_back(tilt_deg);
+		extract_psi_deg.push_back(psi_deg);
+		ipos++;
+	}
 
-			// X-boundaries
-			if (x0 < 0 || xF >= XSIZE(Imic()) )
-			{
-				FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
-				{
-					if (j + xpos < 0)
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, -xpos);
-					else if (j + xpos >= XSIZE(Imic()))
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, XSIZE(Imic()) - xpos - 1);
-				}
-			}
+	// Window and process batches of particles in parallel, and write them to the output stack in order
+	long int npos = extract_xpos.size();
+	long int batch_size = (nr_threads > 1) ? 16 * nr_threads : 1;
+	extract_Imic = &Imic;
+	extract_n_frames = n_frames;
+	extract_imic = imic;
+	extract_first_image_nr = my_current_nr_images;
+	extract_parts.resize(XMIPP_MIN(batch_size, npos));
+	if (nr_threads > 1 && extract_threads == NULL)
+	{
+		extract_distributor = new ThreadTaskDistributor(batch_size, 1);
+		extract_threads = new ThreadManager(nr_threads, this);
+	}
+	for (extract_first_pos = 0; extract_first_pos < npos; extract_first_pos += batch_size)
+	{
+		long int my_nr_parts = XMIPP_MIN(batch_size, npos - extract_first_pos);
 
-			// Y-boundaries
-			if (y0 < 0 || yF >= YSIZE(Imic()))
-			{
-				FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
-				{
-					if (i + ypos < 0)
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, -ypos, j);
-					else if (i + ypos >= YSIZE(Imic()))
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, YSIZE(Imic()) - ypos - 1, j);
-				}
-			}
+		TIMING_TIC(TIMING_PRE_IMG_OPS);
+		if (nr_threads > 1)
+		{
+			extract_distributor->resize(my_nr_parts, 1);
+			extract_distributor->reset();
+			extract_threads->run(globalThreadExtractParticles);
+		}
+		else
+		{
+			extractOneParticle(extract_first_pos, extract_parts[0]);
+		}
+		TIMING_TOC(TIMING_PRE_IMG_OPS);
 
-			if (dimensionality == 3)
-			{
-				// Z-boundaries
-				if (z0 < 0 || zF >= ZSIZE(Imic()))
-				{
-					FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
-					{
-						if (k + zpos < 0)
-							A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), -zpos, i, j);
-						else if (k + zpos >= ZSIZE(Imic()))
-							A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), ZSIZE(Imic()) - zpos - 1, i, j);
-					}
-				}
-			}
+		// performPerImageOperations used to also append the particles to the output stack in fn_stack
+		for (long int i = 0; i < my_nr_parts; i++)
+			writeOneImage(extract_parts[i], fn_output_img_root, my_current_nr_images + extract_first_pos + i, my_total_nr_images,
+					all_avg, all_stddev, all_minval, all_maxval);
+	}
+	extract_parts.clear();
 
-			//
-			if (dimensionality == 3 && do_project_3d)
-			{
-				// Project the 3D sub-tomogram into a 2D particle again
-				Image<RFLOAT> Iproj(YSIZE(Ipart()), XSIZE(Ipart()));
-				Iproj().setXmippOrigin();
-				FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ipart())
-				{
-					DIRECT_A2D_ELEM(Iproj(), i, j) += DIRECT_A3D_ELEM(Ipart(), k, i, j);
-				}
-				Ipart = Iproj;
-			}
-			TIMING_TOC(TIMING_BOUNDARY);
+	// Now store all the particles information in the STAR file
+	ipos = 0;
+	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
+	{
+		TIMING_TIC(TIMING_REST);
+		FileName fn_img;
+		if (dimensionality == 3 && !do_project_3d)
+			fn_img.compose(fn_output_img_root, my_current_nr_images + ipos + 1, "mrc");
+		else
+			fn_img.compose(my_current_nr_images + ipos + 1, fn_output_img_root + ".mrcs"); // start image counting in stacks at 1!
+		if (do_movie_extract && fn_data == "")
+		{
+			FileName fn_part;
+			fn_part.compose(ipos + 1,  fn_oristack); // start image counting in stacks at 1!
+			// for automated re-alignment of particles in relion_refine: have rlnParticleName equal to rlnImageName in non-movie star file
+			MD.setValue(EMDL_PARTICLE_ORI_NAME, fn_part);
+		}
+		MD.setValue(EMDL_IMAGE_NAME, fn_img);
+		MD.setValue(EMDL_MICROGRAPH_NAME, fn_frame);
+		if (do_movie_extract)
+		{
+			MD.setValue(EMDL_PARTICLE_NR_FRAMES, movie_last_frame - movie_first_frame + 1);
+			MD.setValue(EMDL_PARTICLE_NR_FRAMES_AVG, avg_n_frames);
+		}
 
-			// performPerImageOperations will also append the particle to the output stack in fn_stack
-			// Jun24,2015 - Shaoda, extract helical segments
-			RFLOAT tilt_deg, psi_deg;
-			tilt_deg = psi_deg = 0.;
-			if (do_extract_helix) // If priors do not exist, errors will occur in 'readHelicalCoordinates()'.
+		// Also fill in the CTF parameters
+		if (star_has_ctf)
+		{
+			ctf.write(MD);
+			RFLOAT mag, dstep, maxres, fom;
+			if (MDmics.containsLabel(EMDL_CTF_MAGNIFICATION))
 			{
-				MD.getValue(EMDL_ORIENT_TILT_PRIOR, tilt_deg);
-				MD.getValue(EMDL_ORIENT_PSI_PRIOR, psi_deg);
+				MDmics.getValue(EMDL_CTF_MAGNIFICATION, mag, imic);
+				MD.setValue(EMDL_CTF_MAGNIFICATION, mag);
 			}
-
-			TIMING_TIC(TIMING_PRE_IMG_OPS);
-			performPerImageOperations(Ipart, fn_output_img_root, n_frames, my_current_nr_images + ipos, my_total_nr_images,
-					tilt_deg, psi_deg,
-					all_avg, all_stddev, all_minval, all_maxval);
-			TIMING_TOC(TIMING_PRE_IMG_OPS);
-
-
-			TIMING_TIC(TIMING_REST);
-			// Also store all the particles information in the STAR file
-			FileName fn_img;
-			if (Ipart().getDim() == 3)
-				fn_img.compose(fn_output_img_root, my_current_nr_images + ipos + 1, "mrc");
-			else
-				fn_img.compose(my_current_nr_images + ipos + 1, fn_output_img_root + ".mrcs"); // start image counting in stacks at 1!
-			if (do_movie_extract && fn_data == "")
+			if (MDmics.containsLabel(EMDL_CTF_DETECTOR_PIXEL_SIZE))
 			{
-				FileName fn_part;
-				fn_part.compose(ipos + 1,  fn_oristack); // start image counting in stacks at 1!
-				// for automated re-alignment of particles in relion_refine: have rlnParticleName equal to rlnImageName in non-movie star file
-				MD.setValue(EMDL_PARTICLE_ORI_NAME, fn_part);
+				MDmics.getValue(EMDL_CTF_DETECTOR_PIXEL_SIZE, dstep, imic);
+				if (do_rescale)
+					dstep *= (RFLOAT)extract_size/(RFLOAT)scale;
+				MD.setValue(EMDL_CTF_DETECTOR_PIXEL_SIZE, dstep);
 			}
-			MD.setValue(EMDL_IMAGE_NAME, fn_img);
-			MD.setValue(EMDL_MICROGRAPH_NAME, fn_frame);
-			if (do_movie_extract)
+			if (MDmics.containsLabel(EMDL_CTF_MAXRES))
 			{
-				MD.setValue(EMDL_PARTICLE_NR_FRAMES, movie_last_frame - movie_first_frame + 1);
-				MD.setValue(EMDL_PARTICLE_NR_FRAMES_AVG, avg_n_frames);
+				MDmics.getValue(EMDL_CTF_MAXRES, maxres, imic);
+				MD.setValue(EMDL_CTF_MAXRES, maxres);
 			}
-
-			// Also fill in the CTF parameters
-			if (star_has_ctf)
+			if (MDmics.containsLabel(EMDL_CTF_FOM))
 			{
-				ctf.write(MD);
-				RFLOAT mag, dstep, maxres, fom;
-				if (MDmics.containsLabel(EMDL_CTF_MAGNIFICATION))
-				{
-					MDmics.getValue(EMDL_CTF_MAGNIFICATION, mag, imic);
-					MD.setValue(EMDL_CTF_MAGNIFICATION, mag);
-				}
-				if (MDmics.containsLabel(EMDL_CTF_DETECTOR_PIXEL_SIZE))
-				{
-					MDmics.getValue(EMDL_CTF_DETECTOR_PIXEL_SIZE, dstep, imic);
-					if (do_rescale)
-						dstep *= (RFLOAT)extract_size/(RFLOAT)scale;
-					MD.setValue(EMDL_CTF_DETECTOR_PIXEL_SIZE, dstep);
-				}
-				if (MDmics.containsLabel(EMDL_CTF_MAXRES))
-				{
-					MDmics.getValue(EMDL_CTF_MAXRES, maxres, imic);
-					MD.setValue(EMDL_CTF_MAXRES, maxres);
-				}
-				if (MDmics.containsLabel(EMDL_CTF_FOM))
-				{
-					MDmics.getValue(EMDL_CTF_FOM, fom, imic);
-					MD.setValue(EMDL_CTF_FOM, fom);
-				}
+				MDmics.getValue(EMDL_CTF_FOM, fom, imic);
+				MD.setValue(EMDL_CTF_FOM, fom);
 			}
-			TIMING_TOC(TIMING_REST);
-
 		}
+		TIMING_TOC(TIMING_REST);
+
 		ipos++;
 	}
 
@@ -997,16 +996,22 @@ void Preprocessing::runOperateOnInputFile()
 	RFLOAT all_maxval = -LARGE_NUMBER;
 	init_progress_bar(Nimg);
 	int barstep = XMIPP_MAX(1, Nimg / 120);
+	// Each input stack is only opened once for all of its images
+	ImageStackReader stack_reader;
 	for (long int i = 0; i < Nimg; i++)
 	{
-		FileName fn_tmp;
+		FileName fn_tmp, fn_in_stack;
+		long int dump;
 
 		// Read in individual miages from the stack
 		Ipart.clear();
 		if (fn_operate_in.isStarFile())
 		{
 			MD.getValue(EMDL_IMAGE_NAME, fn_tmp);
-			Ipart.read(fn_tmp);
+			fn_tmp.decompose(dump, fn_in_stack);
+			if (fn_in_stack != stack_reader.fn_stack)
+				stack_reader.openStack(fn_in_stack);
+			Ipart.readFromStackReader(fn_tmp, stack_reader);
 
 			// Set the new name at this point in the MDtable, e.g. as 000001@out.mrcs
 			fn_tmp.compose(i+1,fn_stack);
@@ -1016,7 +1021,10 @@ void Preprocessing::runOperateOnInputFile()
 		}
 		else
 		{
-			Ipart.read(fn_operate_in, true, i);
+			if (!stack_reader.isOpen())
+				stack_reader.openStack(fn_operate_in);
+			fn_tmp.compose(i+1, fn_operate_in);
+			Ipart.readFromStackReader(fn_tmp, stack_reader);
 			// Set the new name at this point in the MDtable, e.g. as 000001@out.mrcs
 			fn_tmp.compose(i+1,fn_stack);
 			MD.addObject();
@@ -1043,18 +1051,160 @@ void Preprocessing::runOperateOnInputFile()
 }
 
 
-void Preprocessing::performPerImageOperations(
+void Preprocessing::readMicrograph(FileName fn_mic, Image<RFLOAT> &Imic)
+{
+	bool have_read = false;
+	if (is_prefetching)
+	{
+		pthread_join(prefetch_thread, NULL);
+		is_prefetching = false;
+		// If the background thread failed, the micrograph is read again below to report the error
+		if (prefetch_ok && fn_mic_prefetch == fn_mic)
+		{
+			// Take over the data of the prefetched micrograph without copying them
+			Imic.data.swap(Imic_prefetch.data);
+			Imic.MDMainHeader = Imic_prefetch.MDMainHeader;
+			have_read = true;
+		}
+		Imic_prefetch.clear();
+	}
+
+	if (!have_read)
+		Imic.read(fn_mic);
+
+	startReadingNextMicrograph();
+}
+
+void Preprocessing::startReadingNextMicrograph()
+{
+	if (fn_mic_next == "" || !exists(fn_mic_next))
+		return;
+
+	fn_mic_prefetch = fn_mic_next;
+	if (pthread_create(&prefetch_thread, NULL, globalThreadReadMicrograph, (void *)this) != 0)
+		REPORT_ERROR("Preprocessing::startReadingNextMicrograph ERROR: cannot create thread to read " + fn_mic_prefetch);
+	is_prefetching = true;
+}
+
+void Preprocessing::readMicrographInBackground()
+{
+	try
+	{
+		Imic_prefetch.read(fn_mic_prefetch);
+		prefetch_ok = true;
+	}
+	catch (RelionError XE)
+	{
+		prefetch_ok = false;
+	}
+}
+
+void Preprocessing::extractOneParticle(long int ipos, Image<RFLOAT> &Ipart)
+{
+	Image<RFLOAT> &Imic = *extract_Imic;
+	long int xpos = extract_xpos[ipos];
+	long int ypos = extract_ypos[ipos];
+	long int zpos = extract_zpos[ipos];
+	long int x0, xF, y0, yF, z0, zF;
+	x0 = xpos + FIRST_XMIPP_INDEX(extract_size);
+	xF = xpos + LAST_XMIPP_INDEX(extract_size);
+	y0 = ypos + FIRST_XMIPP_INDEX(extract_size);
+	yF = ypos + LAST_XMIPP_INDEX(extract_size);
+	z0 = zpos + FIRST_XMIPP_INDEX(extract_size);
+	zF = zpos + LAST_XMIPP_INDEX(extract_size);
+
+	// extract one particle in Ipart
+	if (dimensionality == 3)
+		Imic().window(Ipart(), z0, y0, x0, zF, yF, xF);
+	else
+		Imic().window(Ipart(), y0, x0, yF, xF);
+
+	// Check boundaries: fill pixels outside the boundary with the nearest ones inside
+	// This will create lines at the edges, rather than zeros
+	Ipart().setXmippOrigin();
+
+	// X-boundaries
+	if (x0 < 0 || xF >= XSIZE(Imic()) )
+	{
+		FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+		{
+			if (j + xpos < 0)
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, -xpos);
+			else if (j + xpos >= XSIZE(Imic()))
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, XSIZE(Imic()) - xpos - 1);
+		}
+	}
+
+	// Y-boundaries
+	if (y0 < 0 || yF >= YSIZE(Imic()))
+	{
+		FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+		{
+			if (i + ypos < 0)
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, -ypos, j);
+			else if (i + ypos >= YSIZE(Imic()))
+				A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, YSIZE(Imic()) - ypos - 1, j);
+		}
+	}
+
+	if (dimensionality == 3)
+	{
+		// Z-boundaries
+		if (z0 < 0 || zF >= ZSIZE(Imic()))
+		{
+			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+			{
+				if (k + zpos < 0)
+					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), -zpos, i, j);
+				else if (k + zpos >= ZSIZE(Imic()))
+					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), ZSIZE(Imic()) - zpos - 1, i, j);
+			}
+		}
+	}
+
+	//
+	if (dimensionality == 3 && do_project_3d)
+	{
+		// Project the 3D sub-tomogram into a 2D particle again
+		Image<RFLOAT> Iproj(YSIZE(Ipart()), XSIZE(Ipart()));
+		Iproj().setXmippOrigin();
+		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ipart())
+		{
+			DIRECT_A2D_ELEM(Iproj(), i, j) += DIRECT_A3D_ELEM(Ipart(), k, i, j);
+		}
+		Ipart = Iproj;
+	}
+
+	// Seed the noise of the dust removal by the micrograph and the particle number, so that it does not
+	// depend on which thread (or MPI process) extracts the particle
+	unsigned int dust_seed = (unsigned int)(extract_imic + 1) * 2654435761u + (unsigned int)(extract_first_image_nr + ipos + 1) * 40503u;
+	processOneImage(Ipart, extract_n_frames, extract_tilt_deg[ipos], extract_psi_deg[ipos], &dust_seed);
+}
+
+void Preprocessing::doThreadExtractParticles(int thread_id)
+{
+	try
+	{
+		size_t first_ipart, last_ipart;
+		while (extract_distributor->getTasks(first_ipart, last_ipart))
+		{
+			for (long int ipart = first_ipart; ipart <= last_ipart; ipart++)
+				extractOneParticle(extract_first_pos + ipart, extract_parts[ipart]);
+		}
+	}
+	catch (RelionError XE)
+	{
+		std::cerr << XE << std::endl << "In the thread that extracts particles" << std::endl;
+		exit(1);
+	}
+}
+
+void Preprocessing::processOneImage(
 		Image<RFLOAT> &Ipart,
-		FileName fn_output_img_root,
 		int nframes,
-		long int image_nr,
-		long int nr_of_images,
 		RFLOAT tilt_deg,
 		RFLOAT psi_deg,
-		RFLOAT &all_avg,
-		RFLOAT &all_stddev,
-		RFLOAT &all_minval,
-		RFLOAT &all_maxval)
+		unsigned int *dust_seed)
 {
 
 	Ipart().setXmippOrigin();
@@ -1071,7 +1221,7 @@ void Preprocessing::performPerImageOperations(
 		if (do_rescale)
 			bg_helical_radius *= scale / extract_size;
 		normalise(Ipart, bg_radius, white_dust_stddev, black_dust_stddev, do_ramp,
-				do_extract_helix, bg_helical_radius, tilt_deg, psi_deg);
+				do_extract_helix, bg_helical_radius, tilt_deg, psi_deg, dust_seed);
 	}
 	TIMING_TOC(TIMING_NORMALIZE);
 
@@ -1083,6 +1233,18 @@ void Preprocessing::performPerImageOperations(
 	if (nframes > 1)
 		Ipart() *= sqrt((RFLOAT)nframes/(RFLOAT)avg_n_frames);
 
+}
+
+void Preprocessing::writeOneImage(
+		Image<RFLOAT> &Ipart,
+		FileName fn_output_img_root,
+		long int image_nr,
+		long int nr_of_images,
+		RFLOAT &all_avg,
+		RFLOAT &all_stddev,
+		RFLOAT &all_minval,
+		RFLOAT &all_maxval)
+{
 	// Calculate mean, stddev, min and max
 	RFLOAT avg, stddev, minval, maxval;
 	TIMING_TIC(TIMING_COMP_STATS);
@@ -1125,16 +1287,38 @@ void Preprocessing::performPerImageOperations(
 
 		TIMING_TIC(TIMING_PER_IMG_OP_WRITE);
 		// Write this particle to the stack on disc
-		// First particle: write stack in overwrite mode, from then on just append to it
+		// First particle: start a new stack, from then on the particles are written in large batches in the background
 		if (image_nr == 0)
-			Ipart.write(fn_output_img_root+".mrcs", -1, (nr_of_images > 1), WRITE_OVERWRITE);
-		else
-			Ipart.write(fn_output_img_root+".mrcs", -1, false, WRITE_APPEND);
+			particle_writer.openStack(fn_output_img_root+".mrcs", (do_write_float16) ? Float16 : Float, 64, true);
+		particle_writer.writeImage(Ipart);
+		// Last particle: write the remaining particles and the header
+		if (image_nr == (nr_of_images - 1))
+		{
+			particle_writer.setStatistics(all_minval, all_maxval, all_avg, all_stddev);
+			particle_writer.closeStack();
+		}
 		TIMING_TOC(TIMING_PER_IMG_OP_WRITE);
 	}
 
 }
 
+void Preprocessing::performPerImageOperations(
+		Image<RFLOAT> &Ipart,
+		FileName fn_output_img_root,
+		int nframes,
+		long int image_nr,
+		long int nr_of_images,
+		RFLOAT tilt_deg,
+		RFLOAT psi_deg,
+		RFLOAT &all_avg,
+		RFLOAT &all_stddev,
+		RFLOAT &all_minval,
+		RFLOAT &all_maxval)
+{
+	processOneImage(Ipart, nframes, tilt_deg, psi_deg);
+	writeOneImage(Ipart, fn_output_img_root, image_nr, nr_of_images, all_avg, all_stddev, all_minval, all_maxval);
+}
+
 // Get the coordinate file from a given micrograph filename from MDdata
 MetaDataTable Preprocessing::getCoordinateMetaDataTable(FileName fn_mic)
 {
@@ -34,11 +34,29 @@
 #include "src/helix.h"
 #include <src/fftw.h>
 #include <src/time.h>
+#include "src/parallel.h"
 
 class Preprocessing
 {
 public:
 
+	Preprocessing()
+	{
+		extract_threads = NULL;
+		extract_distributor = NULL;
+		is_prefetching = prefetch_ok = false;
+	}
+
+	~Preprocessing()
+	{
+		if (is_prefetching)
+			pthread_join(prefetch_thread, NULL);
+		if (extract_threads != NULL)
+			delete extract_threads;
+		if (extract_distributor != NULL)
+			delete extract_distributor;
+	}
+
 	// I/O Parser
 	IOParser parser;
 
@@ -139,6 +157,33 @@ public:
 	// Perform contrast inversion of the extracted images
 	bool do_invert_contrast;
 
+	// Write the extracted particle stacks as 16-bit floats (MRC mode 12)
+	bool do_write_float16;
+
+	// Buffered writer of the output stack of the micrograph that is being extracted
+	ImageStackWriter particle_writer;
+
+	// Number of threads to process the particles of each micrograph in parallel
+	int nr_threads;
+
+	// The threads, and the micrograph and particles they are working on
+	ThreadManager *extract_threads;
+	ThreadTaskDistributor *extract_distributor;
+	Image<RFLOAT> *extract_Imic;
+	std::vector<long int> extract_xpos, extract_ypos, extract_zpos;
+	std::vector<RFLOAT> extract_tilt_deg, extract_psi_deg;
+	std::vector<Image<RFLOAT> > extract_parts;
+	long int extract_first_pos;
+	int extract_n_frames;
+	// The micrograph and the number of its first particle in this frame, to seed the noise of the dust removal
+	long int extract_imic, extract_first_image_nr;
+
+	// The next micrograph is read in a background thread while the particles of the current one are extracted
+	FileName fn_mic_next, fn_mic_prefetch;
+	Image<RFLOAT> Imic_prefetch;
+	pthread_t prefetch_thread;
+	bool is_prefetching, prefetch_ok;
+
 	// Standard deviations to remove black and white dust
 	RFLOAT white_dust_stddev, black_dust_stddev;
 
@@ -210,9 +255,45 @@ public:
 			long int &my_current_nr_images, long int my_total_nr_images,
 			RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval);
 
+	// Read a micrograph, or take it from the background thread if that already read it
+	void readMicrograph(FileName fn_mic, Image<RFLOAT> &Imic);
+
+	// Start reading fn_mic_next in a background thread
+	void startReadingNextMicrograph();
+
+	// Read fn_mic_prefetch into Imic_prefetch (this is run in a background thread)
+	void readMicrographInBackground();
+
+	// Window a single particle (ipos in the extract_ vectors) from the micrograph and perform the per-image operations on it
+	void extractOneParticle(long int ipos, Image<RFLOAT> &Ipart);
+
+	// Extract the particles extract_first_pos onwards into extract_parts, in parallel
+	void doThreadExtractParticles(int thread_id);
+
 	// Perform per-image operations (e.g. normalise, rescaling, rewindowing and inverting contrast) on an input stack (or STAR file)
 	void runOperateOnInputFile();
 
+	// Normalisation, re-scaling, re-windowing and contrast inversion of an individual image
+	// Jun24,2015 - Shaoda, extract helical segments
+	// If dust_seed is given, the noise of the dust removal is drawn with that seed instead of from the global random generator
+	void processOneImage(
+			Image<RFLOAT> &Ipart,
+			int nframes,
+			RFLOAT tilt_deg,
+			RFLOAT psi_deg,
+			unsigned int *dust_seed = NULL);
+
+	// Update the statistics of the stack and write an individual (processed) image to disc
+	void writeOneImage(
+			Image<RFLOAT> &Ipart,
+			FileName fn_output_img_root,
+			long int image_nr,
+			long int nr_of_images,
+			RFLOAT &all_avg,
+			RFLOAT &all_stddev,
+			RFLOAT &all_minval,
+			RFLOAT &all_maxval);
+
 	// Here normalisation, windowing etc is performed on an individual image and it is written to disc
 	// Jun24,2015 - Shaoda, extract helical segments
 	void performPerImageOperations(
@@ -92,6 +92,11 @@ void PreprocessingMpi::runExtractParticles()
 				if (verb > 0 && imic % barstep == 0)
 					progress_bar(imic);
 
+				// The next micrograph can already be read while extracting from this one
+				fn_mic_next = "";
+				if (!do_movie_extract && imic + 1 <= my_last_mic)
+					MDmics.getValue(EMDL_MICROGRAPH_NAME, fn_mic_next, imic + 1);
+
 				extractParticlesFromFieldOfView(fn_mic, imic);
 			}
 			imic++;
@@ -107,6 +107,7 @@ void Projector::computeFourierTransformMap(MultidimArray<RFLOAT> &vol_in, Multid
 	MultidimArray<Complex > Faux;
     FourierTransformer transformer;
     RFLOAT normfft;
+    transformer.setThreads(nr_threads);
 
 	// Size of padded real-space volume
 	int padoridim = ROUND(padding_factor * ori_size);
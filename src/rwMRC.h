@@ -203,7 +203,14 @@ int readMRC(long int img_select, bool isStack=false, const FileName &name="")
     data.setDimensions(_xDim, _yDim, _zDim, _nDim);
 
     DataType datatype;
-    switch ( header->mode%5 )
+    if (header->mode == 12)
+        datatype = Float16;
+    else if (header->mode == 101)
+    {
+        datatype = UInt4;
+        swap = 0; // single bytes have no byte order
+    }
+    else switch ( header->mode%5 )
     {
     case 0:
         datatype = UChar; // The image2010 web page says map-mode 0 is signed, but Jude's code interpretes the data as unsigned
@@ -257,8 +264,9 @@ int readMRC(long int img_select, bool isStack=false, const FileName &name="")
 
 /** MRC Writer
   * @ingroup MRC
+  * Data are written as Float (mode 2), Float16 (mode 12) or UInt4 (mode 101)
 */
-int writeMRC(long int img_select, bool isStack=false, int mode=WRITE_OVERWRITE)
+int writeMRC(long int img_select, bool isStack=false, int mode=WRITE_OVERWRITE, DataType datatype=Float)
 {
     MRChead*        header = (MRChead *) askMemory(sizeof(MRChead));
 
@@ -310,7 +318,11 @@ int writeMRC(long int img_select, bool isStack=false, int mode=WRITE_OVERWRITE)
     	header->nz = Zdim;
 
     // Convert T to datatype
-    if ( typeid(T) == typeid(RFLOAT) ||
+    if (datatype == Float16)
+        header->mode = 12;
+    else if (datatype == UInt4)
+        header->mode = 101;
+    else if ( typeid(T) == typeid(RFLOAT) ||
          typeid(T) == typeid(float) ||
          typeid(T) == typeid(int) )
         header->mode = 2;
@@ -419,7 +431,9 @@ int writeMRC(long int img_select, bool isStack=false, int mode=WRITE_OVERWRITE)
     offset = MRCSIZE + header->nsymbt;
     size_t datasize, datasize_n;
     datasize_n = Xdim*Ydim*Zdim;
-    datasize = datasize_n * gettypesize(Float);
+    if (datatype != Float16 && datatype != UInt4)
+        datatype = Float;
+    datasize = getPageSizeInFile(datatype);
 
     //#define DEBUG
 #ifdef DEBUG
@@ -458,7 +472,10 @@ int writeMRC(long int img_select, bool isStack=false, int mode=WRITE_OVERWRITE)
 
     if ( NSIZE(data) == 1 && mode==WRITE_OVERWRITE)
     {
-    	castPage2Datatype(MULTIDIM_ARRAY(data), fdata, Float, datasize_n);
+        if (datatype == UInt4)
+            packPageT24Bit(MULTIDIM_ARRAY(data), fdata, Zdim*Ydim);
+        else
+            castPage2Datatype(MULTIDIM_ARRAY(data), fdata, datatype, datasize_n);
         fwrite( fdata, datasize, 1, fimg );
     }
     else
@@ -471,7 +488,10 @@ int writeMRC(long int img_select, bool isStack=false, int mode=WRITE_OVERWRITE)
         }
         for ( size_t i =imgStart; i<imgEnd; i++ )
         {
-        	castPage2Datatype(MULTIDIM_ARRAY(data) + i*datasize_n, fdata, Float, datasize_n);
+            if (datatype == UInt4)
+                packPageT24Bit(MULTIDIM_ARRAY(data) + i*datasize_n, fdata, Zdim*Ydim);
+            else
+                castPage2Datatype(MULTIDIM_ARRAY(data) + i*datasize_n, fdata, datatype, datasize_n);
             fwrite( fdata, datasize, 1, fimg );
         }
     }